@@ -0,0 +1,128 @@
+#ifndef BLENDING_H
+#define BLENDING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////// ROW KERNELS /////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * How a source pixel is combined with the destination pixel beneath it
+ * Every mode except replace weights its result by the source alpha, so transparent pixels leave the destination unchanged
+ */
+typedef enum Blend_Mode {
+    BLEND_OVER,     // Normal alpha blending, the source is drawn on top
+    BLEND_MULTIPLY, // Color becomes src * dst, darkening
+    BLEND_SCREEN,   // Color becomes src + dst - src * dst, lightening
+    BLEND_ADDITIVE, // Color becomes dst + src, saturating, for glows and light
+    BLEND_DARKEN,   // Color becomes the darker of src and dst, per channel
+    BLEND_LIGHTEN,  // Color becomes the lighter of src and dst, per channel
+    BLEND_REPLACE,  // The source pixel replaces the destination pixel, alpha included
+    BLEND_OVER_LINEAR, // Like over, but the colors are blended in linear light, so antialiased edges and fades don't come out too dark
+    BLEND_MODE_COUNT
+} Blend_Mode;
+
+/*
+ * Signature shared by the row blending kernels
+ * Blends count RGBA pixels from src onto dst in place, both rows are tightly packed (4 bytes per pixel)
+ */
+typedef void (*Blend_Row_Function)(uint8_t* dst, const uint8_t* src, int count);
+
+/*
+ * Blends a row of RGBA pixels onto another using the source alpha, in place
+ * Uses 8 bit fixed point math, every channel becomes (src * alpha + dst * (255 - alpha)) / 255 rounded to nearest
+ * Dispatches to an AVX2 or SSE2 kernel when the CPU supports it, all kernels give bit identical output
+ */
+void blend_row_over(uint8_t* dst, const uint8_t* src, int count);
+
+/*
+ * Blends a row of premultiplied RGBA pixels onto another premultiplied row in place
+ * Every channel becomes src + dst * (255 - alpha) / 255 rounded to nearest, all kernels give bit identical output
+ */
+void blend_row_over_premultiplied(uint8_t* dst, const uint8_t* src, int count);
+
+/*
+ * Returns the over kernel matching the alpha representation of the source and destination rows
+ * Mixed representations use portable kernels which convert on the fly, matching representations use the SIMD kernels
+ */
+Blend_Row_Function get_blend_row_over(bool src_premultiplied, bool dst_premultiplied);
+
+/*
+ * Returns the kernel for the given blend mode matching the alpha representation of the source and destination rows
+ * Straight alpha destinations are treated like the over kernel does: the mode picks the color, the source alpha weighs it against the destination.
+ * Premultiplied destinations follow the standard separable blend mode formulas, which account for the destination alpha as well.
+ * Mixed representations convert the source on the fly, matching representations use the SIMD kernels.
+ * Every mode is its own specialized kernel, so nothing branches on the mode per pixel.
+ */
+Blend_Row_Function get_blend_row(Blend_Mode mode, bool src_premultiplied, bool dst_premultiplied);
+
+/*
+ * Computes the per channel factors which apply an opacity and an RGB tint to source pixels, for blend_row_modulated
+ * The tint is given as 0xRRGGBB and multiplies the colors, 0xFFFFFF leaves them unchanged. An opacity of 255 leaves the alpha unchanged.
+ * Premultiplied colors carry their alpha, so for premultiplied sources the opacity is folded into the color factors as well.
+ */
+void get_modulation_factors(uint8_t factors[4], uint8_t opacity, uint32_t tint, bool src_premultiplied);
+
+/*
+ * Blends a row like the given kernel, after multiplying every source channel by its factor out of 255
+ * The source is modulated a small chunk at a time into a buffer on the stack, which stays in cache until the kernel reads it back,
+ * so no modified copy of the source image is ever made. The source row is left unchanged.
+ */
+void blend_row_modulated(Blend_Row_Function blend_row, uint8_t* dst, const uint8_t* src, int count, const uint8_t factors[4]);
+
+/*
+ * Multiplies every channel of a row of RGBA pixels by its factor out of 255, from get_modulation_factors
+ * The rows may be the same row, to modulate in place
+ */
+void modulate_row(uint8_t* dst, const uint8_t* src, int count, const uint8_t factors[4]);
+
+/*
+ * Multiplies the alpha of every pixel of a row by its coverage out of 255, one byte per pixel in mask, and the colors too when premultiplied
+ * The rows may be the same row, to mask in place
+ */
+void mask_row(uint8_t* dst, const uint8_t* src, const uint8_t* mask, int count, bool premultiplied);
+
+/*
+ * Blends a row like the given kernel, after masking the source by the coverage and modulating it by the factors if there are any
+ * Masking first gives the same pixels as blending a copy of the source masked beforehand.
+ * Like blend_row_modulated, the source is prepared a small chunk at a time into a buffer on the stack and the source row is left unchanged.
+ */
+void blend_row_masked(Blend_Row_Function blend_row, uint8_t* dst, const uint8_t* src, const uint8_t* mask, int count, const uint8_t* factors, bool src_premultiplied);
+
+/*
+ * Fills a row with count copies of the given RGBA pixel
+ * Whole vectors are stored at a time when the CPU supports AVX2 or SSE2, so filling runs at memset speed
+ */
+void fill_row(uint8_t* dst, const uint8_t pixel[4], int count);
+
+/*
+ * Flattens a row of RGBA pixels onto an opaque matte color given as 0xRRGGBB and writes it as 32 bit BGRX pixels
+ * BGRX is the memory layout of the usual 24 and 32 bit TrueColor displays: blue, green, red, then an unused byte which is set to 255.
+ * The row is matted a small chunk at a time into a buffer on the stack and converted straight out of it, in a single pass over the source.
+ * Each chunk is read before it is written, so dst may be src to convert a row in place.
+ * An opaque matte looks the same in both alpha representations, so the over kernel of the source's representation does the matting.
+ */
+void matte_row_to_bgrx(uint8_t* dst, const uint8_t* src, int count, uint32_t matte, bool src_premultiplied);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////// LINEAR LIGHT /////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Lookup tables between sRGB encoded bytes and linear light out of 65535
+ * Decoding takes a byte, encoding takes the top 12 bits of a linear value, which is enough for every byte to survive the round trip
+ * and keeps the encode table at 4KB, small enough to stay in L1.
+ */
+typedef struct Linear_Light_Tables {
+    uint16_t srgb_to_linear[256];
+    uint8_t linear_to_srgb[4096];
+} Linear_Light_Tables;
+
+/*
+ * Returns the tables between sRGB bytes and 16 bit linear light, built once per process
+ */
+const Linear_Light_Tables* get_linear_light_tables();
+
+#endif // BLENDING_H
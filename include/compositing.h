@@ -3,7 +3,97 @@
 
 #include <png.h>
 #include <pthread.h>
+#include "blending.h"
 #include "png_image.h"
+#include "scaling.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////// LAYER OPTIONS ////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * How the edges and center of a nine slice layer fill the size they are drawn at
+ */
+typedef enum Slice_Fill {
+    SLICE_STRETCH, // Scale the edges and center to fit, sampled with the layer's filter
+    SLICE_TILE     // Repeat the edges and center unscaled, starting from their top left corner
+} Slice_Fill;
+
+/*
+ * Draws a layer at a new size, keeping the corners of its source unscaled while the edges and center fill the rest.
+ * Corners which do not fit in the size drawn are cut down, keeping their outer edges.
+ */
+typedef struct Nine_Slice {
+    int width;  // Size the layer is drawn at, zero sized draws the layer at the size of its source
+    int height;
+    int left;   // Width of the left corners and edge of the source, which are never scaled horizontally
+    int top;    // Height of the top corners and edge of the source, which are never scaled vertically
+    int right;  // Width of the right corners and edge of the source
+    int bottom; // Height of the bottom corners and edge of the source
+    Slice_Fill fill;
+} Nine_Slice;
+
+/*
+ * A 2x3 affine transform which maps the source of a layer onto the canvas, relative to the position the layer is pushed at.
+ * The source pixel edge at (u, v) lands at (x + a * u + c * v + tx, y + b * u + d * v + ty), so fractional tx and ty position a layer
+ * between pixels. An all zero transform draws the layer untransformed.
+ */
+typedef struct Layer_Transform {
+    double a, b; // Where one step right in the source goes on the canvas
+    double c, d; // Where one step down in the source goes on the canvas
+    double tx, ty; // Where the top left of the source goes on the canvas, in pixels which may be fractional
+} Layer_Transform;
+
+/*
+ * How a layer is drawn, beyond which image it draws and where
+ * Start from LAYER_OPTIONS_DEFAULT and change the fields you need, so code keeps compiling as options are added
+ */
+typedef struct Layer_Options {
+    Blend_Mode blend_mode; // How the layer's pixels are combined with the pixels below
+    uint8_t opacity; // Multiplies the alpha of every pixel, 255 draws the layer as is and 0 hides it
+    uint32_t tint; // Multiplies the colors of every pixel, as 0xRRGGBB. 0xFFFFFF leaves them unchanged
+    Image_Rect source; // Part of the image to draw, such as one icon of an atlas. Zero sized draws the whole image
+    Nine_Slice nine_slice; // Draws the source at another size without scaling its corners, zero sized draws it as is
+    Scale_Filter filter; // How the source is sampled wherever it is stretched or transformed
+    Layer_Transform transform; // Rotates, scales and moves the source by fractions of a pixel, all zero draws it as is. Replaces the nine slice when set
+    const PNG_Image* mask; // Its alpha multiplies the alpha of the layer, nothing is drawn outside of it. NULL draws the layer unmasked
+    int mask_x; // Where the top left of the mask goes on the canvas, relative to the position the layer is pushed at
+    int mask_y;
+} Layer_Options;
+
+// Options which draw a layer the way push_image_raw() does
+#define LAYER_OPTIONS_DEFAULT ((Layer_Options){.blend_mode = BLEND_OVER, .opacity = 255, .tint = 0xFFFFFF, .source = {0, 0, 0, 0}, .nine_slice = {0}, .filter = SCALE_NEAREST, .transform = {0}, \
+                                                 .mask = NULL, .mask_x = 0, .mask_y = 0})
+
+/*
+ * Returns the transform which scales the source around the given source point, then rotates it by the given angle in radians clockwise,
+ * and places that point at the given canvas offset from the layer's position. The offset may be fractional.
+ */
+Layer_Transform layer_transform_make(double origin_u, double origin_v, double scale_x, double scale_y, double radians, double offset_x, double offset_y);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////// COMPOSITE CONTEXTS //////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Handle to a compositing context, which owns an image stack, incremental flattening state and a retained scene
+ * The functions which do not take a context use a default context shared by the whole process
+ */
+typedef struct Composite_Context Composite_Context;
+
+/*
+ * Creates an independent compositing context with its own image stack, incremental state and retained scene.
+ * Contexts share nothing, so different threads can each build and flatten frames in their own context without waiting on each other.
+ * Returns NULL on failure.
+ */
+Composite_Context* composite_context_create();
+
+/*
+ * Deallocates a compositing context along with everything it still holds, including frames it returned and its retained layers.
+ * Images pushed to the context or drawn by its layers are not deallocated. Sets the given pointer to NULL.
+ * The context must not be in use by any other thread.
+ */
+void composite_context_destroy(Composite_Context** context_ptr);
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////// IMAGE FLATTENING ///////////////////////////////////////////////////////////////
@@ -18,23 +108,421 @@
  */
 void push_image_raw(const PNG_Image *const image, int x, int y);
 
+/*
+ * Same as push_image_raw(), but on the given context instead of the default one
+ */
+void context_push_image_raw(Composite_Context *const context, const PNG_Image *const image, int x, int y);
+
+/*
+ * Same as push_image_raw(), but the image is drawn with the given layer options, NULL for the defaults.
+ * The options are copied, so they do not need to outlive the call.
+ */
+void push_image_with_options(const PNG_Image *const image, int x, int y, const Layer_Options *const options);
+
+/*
+ * Same as push_image_with_options(), but on the given context instead of the default one
+ */
+void context_push_image_with_options(Composite_Context *const context, const PNG_Image *const image, int x, int y, const Layer_Options *const options);
+
+/*
+ * Same as push_image_raw(), but the image is drawn scaled to the given width and height, sampled with the given filter.
+ * The compositor samples the image while it blends it, so no scaled copy of the image is made. Layers in the same frame can use different filters.
+ */
+void push_image_scaled(const PNG_Image *const image, int x, int y, int width, int height, Scale_Filter filter);
+
+/*
+ * Same as push_image_scaled(), but on the given context instead of the default one
+ */
+void context_push_image_scaled(Composite_Context *const context, const PNG_Image *const image, int x, int y, int width, int height, Scale_Filter filter);
+
+/*
+ * Same as push_image_raw(), but the image is drawn through the given affine transform, sampled with the given filter.
+ * Every canvas pixel is mapped back into the image while compositing, so rotating, zooming or smoothly scrolling a layer never re-rasterizes it.
+ */
+void push_image_transformed(const PNG_Image *const image, int x, int y, const Layer_Transform *const transform, Scale_Filter filter);
+
+/*
+ * Same as push_image_transformed(), but on the given context instead of the default one
+ */
+void context_push_image_transformed(Composite_Context *const context, const PNG_Image *const image, int x, int y, const Layer_Transform *const transform, Scale_Filter filter);
+
+/*
+ * Same as push_image_raw(), but only the given rectangle of the image is drawn, with its top left corner at the given X & Y coordinates.
+ * Pixels are read straight out of the image, so icons packed into one atlas image never need to be copied into images of their own.
+ * The rectangle is clipped to the image.
+ */
+void push_image_region(const PNG_Image *const image, Image_Rect source, int x, int y);
+
+/*
+ * Same as push_image_region(), but on the given context instead of the default one
+ */
+void context_push_image_region(Composite_Context *const context, const PNG_Image *const image, Image_Rect source, int x, int y);
+
+/*
+ * Same as push_image_raw(), but the image is drawn as a nine slice at the size the given nine slice asks for.
+ * The corners are drawn unscaled and the edges and center are stretched or tiled while compositing, no scaled copy of the image is made.
+ */
+void push_image_nine_slice(const PNG_Image *const image, const Nine_Slice *const nine_slice, int x, int y);
+
+/*
+ * Same as push_image_nine_slice(), but on the given context instead of the default one
+ */
+void context_push_image_nine_slice(Composite_Context *const context, const PNG_Image *const image, const Nine_Slice *const nine_slice, int x, int y);
+
+/*
+ * Mark a rectangle of solid color, given as 0xRRGGBBAA, to be rendered by get_flattened_image().
+ * Fills are drawn straight into the frame and never allocate or hold pixels. Pushed last, a fill becomes the background and sets the size of the frame,
+ * in the alpha representation png_set_premultiplied_loading() asks for.
+ */
+void push_fill_rect(uint32_t rgba, int x, int y, int width, int height);
+
+/*
+ * Same as push_fill_rect(), but on the given context instead of the default one
+ */
+void context_push_fill_rect(Composite_Context *const context, uint32_t rgba, int x, int y, int width, int height);
+
+/*
+ * Same as push_fill_rect(), but the fill is drawn with the given layer options, NULL for the defaults.
+ * Source rectangles and nine slices do not apply to fills.
+ */
+void push_fill_rect_with_options(uint32_t rgba, int x, int y, int width, int height, const Layer_Options *const options);
+
+/*
+ * Same as push_fill_rect_with_options(), but on the given context instead of the default one
+ */
+void context_push_fill_rect_with_options(Composite_Context *const context, uint32_t rgba, int x, int y, int width, int height, const Layer_Options *const options);
+
+/*
+ * Restricts every image and fill pushed from now on to the given rectangle of the canvas, until the matching pop_clip_rect().
+ * Clip rectangles nest, a layer is drawn only where every clip active when it was pushed overlaps.
+ * Clipping costs nothing per pixel, the part of each layer to draw is worked out once when flattening, so a scrolled list can be pushed
+ * whole and only its visible part is composited. The background defines the frame and is never clipped. Clips stay active across flattens.
+ */
+void push_clip_rect(int x, int y, int width, int height);
+
+/*
+ * Same as push_clip_rect(), but on the given context instead of the default one
+ */
+void context_push_clip_rect(Composite_Context *const context, int x, int y, int width, int height);
+
+/*
+ * Ends the innermost clip rectangle, layers pushed from now on are only restricted by the clips around it.
+ * Does nothing if no clip rectangle is active.
+ */
+void pop_clip_rect();
+
+/*
+ * Same as pop_clip_rect(), but on the given context instead of the default one
+ */
+void context_pop_clip_rect(Composite_Context *const context);
+
 /*
  * Flattens all the images pushed prior to calling this function into a single image and resets the stack.
- * Any PNG_Images not pushed with push_image_raw will be deallocated when you call this function.
- * Returns a pointer to a newly created PNG_Image which is the result of layer all the pushed images on top of each other.
+ * Returns a new PNG_Image holding all the pushed images layered on top of each other, which the caller owns and destroys with
+ * png_destroy_image(). The pushed images are not deallocated.
  * The first image to be pushed will be the topmost layer, and the last image to be pushed will be the background layer.
+ * The result uses the alpha representation of the background layer, premultiplied layers compose correctly in any grouping.
+ * The display list of the last frame is kept, and once the same layers are pushed twice in a row the frame is kept as well.
+ * From then on pushing the same layers returns a copy of the kept frame without compositing. The first frame which differs
+ * drops the kept frame and is composited straight into the returned image, as are frames which differ every time.
  */
 PNG_Image* get_flattened_image();
 
+/*
+ * Same as get_flattened_image(), but on the given context instead of the default one
+ */
+PNG_Image* context_get_flattened_image(Composite_Context *const context);
+
+/*
+ * Flattens all the images pushed prior to calling this function into a buffer owned by the caller instead of a new PNG_Image, and resets the stack.
+ * The buffer holds width x height RGBA pixels, each row starting stride bytes after the previous one, and receives the alpha
+ * representation of the background layer. Only the part of the buffer the background covers is written, the rest is left untouched.
+ * Once a frame of similar size has been flattened no memory is allocated, so the buffer can be reused every frame.
+ * Returns false if there was nothing to flatten or the buffer is invalid, true otherwise.
+ */
+bool get_flattened_image_into(unsigned char* buffer, int width, int height, size_t stride);
+
+/*
+ * Same as get_flattened_image_into(), but on the given context instead of the default one
+ */
+bool context_get_flattened_image_into(Composite_Context *const context, unsigned char* buffer, int width, int height, size_t stride);
+
+/*
+ * Flattens all the images pushed prior to calling this function straight into a buffer in the display's BGRX layout, and resets the stack.
+ * The buffer holds width x height 32 bit pixels stored as blue, green, red and an unused byte, each row starting stride bytes after
+ * the previous one, such as the data of a 24 or 32 bit ZPixmap XImage. The frame is flattened onto the opaque matte color,
+ * given as 0xRRGGBB, on the way. Every tile is matted and converted while it is still in cache, so no RGBA frame is ever written.
+ * Only the part of the buffer the background covers is written, the rest is left untouched.
+ * Returns false if there was nothing to flatten or the buffer is invalid, true otherwise.
+ */
+bool get_flattened_image_into_bgrx(unsigned char* buffer, int width, int height, size_t stride, uint32_t matte);
+
+/*
+ * Same as get_flattened_image_into_bgrx(), but on the given context instead of the default one
+ */
+bool context_get_flattened_image_into_bgrx(Composite_Context *const context, unsigned char* buffer, int width, int height, size_t stride, uint32_t matte);
+
+/*
+ * Marks a region of the flattened image as changed, so the next flatten recomposites it.
+ * An asynchronous flatten takes the damage when it starts compositing, not when it is requested.
+ * Rarely needed: moved and swapped layers are found automatically, and so are images changed in place as long as they got a new generation.
+ */
+void add_damage_rect(int x, int y, int width, int height);
+
+/*
+ * Same as add_damage_rect(), but on the given context instead of the default one
+ */
+void context_add_damage_rect(Composite_Context *const context, int x, int y, int width, int height);
+
+/*
+ * Flattens all the images pushed prior to calling this function like get_flattened_image(), but only recomposites what changed.
+ * The previous flattened image is kept, and only regions damaged by add_damage_rect() or by layers which were added, removed,
+ * moved, swapped for another image or changed in place since the previous call are composited again.
+ * Layers are matched by identity, so adding or removing one layer anywhere in the stack only damages where that layer is drawn.
+ * Returns a pointer to the kept image, which is owned by the compositor and stays valid until the next call. Do not destroy it.
+ * If damage_rects and damage_count are given, they are set to the regions which changed, valid until the next call.
+ */
+const PNG_Image* get_flattened_image_incremental(const Image_Rect** damage_rects, int* damage_count);
+
+/*
+ * Same as get_flattened_image_incremental(), but on the given context instead of the default one
+ */
+const PNG_Image* context_get_flattened_image_incremental(Composite_Context *const context, const Image_Rect** damage_rects, int* damage_count);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////// ASYNC FLATTENING ///////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * A flatten running on the cpu thread pool, which can be polled, waited on, or left to deliver its image to a callback
+ */
+typedef struct Flatten_Handle Flatten_Handle;
+
+/*
+ * Receives the image of an asynchronous flatten on a pool thread, and owns it. The image is NULL if there was nothing to flatten.
+ */
+typedef void (*Flatten_Callback)(PNG_Image* image, void* user_data);
+
+/*
+ * Starts flattening all the images pushed prior to calling this function on the cpu thread pool and returns right away with a handle.
+ * The pushed images are taken off the stack before returning, so the next frame can be pushed while this one is composited.
+ * The result is the same image get_flattened_image() would return. If a callback is given it receives the image on a pool thread
+ * and owns it, NULL if there was nothing to flatten. Otherwise the image is collected from the handle with flatten_handle_wait().
+ * Flattens finish in the order they were requested. The pushed images must stay alive until the flatten is done.
+ * Returns NULL on failure, including when the thread pool cannot take the flatten, in which case the pushed images stay on the stack.
+ */
+Flatten_Handle* get_flattened_image_async(Flatten_Callback callback, void* user_data);
+
+/*
+ * Same as get_flattened_image_async(), but on the given context instead of the default one, which must outlive the flatten
+ */
+Flatten_Handle* context_get_flattened_image_async(Composite_Context *const context, Flatten_Callback callback, void* user_data);
+
+/*
+ * Returns true once the flatten is done, including its callback if it has one, false while it is still in progress. Never blocks.
+ */
+bool flatten_handle_poll(Flatten_Handle *const handle);
+
+/*
+ * Blocks until the flatten is done, then returns the flattened image, which the caller owns.
+ * Returns NULL if there was nothing to flatten, if a callback received the image, or if the image was already taken by an earlier call.
+ */
+PNG_Image* flatten_handle_wait(Flatten_Handle *const handle);
+
+/*
+ * Lets go of a flatten handle without waiting for it. Sets the given pointer to NULL.
+ * A flatten still in progress runs to completion and its callback is still called, an image nobody took is deallocated.
+ */
+void flatten_handle_destroy(Flatten_Handle** handle_ptr);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////// RETAINED LAYERS ////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Handle to a retained layer, which stays in the scene between frames until it is destroyed
+ */
+typedef struct Scene_Layer Scene_Layer;
+
+/*
+ * Creates a retained layer which draws the given image at the given X & Y coordinates until it is destroyed.
+ * Layers with a higher z are drawn on top of layers with a lower z, layers with the same z are drawn in creation order.
+ * The lowest visible layer is the background, which sets the size of the flattened scene and is drawn at (0, 0).
+ * The image is not deallocated by the layer and must outlive it. Returns NULL on failure.
+ */
+Scene_Layer* layer_create(const PNG_Image *const image, int x, int y, int z);
+
+/*
+ * Same as layer_create(), but on the given context instead of the default one
+ */
+Scene_Layer* context_layer_create(Composite_Context *const context, const PNG_Image *const image, int x, int y, int z);
+
+/*
+ * Creates a retained layer which fills a rectangle at the given X & Y coordinates with a solid color given as 0xRRGGBBAA until it is destroyed.
+ * The color is drawn straight into the frame, no pixels are ever allocated for it.
+ * As the background, the fill sets the size of the flattened scene, in the alpha representation png_set_premultiplied_loading() asks for.
+ * Returns NULL on failure.
+ */
+Scene_Layer* layer_create_fill(uint32_t rgba, int x, int y, int width, int height, int z);
+
+/*
+ * Same as layer_create_fill(), but on the given context instead of the default one
+ */
+Scene_Layer* context_layer_create_fill(Composite_Context *const context, uint32_t rgba, int x, int y, int width, int height, int z);
+
+/*
+ * Moves a retained layer so its top left corner is drawn at the given X & Y coordinates
+ */
+void layer_move(Scene_Layer *const layer, int x, int y);
+
+/*
+ * Changes the z order of a retained layer, layers with a higher z are drawn on top
+ */
+void layer_set_z(Scene_Layer *const layer, int z);
+
+/*
+ * Shows or hides a retained layer, hidden layers keep their place in the scene but are not drawn
+ */
+void layer_set_visible(Scene_Layer *const layer, bool visible);
+
+/*
+ * Swaps the image a retained layer draws, the image is not deallocated by the layer and must outlive it
+ */
+void layer_set_image(Scene_Layer *const layer, const PNG_Image *const image);
+
+/*
+ * Changes the color and size of a retained fill layer, layers which draw an image are left unchanged
+ */
+void layer_set_fill(Scene_Layer *const layer, uint32_t rgba, int width, int height);
+
+/*
+ * Changes how a retained layer is drawn, NULL restores the defaults. The options are copied.
+ */
+void layer_set_options(Scene_Layer *const layer, const Layer_Options *const options);
+
+/*
+ * Marks a retained layer as changed, so it is recomposited on the next flatten
+ * Only needed after the pixels of its image or mask were modified in place without giving it a new generation
+ */
+void layer_mark_changed(Scene_Layer *const layer);
+
+/*
+ * Removes a retained layer from the scene and deallocates it, the image it drew is not deallocated
+ * Sets the given pointer to NULL
+ */
+void layer_destroy(Scene_Layer** layer_ptr);
+
+/*
+ * Flattens every visible retained layer into a single image, recompositing only what changed since the last call.
+ * Returns a pointer to the flattened scene, which is owned by the compositor and stays valid until the next call. Do not destroy it.
+ * If damage_rects and damage_count are given, they are set to the regions which changed, valid until the next call.
+ * Returns NULL if no layer is visible.
+ */
+const PNG_Image* get_flattened_scene(const Image_Rect** damage_rects, int* damage_count);
+
+/*
+ * Same as get_flattened_scene(), but on the given context instead of the default one
+ */
+const PNG_Image* context_get_flattened_scene(Composite_Context *const context, const Image_Rect** damage_rects, int* damage_count);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////// GROUP LAYERS /////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Handle to a group of retained layers, flattened once into a cached surface which is drawn as a single layer
+ */
+typedef struct Layer_Group Layer_Group;
+
+/*
+ * Creates an empty group with a transparent surface of the given size, which is the area its children are clipped to.
+ * Children are added with layer_group_add_image and layer_group_add_fill, and changed or destroyed with the usual retained layer functions.
+ * The group is drawn with push_group, which flattens only the regions changed children touched since it was last drawn and then blends
+ * the cached surface as a single layer, so a widget built from many static sprites costs one blend per frame. Returns NULL on failure.
+ */
+Layer_Group* layer_group_create(int width, int height);
+
+/*
+ * Changes the size of the surface of a group, its children are flattened again on the next draw
+ */
+void layer_group_resize(Layer_Group *const group, int width, int height);
+
+/*
+ * Adds a child to a group which draws the given image at the given X & Y coordinates on the group's surface until it is destroyed.
+ * Children with a higher z are drawn on top, like retained layers. The image is not deallocated by the layer and must outlive it.
+ * Returns NULL on failure.
+ */
+Scene_Layer* layer_group_add_image(Layer_Group *const group, const PNG_Image *const image, int x, int y, int z);
+
+/*
+ * Adds a child to a group which fills a rectangle of the group's surface with a solid color given as 0xRRGGBBAA until it is destroyed.
+ * Returns NULL on failure.
+ */
+Scene_Layer* layer_group_add_fill(Layer_Group *const group, uint32_t rgba, int x, int y, int width, int height, int z);
+
+/*
+ * Returns the surface of a group, a premultiplied image holding every visible child, after flattening the regions which changed since the last call.
+ * An unchanged group costs nothing to bring up to date. A surface handed to an asynchronous flatten is never written to,
+ * if the group changed it gets a new surface instead. The surface is owned by the group and stays valid until the group
+ * is resized, changed while an asynchronous flatten reads the surface, or destroyed. Returns NULL on failure.
+ */
+const PNG_Image* layer_group_get_surface(Layer_Group *const group);
+
+/*
+ * Deallocates a group along with its surface and every child still in it, the images the children drew are not deallocated.
+ * Waits for asynchronous flattens which were handed the surface to be done with it. Handles to its children must not be used afterwards.
+ * Sets the given pointer to NULL.
+ */
+void layer_group_destroy(Layer_Group** group_ptr);
+
+/*
+ * Same as push_group(), but on the given context instead of the default one
+ */
+void context_push_group(Composite_Context *const context, Layer_Group *const group, int x, int y, const Layer_Options *const options);
+
+/*
+ * Pushes a group onto the image stack, drawn at the given X & Y coordinates with the given options, NULL for the defaults.
+ * The group is brought up to date first, then its cached surface is pushed like an image, so it is blended as a single layer.
+ * The group must not be resized or destroyed until the stack was flattened or handed to an asynchronous flatten.
+ * An asynchronous flatten keeps the surface it was handed, so the group can be changed and pushed again for the next frame right away.
+ */
+void push_group(Layer_Group *const group, int x, int y, const Layer_Options *const options);
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////// IMAGE MANIPULATION ///////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*
- * Blends an image with a specified background color by modifying the image's pixel data in place
- * Assumes pixels are represented as four consecutive bytes (RGBA: Red, Green, Blue, Alpha) in a flat array
- * Sets the opacity to full for every pixel
+ * Blends the given image onto the given canvas, dropping any pixels which fall out of bounds.
+ * Specified X & Y determine where the topleft corner of the image is drawn on the canvas.
+ * Returns a pointer to a newly created PNG_Image, the given canvas is left unchanged
  */
 PNG_Image* blend_images(const PNG_Image* const canvas, const PNG_Image* const image, int startX, int startY);
 
+/*
+ * Blends the given image onto the given canvas in place, dropping any pixels which fall out of bounds.
+ * Specified X & Y determine where the topleft corner of the image is drawn on the canvas.
+ * The canvas pixel data is modified directly, no new PNG_Image is allocated.
+ * The image may be in any pixel format, the canvas must be RGBA, other canvases are left unchanged.
+ */
+void blend_images_into(PNG_Image* const canvas, const PNG_Image* const image, int startX, int startY);
+
+/*
+ * Same as blend_images_into(), but the image is drawn with the given layer options, NULL for the defaults.
+ */
+void blend_images_into_with_options(PNG_Image* const canvas, const PNG_Image* const image, int startX, int startY, const Layer_Options *const options);
+
+/*
+ * Blends a rectangle of solid color given as 0xRRGGBBAA onto the canvas in place, clipped to the canvas.
+ * An opaque color is written at memset speed and nothing is allocated, which makes this the way to clear or matte a frame.
+ * The canvas must be RGBA, other canvases are left unchanged.
+ */
+void fill_rect_into(PNG_Image* const canvas, uint32_t rgba, int x, int y, int width, int height);
+
+/*
+ * Fills a rectangle of the canvas with a solid color given as 0xRRGGBBAA, drawn with the given layer options, NULL for the defaults.
+ * The color is drawn straight into the canvas, clipped to it, without allocating. Source rectangles and nine slices do not apply to fills.
+ */
+void fill_rect_into_with_options(PNG_Image* const canvas, uint32_t rgba, int x, int y, int width, int height, const Layer_Options *const options);
+
 #endif
\ No newline at end of file
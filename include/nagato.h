@@ -2,6 +2,7 @@
 #define NAGATO_H
 
 // Master header file
+#include "blending.h"
 #include "compositing.h"
 #include "key_constants.h"
 #include "logo.h"
@@ -1,16 +1,83 @@
 #ifndef PNG_IMAGE_H
 #define PNG_IMAGE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
-// Struct to represent an RGBA image
+// Struct to represent a rectangle of pixels, the top left corner is (x, y)
+typedef struct Image_Rect {
+    int x;
+    int y;
+    int width;
+    int height;
+} Image_Rect;
+
+// How the alpha of every pixel in a span compares to full opacity
+typedef enum Span_Kind {
+    SPAN_TRANSPARENT, // Every pixel has an alpha of 0
+    SPAN_OPAQUE,      // Every pixel has an alpha of 255
+    SPAN_PARTIAL      // Anything else, pixels need a full blend
+} Span_Kind;
+
+// Struct to represent a run of pixels within one row which share a Span_Kind
+typedef struct Image_Span {
+    int start;  // First column of the run
+    int length; // Number of pixels in the run
+    Span_Kind kind;
+} Image_Span;
+
+// Struct to represent the spans of every row of an image
+// The spans of row y are spans[row_starts[y]] up to but not including spans[row_starts[y + 1]]
+typedef struct Image_Span_Index {
+    int* row_starts; // height + 1 entries
+    Image_Span* spans;
+} Image_Span_Index;
+
+// How the pixels of an image are stored, rows are tightly packed in every format
+typedef enum Pixel_Format {
+    PIXEL_FORMAT_RGBA,    // 4 bytes per pixel: red, green, blue and alpha
+    PIXEL_FORMAT_A8,      // 1 byte per pixel: alpha only, the color is white, so a layer tint colors glyphs and masks
+    PIXEL_FORMAT_RGB565,  // 2 bytes per pixel: 5 bits of red, 6 of green and 5 of blue in a native endian uint16_t, always opaque
+    PIXEL_FORMAT_INDEXED, // 1 byte per pixel: an index into a palette of up to 256 RGBA colors
+    PIXEL_FORMAT_COUNT
+} Pixel_Format;
+
+// Struct to represent an image, RGBA unless it was loaded or converted into a compact format
 typedef struct PNG_Image {
     int width;      // Image width
     int height;     // Image height
     unsigned char* data; // Pointer to the image data
+    Pixel_Format format; // How the pixels in data are stored
+    uint8_t* palette; // 256 RGBA colors in the alpha representation of the image, NULL unless the format is indexed
+    bool premultiplied; // True when the RGB channels have already been multiplied by the alpha channel
+    Image_Rect opaque_region; // A rectangle known to be fully opaque, zero sized when none is known
+    Image_Span_Index* span_index; // Runs of transparent, opaque and partial pixels per row, NULL unless png_build_span_index was called
+    unsigned long generation; // Changes whenever the pixels change, never shared by two images or two versions of one image
 } PNG_Image;
 
+/*
+ * Sets whether images loaded or created from now on are converted to premultiplied alpha
+ * Off by default, premultiplied images composite with a cheaper blend and compose correctly in groups
+ */
+void png_set_premultiplied_loading(bool enabled);
+
+/*
+ * Returns true if images loaded or created from now on are converted to premultiplied alpha, false otherwise
+ */
+bool png_get_premultiplied_loading();
+
+/*
+ * Sets whether images loaded from now on keep a compact pixel format when it loses nothing
+ * Palette PNGs stay indexed, and images whose visible pixels are all white become A8 masks. Off by default, every image loads as RGBA.
+ */
+void png_set_compact_loading(bool enabled);
+
+/*
+ * Returns true if images loaded from now on keep a compact pixel format when it loses nothing, false otherwise
+ */
+bool png_get_compact_loading();
+
 /*
  * Loads a PNG image from a memory buffer into a custom PNG_Image structure
  */
@@ -26,11 +93,94 @@ PNG_Image* png_load_from_file(const char *const filepath);
  */
 PNG_Image* png_create_image(int width, int height, uint32_t rgba);
 
+/*
+ * Allocates a new PNG_Image structure without initializing its pixel data
+ * Meant for callers which are about to overwrite every pixel anyway
+ */
+PNG_Image* png_allocate_image(int width, int height, bool premultiplied);
+
 /*
  * Creates a deep copy of a PNG_Image assuming RGBA format
  */
 PNG_Image* png_copy_image(const PNG_Image *const source);
 
+/*
+ * Returns the number of bytes one pixel takes in the given format
+ */
+int png_bytes_per_pixel(Pixel_Format format);
+
+/*
+ * Converts the pixels of a PNG_Image to another format in place
+ * Converting to A8 keeps only the alpha, the color is left to the layer tint. Converting to RGB565 fails unless the image is opaque,
+ * and converting to indexed fails if the image has more than 256 distinct colors. Returns false on failure, leaving the image unchanged.
+ */
+bool png_convert_format(PNG_Image *const image, Pixel_Format format);
+
+/*
+ * Writes count pixels of row y of the image, starting at column x, as RGBA in the alpha representation of the image
+ * Every format has its own loop, so compact images are expanded a row at a time without branching per pixel
+ */
+void png_expand_row(const PNG_Image *const image, int x, int y, int count, uint8_t* out);
+
+/*
+ * Writes the pixels at the given indices of the image, each y * width + x, as RGBA in the alpha representation of the image
+ * Used by the scalers to sample compact images without expanding them first
+ */
+void png_gather_pixels(const PNG_Image *const image, const uint32_t* indices, int count, uint8_t* out);
+
+/*
+ * Converts a straight alpha PNG_Image to premultiplied alpha in place, does nothing if it is already premultiplied
+ */
+void png_premultiply_image(PNG_Image *const image);
+
+/*
+ * Converts a premultiplied alpha PNG_Image back to straight alpha in place, does nothing if it is already straight
+ */
+void png_unpremultiply_image(PNG_Image *const image);
+
+/*
+ * Recomputes the cached opaque region of a PNG_Image from its pixel data
+ * Loaders and png_create_image do this already, call it after writing to the pixel data directly
+ * Also gives the image a new generation, like png_mark_changed
+ */
+void png_update_opaque_region(PNG_Image *const image);
+
+/*
+ * Updates the cached opaque region of a PNG_Image after the pixels in the given rectangle changed, scanning only that rectangle.
+ * A fully opaque rectangle replaces the region when it is larger, otherwise the region is cut down to its largest part outside the rectangle.
+ * The result is always opaque but may be smaller than what png_update_opaque_region would find. Also gives the image a new generation.
+ */
+void png_update_opaque_region_rect(PNG_Image *const image, Image_Rect rect);
+
+/*
+ * Gives the image a new generation, so compositors which cached frames drawn from it draw it again
+ * Functions which modify an image in place do this already, as does png_update_opaque_region
+ */
+void png_mark_changed(PNG_Image *const image);
+
+/*
+ * Returns true if the cached opaque region of a PNG_Image covers the whole image, false otherwise
+ */
+bool png_is_opaque(const PNG_Image *const image);
+
+/*
+ * Builds and caches the span index of a PNG_Image, replacing any index it already had
+ * With an index the compositor skips transparent runs and copies opaque runs instead of blending them, which pays off for sprites and icons
+ * Call it again after writing to the pixel data directly. Returns false if the index could not be allocated.
+ */
+bool png_build_span_index(PNG_Image *const image);
+
+/*
+ * Rebuilds the span index of a PNG_Image for the given rows only, after their pixels changed. The spans of the other rows are moved, not rebuilt.
+ * Builds the whole index if the image has none yet. Returns false if the index could not be allocated, in which case the image is left without one.
+ */
+bool png_update_span_index_rows(PNG_Image *const image, int first_row, int row_count);
+
+/*
+ * Deallocates the span index of a PNG_Image, if it has one
+ */
+void png_discard_span_index(PNG_Image *const image);
+
 /*
  * Safely deallocate memory used by a PNG_Image structure, including its image data, and then the structure itself
  */
@@ -1,8 +1,33 @@
 #ifndef IMAGE_SCALING_H
 #define IMAGE_SCALING_H
 
+#include <stdint.h>
 #include "png_image.h"
 
+/*
+ * How a scaled image samples its source
+ */
+typedef enum Scale_Filter {
+    SCALE_NEAREST,  // Each pixel takes the source pixel nearest to its center, keeps pixel art sharp
+    SCALE_BILINEAR, // Each pixel blends the 4 source pixels around its center, smooths photos
+    SCALE_BILINEAR_LINEAR, // Like bilinear, but blended in linear light, so downscaled photos and soft edges don't come out darker
+    SCALE_FILTER_COUNT
+} Scale_Filter;
+
+/*
+ * Signature shared by the row samplers
+ * Writes count RGBA pixels of row dest_y of the source rectangle of the image scaled to dest_width x dest_height, starting at column dest_x.
+ * Only pixels inside the source rectangle are read, so parts of an atlas never bleed into each other.
+ */
+typedef void (*Scale_Row_Function)(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y, int count);
+
+/*
+ * Signature shared by the affine row samplers, which sample along any straight line through a source rectangle
+ * Writes count RGBA pixels, the first sampled at source position (u, v) and every next one du, dv further, all in 16.16 fixed point.
+ * Positions are relative to the top left of the source rectangle and address pixel centers at +0.5. Samples outside the rectangle are clamped to it.
+ */
+typedef void (*Affine_Row_Function)(uint8_t* out, const PNG_Image* image, Image_Rect source, int32_t u, int32_t v, int32_t du, int32_t dv, int count);
+
 /*
  * scales an image to a new width and height using nearest neighbor scaling
  * returns a newly created PNG_Image struct
@@ -17,4 +42,54 @@ PNG_Image* nearest_neighbor_scale(const PNG_Image *const orig, int new_width, in
  */
 PNG_Image* bilinear_interpolation_scale(const PNG_Image *const orig, int new_width, int new_height);
 
+/*
+ * Scales an image to a new width and height blending in linear light, sampling pixel centers like the compositor does
+ * Returns a newly created PNG_Image struct, in the alpha representation of the original, or NULL on failure
+ * Does not deallocate the original PNG_Image at all
+ */
+PNG_Image* bilinear_interpolation_scale_linear(const PNG_Image *const orig, int new_width, int new_height);
+
+/*
+ * Returns the source offset sampled by nearest neighbor scaling for an offset into a size scaled from src_size to dest_size pixels
+ * Samples the nearest pixel to the center of the destination pixel, in 16.16 fixed point
+ */
+int nearest_sample(int offset, int src_size, int dest_size);
+
+/*
+ * Samples a row of a scaled source rectangle taking the nearest pixel to the center of every destination pixel
+ * Reads RGBA sources, get_scale_row returns the samplers of compact formats
+ */
+void scale_row_nearest(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y, int count);
+
+/*
+ * Samples a row of a scaled source rectangle blending the 4 pixels around the center of every destination pixel
+ * Uses 16.16 fixed point positions and 8 bit weights, the edges of the source rectangle are clamped
+ */
+void scale_row_bilinear(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y, int count);
+
+/*
+ * Samples a row of a scaled source rectangle like scale_row_bilinear, blending the 4 pixels around every sample in linear light
+ * Downscaled photos and soft edges keep their brightness, at the cost of table lookups and a division per channel
+ */
+void scale_row_bilinear_linear(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y, int count);
+
+/*
+ * Scales a whole image to a new width and height with the row sampler of the given filter, sampling pixel centers like the compositor does
+ * Returns a newly created RGBA PNG_Image, in the alpha representation of the original, or NULL on failure
+ */
+PNG_Image* scale_image_by_rows(const PNG_Image *const orig, int new_width, int new_height, Scale_Filter filter);
+
+/*
+ * Returns the row sampler of the given filter for sources in the given pixel format, used by the compositor to scale layers while it blends them
+ * RGBA sources are read in place, compact sources are gathered a chunk at a time by samplers of their own, with bit identical output
+ */
+Scale_Row_Function get_scale_row(Scale_Filter filter, Pixel_Format format);
+
+/*
+ * Returns the affine row sampler of the given filter for sources in the given pixel format, used by the compositor to draw transformed layers
+ * Picks an AVX2 kernel which gathers 8 pixels at a time when the CPU supports it, all kernels give bit identical output.
+ * Compact sources are gathered a chunk at a time by samplers of their own, with output identical to their RGBA equivalent.
+ */
+Affine_Row_Function get_affine_row(Scale_Filter filter, Pixel_Format format);
+
 #endif // IMAGE_SCALING_H
@@ -0,0 +1,1406 @@
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include "blending.h"
+
+// SIMD kernels are only built for x86 with GCC compatible compilers, everything else uses the scalar kernels
+// Define NAGATO_NO_SIMD to force the scalar kernels, or NAGATO_NO_AVX2 to use the SSE2 kernels even on CPUs with AVX2
+#if !defined(NAGATO_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NAGATO_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Mixed representations are converted through a buffer of this many pixels on the stack
+#define CONVERT_CHUNK_PIXELS 64
+
+// Fastest kernel of every blend mode supported by this CPU, indexed by mode and then by whether both rows are premultiplied, picked once
+static Blend_Row_Function mode_kernels[BLEND_MODE_COUNT][2];
+static void (*modulate_kernel)(uint8_t*, const uint8_t*, int, const uint8_t*) = NULL; // Fastest modulation kernel supported by this CPU, picked once
+static void (*mask_kernel)(uint8_t*, const uint8_t*, const uint8_t*, int, bool) = NULL; // Fastest masking kernel supported by this CPU, picked once
+static void (*fill_kernel)(uint8_t*, const uint8_t*, int) = NULL; // Fastest span fill kernel supported by this CPU, picked once
+static void (*bgrx_kernel)(uint8_t*, const uint8_t*, int) = NULL; // Fastest RGBA to BGRX kernel supported by this CPU, picked once
+static pthread_once_t kernel_select_once = PTHREAD_ONCE_INIT; // Guards the kernel selection
+
+// Tables between sRGB bytes and linear light, built along with the kernel selection. The gathers of the AVX2 kernel read 4 bytes at a time,
+// so the encode table is followed by a few bytes of padding
+static struct {
+    Linear_Light_Tables tables;
+    uint8_t gather_padding[3];
+} linear_storage;
+static uint32_t unpremultiply_factors[256]; // 255 / alpha in 16.16 fixed point, to unpremultiply without dividing
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////// HELPER FUNCTIONS ///////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Divides a value in the range [0, 255 * 255] by 255, rounding to nearest
+ * Exact for that range, and uses the same shifts as the SIMD kernels so results are bit identical
+ */
+static inline uint32_t div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////// SCALAR KERNELS /////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Portable over kernel, also used for the leftover pixels of the SIMD kernels
+ */
+static void blend_row_over_scalar(uint8_t* dst, const uint8_t* src, int count) {
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        uint32_t alpha = src[3];
+        if (alpha == 0) continue; // Fully transparent, the destination is unchanged
+        if (alpha == 255) { // Fully opaque, the source replaces the destination
+            memcpy(dst, src, 4);
+            continue;
+        }
+        uint32_t inv_alpha = 255 - alpha;
+        dst[0] = div255(src[0] * alpha + dst[0] * inv_alpha);
+        dst[1] = div255(src[1] * alpha + dst[1] * inv_alpha);
+        dst[2] = div255(src[2] * alpha + dst[2] * inv_alpha);
+        dst[3] = div255(alpha * alpha + dst[3] * inv_alpha);
+    }
+}
+
+/*
+ * Portable premultiplied over kernel, every channel becomes src + dst * (255 - alpha) / 255
+ * Only one multiply per channel, since the source color already carries its alpha
+ */
+static void blend_row_over_premultiplied_scalar(uint8_t* dst, const uint8_t* src, int count) {
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        uint32_t alpha = src[3];
+        if (alpha == 0) continue; // Fully transparent, the destination is unchanged
+        if (alpha == 255) { // Fully opaque, the source replaces the destination
+            memcpy(dst, src, 4);
+            continue;
+        }
+        uint32_t inv_alpha = 255 - alpha;
+        for (int c = 0; c < 4; c++) {
+            uint32_t value = src[c] + div255(dst[c] * inv_alpha);
+            dst[c] = value > 255 ? 255 : value; // Saturate like the SIMD pack, only reachable with invalid premultiplied data
+        }
+    }
+}
+
+/*
+ * Straight alpha source onto a premultiplied destination
+ * The source is premultiplied on the fly, so the result stays premultiplied
+ */
+static void blend_row_over_straight_onto_premultiplied(uint8_t* dst, const uint8_t* src, int count) {
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        uint32_t alpha = src[3];
+        if (alpha == 0) continue; // Fully transparent, the destination is unchanged
+        if (alpha == 255) { // Fully opaque, the source replaces the destination
+            memcpy(dst, src, 4);
+            continue;
+        }
+        uint32_t inv_alpha = 255 - alpha;
+        dst[0] = div255(src[0] * alpha + dst[0] * inv_alpha);
+        dst[1] = div255(src[1] * alpha + dst[1] * inv_alpha);
+        dst[2] = div255(src[2] * alpha + dst[2] * inv_alpha);
+        dst[3] = alpha + div255(dst[3] * inv_alpha);
+    }
+}
+
+/*
+ * Premultiplied source onto a straight alpha destination
+ * The destination is premultiplied on the fly and divided back out, so the result stays straight
+ */
+static void blend_row_over_premultiplied_onto_straight(uint8_t* dst, const uint8_t* src, int count) {
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        uint32_t alpha = src[3];
+        if (alpha == 0) continue; // Fully transparent, the destination is unchanged
+        uint32_t inv_alpha = 255 - alpha;
+        uint32_t dst_alpha = dst[3];
+        uint32_t out_alpha = alpha + div255(dst_alpha * inv_alpha);
+        for (int c = 0; c < 3; c++) {
+            uint32_t premultiplied = src[c] + div255(div255(dst[c] * dst_alpha) * inv_alpha);
+            uint32_t value = (premultiplied * 255 + out_alpha / 2) / out_alpha;
+            dst[c] = value > 255 ? 255 : value;
+        }
+        dst[3] = out_alpha;
+    }
+}
+
+/*
+ * Replace kernel for rows sharing an alpha representation, the source is copied as is
+ */
+static void blend_row_replace(uint8_t* dst, const uint8_t* src, int count) {
+    memcpy(dst, src, (size_t)count * 4);
+}
+
+/*
+ * Converts a row of straight alpha pixels to premultiplied alpha, the same rounding png_premultiply_image uses
+ * Doubles as the replace kernel for a straight source onto a premultiplied destination
+ */
+static void premultiply_row(uint8_t* dst, const uint8_t* src, int count) {
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        uint32_t alpha = src[3];
+        dst[0] = div255(src[0] * alpha);
+        dst[1] = div255(src[1] * alpha);
+        dst[2] = div255(src[2] * alpha);
+        dst[3] = alpha;
+    }
+}
+
+/*
+ * Converts a row of premultiplied pixels to straight alpha, the same rounding png_unpremultiply_image uses
+ * Doubles as the replace kernel for a premultiplied source onto a straight destination
+ */
+static void unpremultiply_row(uint8_t* dst, const uint8_t* src, int count) {
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        uint32_t alpha = src[3];
+        for (int c = 0; c < 3; c++) {
+            uint32_t value = alpha == 0 ? 0 : (src[c] * 255 + alpha / 2) / alpha;
+            dst[c] = value > 255 ? 255 : value;
+        }
+        dst[3] = alpha;
+    }
+}
+
+/*
+ * Portable modulation kernel, multiplies every channel by its factor out of 255
+ */
+static void modulate_row_scalar(uint8_t* dst, const uint8_t* src, int count, const uint8_t* factors) {
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        dst[0] = div255(src[0] * factors[0]);
+        dst[1] = div255(src[1] * factors[1]);
+        dst[2] = div255(src[2] * factors[2]);
+        dst[3] = div255(src[3] * factors[3]);
+    }
+}
+
+/*
+ * Portable masking kernel, multiplies the alpha of every pixel by its coverage out of 255, and the colors too when they are premultiplied
+ */
+static void mask_row_scalar(uint8_t* dst, const uint8_t* src, const uint8_t* mask, int count, bool premultiplied) {
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        uint32_t coverage = mask[i];
+        uint32_t color = premultiplied ? coverage : 255;
+        dst[0] = div255(src[0] * color);
+        dst[1] = div255(src[1] * color);
+        dst[2] = div255(src[2] * color);
+        dst[3] = div255(src[3] * coverage);
+    }
+}
+
+/*
+ * Portable span fill kernel, writes the pixel count times
+ */
+static void fill_row_scalar(uint8_t* dst, const uint8_t* pixel, int count) {
+    uint32_t value;
+    memcpy(&value, pixel, 4);
+    for (int i = 0; i < count; i++) {
+        memcpy(dst + i * 4, &value, 4);
+    }
+}
+
+/*
+ * Portable RGBA to BGRX kernel, swaps red and blue and sets the unused byte to 255
+ */
+static void rgba_to_bgrx_scalar(uint8_t* dst, const uint8_t* src, int count) {
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        uint8_t red = src[0];
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = red;
+        dst[3] = 255;
+    }
+}
+
+/*
+ * Converts the source into the destination's alpha representation a chunk at a time, and blends each chunk with the given kernel
+ */
+static void blend_row_converted(uint8_t* dst, const uint8_t* src, int count, void (*convert)(uint8_t*, const uint8_t*, int), Blend_Row_Function kernel) {
+    uint8_t converted[CONVERT_CHUNK_PIXELS * 4];
+    for (int i = 0; i < count; i += CONVERT_CHUNK_PIXELS) {
+        int chunk = count - i < CONVERT_CHUNK_PIXELS ? count - i : CONVERT_CHUNK_PIXELS;
+        convert(converted, src + i * 4, chunk);
+        kernel(dst + i * 4, converted, chunk);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////// BLEND MODE KERNELS ///////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Every blend mode besides over and replace, as X(name, straight, premultiplied)
+ * The formulas are written once with the V_ primitives, which are defined below for plain integers and for SSE2 and AVX2 16 bit lanes,
+ * so each mode expands into its own scalar, SSE2 and AVX2 kernels with no per pixel branching on the mode.
+ * s and d are a source and destination channel, a and da the source and destination alpha, and ia is 255 - a.
+ * The straight formula gives the color channels, the alpha channel is blended like over so the modes only change color.
+ * The premultiplied formula is applied to all 4 channels, it is the standard separable blend mode formula in premultiplied form.
+ * Every intermediate value fits in 16 bits as long as premultiplied colors do not exceed their alpha.
+ */
+#define BLEND_MODES(X) \
+    X(multiply, \
+      V_DIV255(V_ADD(V_MUL(V_DIV255(V_MUL(s, d)), a), V_MUL(d, ia))), \
+      V_DIV255(V_ADD(V_ADD(V_MUL(s, V_SUB(V_255, da)), V_MUL(d, ia)), V_MUL(s, d)))) \
+    X(screen, \
+      V_DIV255(V_ADD(V_MUL(V_SUB(V_ADD(s, d), V_DIV255(V_MUL(s, d))), a), V_MUL(d, ia))), \
+      V_SUB(V_ADD(s, d), V_DIV255(V_MUL(s, d)))) \
+    X(additive, \
+      V_ADD(d, V_DIV255(V_MUL(s, a))), \
+      V_ADD(s, d)) \
+    X(darken, \
+      V_DIV255(V_ADD(V_MUL(V_MIN(s, d), a), V_MUL(d, ia))), \
+      V_DIV255(V_ADD(V_ADD(V_MIN(V_MUL(s, da), V_MUL(d, a)), V_MUL(s, V_SUB(V_255, da))), V_MUL(d, ia)))) \
+    X(lighten, \
+      V_DIV255(V_ADD(V_MUL(V_MAX(s, d), a), V_MUL(d, ia))), \
+      V_DIV255(V_ADD(V_ADD(V_MAX(V_MUL(s, da), V_MUL(d, a)), V_MUL(s, V_SUB(V_255, da))), V_MUL(d, ia))))
+
+// Plain integer primitives
+#define V_ADD(x, y) ((x) + (y))
+#define V_SUB(x, y) ((x) - (y))
+#define V_MUL(x, y) ((x) * (y))
+#define V_DIV255(x) div255(x)
+#define V_MIN(x, y) ((x) < (y) ? (x) : (y))
+#define V_MAX(x, y) ((x) > (y) ? (x) : (y))
+#define V_255 255u
+
+/*
+ * Portable kernels of one blend mode, also used for the leftover pixels of the SIMD kernels
+ * Straight pixels with no alpha and premultiplied pixels which are all zero leave the destination unchanged under every mode, so they are skipped
+ */
+#define DEFINE_SCALAR_MODE_KERNELS(name, straight, premultiplied) \
+static void blend_row_##name##_scalar(uint8_t* dst, const uint8_t* src, int count) { \
+    for (int i = 0; i < count; i++, dst += 4, src += 4) { \
+        uint32_t a = src[3]; \
+        if (a == 0) continue; \
+        uint32_t ia = 255 - a; \
+        for (int c = 0; c < 3; c++) { \
+            uint32_t s = src[c], d = dst[c]; \
+            uint32_t value = straight; \
+            dst[c] = value > 255 ? 255 : value; /* Saturate like the SIMD pack */ \
+        } \
+        dst[3] = div255(a * a + dst[3] * ia); \
+    } \
+} \
+static void blend_row_##name##_premultiplied_scalar(uint8_t* dst, const uint8_t* src, int count) { \
+    for (int i = 0; i < count; i++, dst += 4, src += 4) { \
+        uint32_t a = src[3], da = dst[3]; \
+        if ((src[0] | src[1] | src[2] | a) == 0) continue; \
+        uint32_t ia = 255 - a; \
+        (void)da; (void)ia; /* Not every formula needs both */ \
+        for (int c = 0; c < 4; c++) { \
+            uint32_t s = src[c], d = dst[c]; \
+            uint32_t value = premultiplied; \
+            dst[c] = value > 255 ? 255 : value; /* Saturate like the SIMD pack */ \
+        } \
+    } \
+}
+
+BLEND_MODES(DEFINE_SCALAR_MODE_KERNELS)
+
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV255
+#undef V_MIN
+#undef V_MAX
+#undef V_255
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////// SIMD KERNELS //////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef NAGATO_X86_SIMD
+
+/*
+ * Blends 2 pixels held as 16 bit channels, the SSE2 equivalent of the scalar per channel math
+ */
+__attribute__((target("sse2")))
+static inline __m128i over_sse2_16(__m128i s, __m128i d) {
+    // Broadcast each pixel's alpha across its 4 channels
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i inv_a = _mm_sub_epi16(_mm_set1_epi16(255), a);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, inv_a));
+    t = _mm_add_epi16(t, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/*
+ * SSE2 over kernel, blends 4 pixels per iteration
+ */
+__attribute__((target("sse2")))
+static void blend_row_over_sse2(uint8_t* dst, const uint8_t* src, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i alphas = _mm_and_si128(s, alpha_mask);
+        int opaque = _mm_movemask_epi8(_mm_cmpeq_epi32(alphas, alpha_mask));
+        if (opaque == 0xFFFF) { // All 4 pixels opaque
+            _mm_storeu_si128((__m128i*)(dst + i * 4), s);
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alphas, zero)) == 0xFFFF) continue; // All 4 pixels transparent
+
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+        __m128i lo = over_sse2_16(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = over_sse2_16(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    blend_row_over_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+/*
+ * Premultiplied over for 2 pixels held as 16 bit channels
+ */
+__attribute__((target("sse2")))
+static inline __m128i over_premultiplied_sse2_16(__m128i s, __m128i d) {
+    // Broadcast each pixel's alpha across its 4 channels
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i inv_a = _mm_sub_epi16(_mm_set1_epi16(255), a);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(d, inv_a), _mm_set1_epi16(128));
+    return _mm_add_epi16(s, _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8));
+}
+
+/*
+ * SSE2 premultiplied over kernel, blends 4 pixels per iteration
+ */
+__attribute__((target("sse2")))
+static void blend_row_over_premultiplied_sse2(uint8_t* dst, const uint8_t* src, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i alphas = _mm_and_si128(s, alpha_mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alphas, alpha_mask)) == 0xFFFF) { // All 4 pixels opaque
+            _mm_storeu_si128((__m128i*)(dst + i * 4), s);
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alphas, zero)) == 0xFFFF) continue; // All 4 pixels transparent
+
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+        __m128i lo = over_premultiplied_sse2_16(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = over_premultiplied_sse2_16(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    blend_row_over_premultiplied_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+/*
+ * Blends 4 pixels held as 16 bit channels, the AVX2 equivalent of the scalar per channel math
+ */
+__attribute__((target("avx2")))
+static inline __m256i over_avx2_16(__m256i s, __m256i d) {
+    // Broadcast each pixel's alpha across its 4 channels
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i inv_a = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, inv_a));
+    t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+/*
+ * AVX2 over kernel, blends 8 pixels per iteration
+ * Unpacking and packing both work within 128 bit lanes, so pixel order is preserved without any permutes
+ */
+__attribute__((target("avx2")))
+static void blend_row_over_avx2(uint8_t* dst, const uint8_t* src, int count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i alphas = _mm256_and_si256(s, alpha_mask);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alphas, alpha_mask)) == -1) { // All 8 pixels opaque
+            _mm256_storeu_si256((__m256i*)(dst + i * 4), s);
+            continue;
+        }
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alphas, zero)) == -1) continue; // All 8 pixels transparent
+
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4));
+        __m256i lo = over_avx2_16(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+        __m256i hi = over_avx2_16(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_packus_epi16(lo, hi));
+    }
+    // The SSE2 and scalar kernels taking the tail are not VEX encoded and would stall on dirty upper halves. The compiler does not clear
+    // them for calls between functions of different targets, so every AVX2 kernel does it before handing off.
+    _mm256_zeroupper();
+    blend_row_over_sse2(dst + i * 4, src + i * 4, count - i);
+}
+
+/*
+ * Premultiplied over for 4 pixels held as 16 bit channels
+ */
+__attribute__((target("avx2")))
+static inline __m256i over_premultiplied_avx2_16(__m256i s, __m256i d) {
+    // Broadcast each pixel's alpha across its 4 channels
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i inv_a = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(d, inv_a), _mm256_set1_epi16(128));
+    return _mm256_add_epi16(s, _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8));
+}
+
+/*
+ * AVX2 premultiplied over kernel, blends 8 pixels per iteration
+ */
+__attribute__((target("avx2")))
+static void blend_row_over_premultiplied_avx2(uint8_t* dst, const uint8_t* src, int count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i alphas = _mm256_and_si256(s, alpha_mask);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alphas, alpha_mask)) == -1) { // All 8 pixels opaque
+            _mm256_storeu_si256((__m256i*)(dst + i * 4), s);
+            continue;
+        }
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alphas, zero)) == -1) continue; // All 8 pixels transparent
+
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4));
+        __m256i lo = over_premultiplied_avx2_16(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+        __m256i hi = over_premultiplied_avx2_16(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_packus_epi16(lo, hi));
+    }
+    _mm256_zeroupper();
+    blend_row_over_premultiplied_sse2(dst + i * 4, src + i * 4, count - i);
+}
+
+/*
+ * Divides 16 bit lanes in the range [0, 255 * 255] by 255, rounding to nearest, like div255
+ */
+__attribute__((target("sse2")))
+static inline __m128i div255_sse2(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/*
+ * Broadcasts the alpha of each of the 2 pixels held as 16 bit channels across its 4 channels
+ */
+__attribute__((target("sse2")))
+static inline __m128i broadcast_alpha_sse2(__m128i v) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i div255_avx2(__m256i x) {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i broadcast_alpha_avx2(__m256i v) {
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+/*
+ * SSE2 modulation kernel, 4 pixels per iteration
+ */
+__attribute__((target("sse2")))
+static void modulate_row_sse2(uint8_t* dst, const uint8_t* src, int count, const uint8_t* factors) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i f = _mm_set_epi16(factors[3], factors[2], factors[1], factors[0], factors[3], factors[2], factors[1], factors[0]);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i lo = div255_sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), f));
+        __m128i hi = div255_sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), f));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    modulate_row_scalar(dst + i * 4, src + i * 4, count - i, factors);
+}
+
+/*
+ * AVX2 modulation kernel, 8 pixels per iteration
+ */
+__attribute__((target("avx2")))
+static void modulate_row_avx2(uint8_t* dst, const uint8_t* src, int count, const uint8_t* factors) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i f = _mm256_set_epi16(factors[3], factors[2], factors[1], factors[0], factors[3], factors[2], factors[1], factors[0],
+                                       factors[3], factors[2], factors[1], factors[0], factors[3], factors[2], factors[1], factors[0]);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i lo = div255_avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), f));
+        __m256i hi = div255_avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), f));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_packus_epi16(lo, hi));
+    }
+    _mm256_zeroupper();
+    modulate_row_sse2(dst + i * 4, src + i * 4, count - i, factors);
+}
+
+/*
+ * SSE2 masking kernel, 4 pixels per iteration
+ * Each coverage byte is spread over the 4 channels of its pixel, straight colors get a factor of 255 which leaves them unchanged
+ */
+__attribute__((target("sse2")))
+static void mask_row_sse2(uint8_t* dst, const uint8_t* src, const uint8_t* mask, int count, bool premultiplied) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i color_factors = premultiplied ? zero : _mm_set_epi16(0, 255, 255, 255, 0, 255, 255, 255);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        int32_t coverage;
+        memcpy(&coverage, mask + i, 4);
+        __m128i pairs = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(coverage), zero), zero); // Coverage in 32 bit lanes
+        pairs = _mm_or_si128(pairs, _mm_slli_epi32(pairs, 16)); // Copied into both 16 bit halves
+        __m128i f_lo = _mm_or_si128(_mm_unpacklo_epi32(pairs, pairs), color_factors);
+        __m128i f_hi = _mm_or_si128(_mm_unpackhi_epi32(pairs, pairs), color_factors);
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i lo = div255_sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), f_lo));
+        __m128i hi = div255_sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), f_hi));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    mask_row_scalar(dst + i * 4, src + i * 4, mask + i, count - i, premultiplied);
+}
+
+/*
+ * AVX2 masking kernel, 8 pixels per iteration
+ * The unpacks work within 128 bit lanes, so the low lane of the factors covers pixels 0, 1, 4, 5 and the high lane pixels 2, 3, 6, 7
+ */
+__attribute__((target("avx2")))
+static void mask_row_avx2(uint8_t* dst, const uint8_t* src, const uint8_t* mask, int count, bool premultiplied) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i color_factors = premultiplied ? zero : _mm256_set_epi16(0, 255, 255, 255, 0, 255, 255, 255, 0, 255, 255, 255, 0, 255, 255, 255);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i coverage = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(mask + i)), _mm_setzero_si128());
+        __m128i low_pairs = _mm_unpacklo_epi16(coverage, coverage); // Pixels 0 to 3, each in both halves of a 32 bit lane
+        __m128i high_pairs = _mm_unpackhi_epi16(coverage, coverage); // Pixels 4 to 7
+        __m256i f_lo = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi32(low_pairs, low_pairs)), _mm_unpacklo_epi32(high_pairs, high_pairs), 1);
+        __m256i f_hi = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpackhi_epi32(low_pairs, low_pairs)), _mm_unpackhi_epi32(high_pairs, high_pairs), 1);
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i lo = div255_avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), _mm256_or_si256(f_lo, color_factors)));
+        __m256i hi = div255_avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), _mm256_or_si256(f_hi, color_factors)));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_packus_epi16(lo, hi));
+    }
+    _mm256_zeroupper();
+    mask_row_sse2(dst + i * 4, src + i * 4, mask + i, count - i, premultiplied);
+}
+
+/*
+ * SSE2 span fill kernel, 4 pixels per store
+ */
+__attribute__((target("sse2")))
+static void fill_row_sse2(uint8_t* dst, const uint8_t* pixel, int count) {
+    int32_t value;
+    memcpy(&value, pixel, 4);
+    const __m128i v = _mm_set1_epi32(value);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128((__m128i*)(dst + i * 4), v);
+    }
+    fill_row_scalar(dst + i * 4, pixel, count - i);
+}
+
+/*
+ * AVX2 span fill kernel, 8 pixels per store
+ */
+__attribute__((target("avx2")))
+static void fill_row_avx2(uint8_t* dst, const uint8_t* pixel, int count) {
+    int32_t value;
+    memcpy(&value, pixel, 4);
+    const __m256i v = _mm256_set1_epi32(value);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), v);
+    }
+    _mm256_zeroupper();
+    fill_row_sse2(dst + i * 4, pixel, count - i);
+}
+
+/*
+ * SSE2 RGBA to BGRX kernel, 4 pixels per iteration
+ * Works on whole 32 bit pixels: green stays in place, red and blue are shifted across each other
+ */
+__attribute__((target("sse2")))
+static void rgba_to_bgrx_sse2(uint8_t* dst, const uint8_t* src, int count) {
+    const __m128i green = _mm_set1_epi32(0x0000FF00);
+    const __m128i low_byte = _mm_set1_epi32(0x000000FF);
+    const __m128i unused = _mm_set1_epi32((int)0xFF000000);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i red = _mm_slli_epi32(_mm_and_si128(v, low_byte), 16);
+        __m128i blue = _mm_and_si128(_mm_srli_epi32(v, 16), low_byte);
+        __m128i out = _mm_or_si128(_mm_or_si128(_mm_and_si128(v, green), unused), _mm_or_si128(red, blue));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), out);
+    }
+    rgba_to_bgrx_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+/*
+ * AVX2 RGBA to BGRX kernel, 8 pixels per iteration
+ */
+__attribute__((target("avx2")))
+static void rgba_to_bgrx_avx2(uint8_t* dst, const uint8_t* src, int count) {
+    const __m256i green = _mm256_set1_epi32(0x0000FF00);
+    const __m256i low_byte = _mm256_set1_epi32(0x000000FF);
+    const __m256i unused = _mm256_set1_epi32((int)0xFF000000);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i red = _mm256_slli_epi32(_mm256_and_si256(v, low_byte), 16);
+        __m256i blue = _mm256_and_si256(_mm256_srli_epi32(v, 16), low_byte);
+        __m256i out = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(v, green), unused), _mm256_or_si256(red, blue));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), out);
+    }
+    _mm256_zeroupper();
+    rgba_to_bgrx_sse2(dst + i * 4, src + i * 4, count - i);
+}
+
+// SSE2 primitives, the unsigned min and max are built from a saturating subtract since SSE2 has no unsigned 16 bit min or max
+#define V_ADD(x, y) _mm_add_epi16(x, y)
+#define V_SUB(x, y) _mm_sub_epi16(x, y)
+#define V_MUL(x, y) _mm_mullo_epi16(x, y)
+#define V_DIV255(x) div255_sse2(x)
+#define V_MIN(x, y) _mm_sub_epi16(x, _mm_subs_epu16(x, y))
+#define V_MAX(x, y) _mm_add_epi16(y, _mm_subs_epu16(x, y))
+#define V_255 _mm_set1_epi16(255)
+
+/*
+ * SSE2 kernels of one blend mode, 4 pixels per iteration
+ * Groups where the scalar kernel would skip every pixel are skipped as a whole
+ */
+#define DEFINE_SSE2_MODE_KERNELS(name, straight, premultiplied) \
+__attribute__((target("sse2"))) \
+static inline __m128i name##_sse2_16(__m128i s, __m128i d) { \
+    __m128i a = broadcast_alpha_sse2(s); \
+    __m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), a); \
+    __m128i color = straight; \
+    __m128i alpha = div255_sse2(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia))); \
+    const __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0); \
+    return _mm_or_si128(_mm_and_si128(alpha_lanes, alpha), _mm_andnot_si128(alpha_lanes, color)); \
+} \
+__attribute__((target("sse2"))) \
+static inline __m128i name##_premultiplied_sse2_16(__m128i s, __m128i d) { \
+    __m128i a = broadcast_alpha_sse2(s); \
+    __m128i da = broadcast_alpha_sse2(d); \
+    __m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), a); \
+    (void)da; (void)ia; \
+    return premultiplied; \
+} \
+__attribute__((target("sse2"))) \
+static void blend_row_##name##_sse2(uint8_t* dst, const uint8_t* src, int count) { \
+    const __m128i zero = _mm_setzero_si128(); \
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000); \
+    int i = 0; \
+    for (; i + 4 <= count; i += 4) { \
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4)); \
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alpha_mask), zero)) == 0xFFFF) continue; \
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4)); \
+        __m128i lo = name##_sse2_16(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero)); \
+        __m128i hi = name##_sse2_16(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero)); \
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi)); \
+    } \
+    blend_row_##name##_scalar(dst + i * 4, src + i * 4, count - i); \
+} \
+__attribute__((target("sse2"))) \
+static void blend_row_##name##_premultiplied_sse2(uint8_t* dst, const uint8_t* src, int count) { \
+    const __m128i zero = _mm_setzero_si128(); \
+    int i = 0; \
+    for (; i + 4 <= count; i += 4) { \
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4)); \
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) == 0xFFFF) continue; \
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4)); \
+        __m128i lo = name##_premultiplied_sse2_16(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero)); \
+        __m128i hi = name##_premultiplied_sse2_16(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero)); \
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi)); \
+    } \
+    blend_row_##name##_premultiplied_scalar(dst + i * 4, src + i * 4, count - i); \
+}
+
+BLEND_MODES(DEFINE_SSE2_MODE_KERNELS)
+
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV255
+#undef V_MIN
+#undef V_MAX
+#undef V_255
+
+// AVX2 primitives, the same operations on 256 bit registers
+#define V_ADD(x, y) _mm256_add_epi16(x, y)
+#define V_SUB(x, y) _mm256_sub_epi16(x, y)
+#define V_MUL(x, y) _mm256_mullo_epi16(x, y)
+#define V_DIV255(x) div255_avx2(x)
+#define V_MIN(x, y) _mm256_min_epu16(x, y)
+#define V_MAX(x, y) _mm256_max_epu16(x, y)
+#define V_255 _mm256_set1_epi16(255)
+
+/*
+ * AVX2 kernels of one blend mode, 8 pixels per iteration
+ */
+#define DEFINE_AVX2_MODE_KERNELS(name, straight, premultiplied) \
+__attribute__((target("avx2"))) \
+static inline __m256i name##_avx2_16(__m256i s, __m256i d) { \
+    __m256i a = broadcast_alpha_avx2(s); \
+    __m256i ia = _mm256_sub_epi16(_mm256_set1_epi16(255), a); \
+    __m256i color = straight; \
+    __m256i alpha = div255_avx2(_mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, ia))); \
+    return _mm256_blend_epi16(color, alpha, 0x88); /* Alpha is lane 3 of every pixel */ \
+} \
+__attribute__((target("avx2"))) \
+static inline __m256i name##_premultiplied_avx2_16(__m256i s, __m256i d) { \
+    __m256i a = broadcast_alpha_avx2(s); \
+    __m256i da = broadcast_alpha_avx2(d); \
+    __m256i ia = _mm256_sub_epi16(_mm256_set1_epi16(255), a); \
+    (void)da; (void)ia; \
+    return premultiplied; \
+} \
+__attribute__((target("avx2"))) \
+static void blend_row_##name##_avx2(uint8_t* dst, const uint8_t* src, int count) { \
+    const __m256i zero = _mm256_setzero_si256(); \
+    const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000); \
+    int i = 0; \
+    for (; i + 8 <= count; i += 8) { \
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4)); \
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(s, alpha_mask), zero)) == -1) continue; \
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4)); \
+        __m256i lo = name##_avx2_16(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero)); \
+        __m256i hi = name##_avx2_16(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero)); \
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_packus_epi16(lo, hi)); \
+    } \
+    _mm256_zeroupper(); \
+    blend_row_##name##_sse2(dst + i * 4, src + i * 4, count - i); \
+} \
+__attribute__((target("avx2"))) \
+static void blend_row_##name##_premultiplied_avx2(uint8_t* dst, const uint8_t* src, int count) { \
+    const __m256i zero = _mm256_setzero_si256(); \
+    int i = 0; \
+    for (; i + 8 <= count; i += 8) { \
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4)); \
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, zero)) == -1) continue; \
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4)); \
+        __m256i lo = name##_premultiplied_avx2_16(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero)); \
+        __m256i hi = name##_premultiplied_avx2_16(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero)); \
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_packus_epi16(lo, hi)); \
+    } \
+    _mm256_zeroupper(); \
+    blend_row_##name##_premultiplied_sse2(dst + i * 4, src + i * 4, count - i); \
+}
+
+BLEND_MODES(DEFINE_AVX2_MODE_KERNELS)
+
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV255
+#undef V_MIN
+#undef V_MAX
+#undef V_255
+
+#endif // NAGATO_X86_SIMD
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////// LINEAR LIGHT KERNELS //////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Fills the tables between sRGB bytes and 16 bit linear light with the exact sRGB transfer functions
+ * Every encode entry is the byte nearest the center of its 16 linear values, so every byte survives a round trip
+ */
+static void build_linear_light_tables() {
+    Linear_Light_Tables* tables = &linear_storage.tables;
+    for (int i = 0; i < 256; i++) {
+        double value = i / 255.0;
+        double linear = value <= 0.04045 ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+        tables->srgb_to_linear[i] = (uint16_t)lround(linear * 65535);
+        unpremultiply_factors[i] = i == 0 ? 0 : (255u * 65536 + i / 2) / i;
+    }
+    for (int i = 0; i < 4096; i++) {
+        double linear = (i + 0.5) / 4096;
+        double value = linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+        tables->linear_to_srgb[i] = (uint8_t)lround(value * 255);
+    }
+}
+
+/*
+ * Blends 2 linear light values with a 16 bit weight for the first, each product rounded down on its own so the AVX2 kernel can match it
+ */
+static inline uint32_t lerp_linear(uint32_t src, uint32_t dst, uint32_t weight) {
+    return ((src * weight) >> 16) + ((dst * (65535 - weight)) >> 16);
+}
+
+/*
+ * Portable linear light over kernel, also used for the leftover pixels of the AVX2 kernel
+ * Colors are decoded through the table, blended in linear light and encoded back, the alpha channel is blended exactly like the sRGB over kernel.
+ * Transparent and opaque pixels skip the lookups, so they give exactly what the sRGB kernel gives.
+ */
+static void blend_row_over_linear_scalar(uint8_t* dst, const uint8_t* src, int count) {
+    const uint16_t* decode = linear_storage.tables.srgb_to_linear;
+    const uint8_t* encode = linear_storage.tables.linear_to_srgb;
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        uint32_t alpha = src[3];
+        if (alpha == 0) continue;
+        if (alpha == 255) {
+            memcpy(dst, src, 4);
+            continue;
+        }
+        uint32_t weight = alpha * 257; // Out of 65535
+        dst[0] = encode[lerp_linear(decode[src[0]], decode[dst[0]], weight) >> 4];
+        dst[1] = encode[lerp_linear(decode[src[1]], decode[dst[1]], weight) >> 4];
+        dst[2] = encode[lerp_linear(decode[src[2]], decode[dst[2]], weight) >> 4];
+        dst[3] = div255(alpha * alpha + dst[3] * (255 - alpha));
+    }
+}
+
+/*
+ * Unpremultiplies a color channel with the reciprocal table, exact for opaque pixels and within one level of dividing otherwise
+ */
+static inline uint32_t unpremultiply_channel(uint32_t value, uint32_t alpha) {
+    uint32_t straight = (value * unpremultiply_factors[alpha] + 32768) >> 16;
+    return straight > 255 ? 255 : straight;
+}
+
+/*
+ * Returns the share of the resulting alpha which comes from the source alpha, out of 65535, using the reciprocal table
+ * The full 16 bits matter: near black a sliver of a bright destination still shows after encoding
+ */
+static inline uint32_t source_share(uint32_t alpha, uint32_t result) {
+    uint32_t share = (alpha * unpremultiply_factors[result] * 257 + 32768) >> 16; // Can't overflow, as alpha is at most result
+    return share > 65535 ? 65535 : share;
+}
+
+/*
+ * Portable linear light premultiplied over kernel, also used for the leftover pixels of the AVX2 kernel
+ * Premultiplied colors can't be decoded directly, so both are unpremultiplied on the way in. The source is weighted by its share of the resulting
+ * alpha, which is the alpha the sRGB premultiplied over kernel gives, and the result is premultiplied on the way out.
+ * Transparent source pixels leave the destination untouched, opaque ones and ones over transparency replace it.
+ */
+static void blend_row_over_linear_premultiplied_scalar(uint8_t* dst, const uint8_t* src, int count) {
+    const uint16_t* decode = linear_storage.tables.srgb_to_linear;
+    const uint8_t* encode = linear_storage.tables.linear_to_srgb;
+    for (int i = 0; i < count; i++, dst += 4, src += 4) {
+        uint32_t alpha = src[3], dst_alpha = dst[3];
+        if (alpha == 0) continue;
+        if (alpha == 255 || dst_alpha == 0) {
+            memcpy(dst, src, 4);
+            continue;
+        }
+        uint32_t result = alpha + div255(dst_alpha * (255 - alpha));
+        uint32_t weight = source_share(alpha, result);
+        for (int c = 0; c < 3; c++) {
+            uint32_t linear = lerp_linear(decode[unpremultiply_channel(src[c], alpha)], decode[unpremultiply_channel(dst[c], dst_alpha)], weight);
+            dst[c] = div255(encode[linear >> 4] * result);
+        }
+        dst[3] = result;
+    }
+}
+
+#ifdef NAGATO_X86_SIMD
+/*
+ * AVX2 linear light over kernel, 8 pixels per iteration with the table lookups done by gathers
+ * Groups of 8 pixels which are all transparent or opaque skip the lookups, so runs of them cost little more than with the sRGB kernel.
+ * Gives the same output as the portable kernel.
+ */
+__attribute__((target("avx2")))
+static void blend_row_over_linear_avx2(uint8_t* dst, const uint8_t* src, int count) {
+    const int* decode = (const int*)linear_storage.tables.srgb_to_linear;
+    const int* encode = (const int*)linear_storage.tables.linear_to_srgb;
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+    const __m256i low_half = _mm256_set1_epi32(0xFFFF);
+    const __m256i full_weight = _mm256_set1_epi32(65535);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4));
+        __m256i alpha = _mm256_srli_epi32(s, 24);
+        __m256i transparent = _mm256_cmpeq_epi32(alpha, _mm256_setzero_si256());
+        __m256i opaque = _mm256_cmpeq_epi32(alpha, byte);
+        int transparent_mask = _mm256_movemask_ps(_mm256_castsi256_ps(transparent));
+        int opaque_mask = _mm256_movemask_ps(_mm256_castsi256_ps(opaque));
+        if ((transparent_mask | opaque_mask) == 0xFF) {
+            if (opaque_mask) _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_blendv_epi8(d, s, opaque));
+            continue;
+        }
+
+        __m256i weight = _mm256_mullo_epi32(alpha, _mm256_set1_epi32(257));
+        __m256i inv_weight = _mm256_sub_epi32(full_weight, weight);
+        __m256i out = _mm256_setzero_si256();
+        // Decode both channels, blend them in linear light and encode the result, shift is the channel's bit offset
+#define LINEAR_CHANNEL_AVX2(shift) { \
+        __m256i src_linear = _mm256_and_si256(_mm256_i32gather_epi32(decode, _mm256_and_si256(_mm256_srli_epi32(s, shift), byte), 2), low_half); \
+        __m256i dst_linear = _mm256_and_si256(_mm256_i32gather_epi32(decode, _mm256_and_si256(_mm256_srli_epi32(d, shift), byte), 2), low_half); \
+        __m256i linear = _mm256_add_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(src_linear, weight), 16), \
+                                          _mm256_srli_epi32(_mm256_mullo_epi32(dst_linear, inv_weight), 16)); \
+        __m256i encoded = _mm256_and_si256(_mm256_i32gather_epi32(encode, _mm256_srli_epi32(linear, 4), 1), byte); \
+        out = _mm256_or_si256(out, _mm256_slli_epi32(encoded, shift)); \
+    }
+        LINEAR_CHANNEL_AVX2(0)
+        LINEAR_CHANNEL_AVX2(8)
+        LINEAR_CHANNEL_AVX2(16)
+#undef LINEAR_CHANNEL_AVX2
+
+        // Alpha like the sRGB kernel, a * a + da * (255 - a) divided by 255
+        __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(alpha, alpha), _mm256_mullo_epi32(_mm256_srli_epi32(d, 24), _mm256_sub_epi32(byte, alpha)));
+        t = _mm256_add_epi32(t, _mm256_set1_epi32(128));
+        t = _mm256_srli_epi32(_mm256_add_epi32(t, _mm256_srli_epi32(t, 8)), 8);
+        out = _mm256_or_si256(out, _mm256_slli_epi32(t, 24));
+
+        out = _mm256_blendv_epi8(out, s, opaque);
+        out = _mm256_blendv_epi8(out, d, transparent);
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), out);
+    }
+    _mm256_zeroupper();
+    blend_row_over_linear_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+/*
+ * Like unpremultiply_channel for 8 channels, with the reciprocals already gathered
+ */
+__attribute__((target("avx2")))
+static inline __m256i unpremultiply_channel_avx2(__m256i value, __m256i factor) {
+    __m256i straight = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(value, factor), _mm256_set1_epi32(32768)), 16);
+    return _mm256_min_epu32(straight, _mm256_set1_epi32(255));
+}
+
+/*
+ * AVX2 linear light premultiplied over kernel, 8 pixels per iteration with the reciprocals and table lookups done by gathers
+ * Groups of 8 pixels which are all transparent, opaque or over transparency skip the lookups. Gives the same output as the portable kernel.
+ */
+__attribute__((target("avx2")))
+static void blend_row_over_linear_premultiplied_avx2(uint8_t* dst, const uint8_t* src, int count) {
+    const int* decode = (const int*)linear_storage.tables.srgb_to_linear;
+    const int* encode = (const int*)linear_storage.tables.linear_to_srgb;
+    const int* factors = (const int*)unpremultiply_factors;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+    const __m256i low_half = _mm256_set1_epi32(0xFFFF);
+    const __m256i rounding = _mm256_set1_epi32(128);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4));
+        __m256i alpha = _mm256_srli_epi32(s, 24);
+        __m256i dst_alpha = _mm256_srli_epi32(d, 24);
+        __m256i transparent = _mm256_cmpeq_epi32(alpha, zero);
+        __m256i replaces = _mm256_andnot_si256(transparent, _mm256_or_si256(_mm256_cmpeq_epi32(alpha, byte), _mm256_cmpeq_epi32(dst_alpha, zero)));
+        int transparent_mask = _mm256_movemask_ps(_mm256_castsi256_ps(transparent));
+        int replaces_mask = _mm256_movemask_ps(_mm256_castsi256_ps(replaces));
+        if ((transparent_mask | replaces_mask) == 0xFF) {
+            if (replaces_mask) _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_blendv_epi8(d, s, replaces));
+            continue;
+        }
+
+        // Resulting alpha like the sRGB kernel, a + da * (255 - a) / 255, and the source's share of it
+        __m256i result = _mm256_add_epi32(_mm256_mullo_epi32(dst_alpha, _mm256_sub_epi32(byte, alpha)), rounding);
+        result = _mm256_add_epi32(alpha, _mm256_srli_epi32(_mm256_add_epi32(result, _mm256_srli_epi32(result, 8)), 8));
+        __m256i weight = _mm256_mullo_epi32(_mm256_mullo_epi32(alpha, _mm256_i32gather_epi32(factors, result, 4)), _mm256_set1_epi32(257));
+        weight = _mm256_min_epu32(_mm256_srli_epi32(_mm256_add_epi32(weight, _mm256_set1_epi32(32768)), 16), _mm256_set1_epi32(65535)); // Like source_share
+        __m256i inv_weight = _mm256_sub_epi32(_mm256_set1_epi32(65535), weight);
+        __m256i src_factor = _mm256_i32gather_epi32(factors, alpha, 4);
+        __m256i dst_factor = _mm256_i32gather_epi32(factors, dst_alpha, 4);
+        __m256i out = _mm256_slli_epi32(result, 24);
+        // Unpremultiply and decode both channels, blend them in linear light, then encode and premultiply the result
+#define LINEAR_PREMULTIPLIED_CHANNEL_AVX2(shift) { \
+        __m256i src_straight = unpremultiply_channel_avx2(_mm256_and_si256(_mm256_srli_epi32(s, shift), byte), src_factor); \
+        __m256i dst_straight = unpremultiply_channel_avx2(_mm256_and_si256(_mm256_srli_epi32(d, shift), byte), dst_factor); \
+        __m256i src_linear = _mm256_and_si256(_mm256_i32gather_epi32(decode, src_straight, 2), low_half); \
+        __m256i dst_linear = _mm256_and_si256(_mm256_i32gather_epi32(decode, dst_straight, 2), low_half); \
+        __m256i linear = _mm256_add_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(src_linear, weight), 16), \
+                                          _mm256_srli_epi32(_mm256_mullo_epi32(dst_linear, inv_weight), 16)); \
+        __m256i encoded = _mm256_and_si256(_mm256_i32gather_epi32(encode, _mm256_srli_epi32(linear, 4), 1), byte); \
+        __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(encoded, result), rounding); \
+        t = _mm256_srli_epi32(_mm256_add_epi32(t, _mm256_srli_epi32(t, 8)), 8); \
+        out = _mm256_or_si256(out, _mm256_slli_epi32(t, shift)); \
+    }
+        LINEAR_PREMULTIPLIED_CHANNEL_AVX2(0)
+        LINEAR_PREMULTIPLIED_CHANNEL_AVX2(8)
+        LINEAR_PREMULTIPLIED_CHANNEL_AVX2(16)
+#undef LINEAR_PREMULTIPLIED_CHANNEL_AVX2
+
+        out = _mm256_blendv_epi8(out, s, replaces);
+        out = _mm256_blendv_epi8(out, d, transparent);
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), out);
+    }
+    _mm256_zeroupper();
+    blend_row_over_linear_premultiplied_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+/*
+ * Decodes the colors of 2 pixels through the table into 16 bit lanes, one lane per channel. The alpha lanes are left 0.
+ * SSE2 has no gathers, so each lookup is inserted on its own, which keeps the values in registers instead of reloading them from memory.
+ */
+__attribute__((target("sse2")))
+static inline __m128i decode_2_pixels_sse2(const uint8_t* channels, const uint16_t* decode) {
+    __m128i linear = _mm_cvtsi32_si128(decode[channels[0]]);
+    linear = _mm_insert_epi16(linear, decode[channels[1]], 1);
+    linear = _mm_insert_epi16(linear, decode[channels[2]], 2);
+    linear = _mm_insert_epi16(linear, decode[channels[4]], 4);
+    linear = _mm_insert_epi16(linear, decode[channels[5]], 5);
+    linear = _mm_insert_epi16(linear, decode[channels[6]], 6);
+    return linear;
+}
+
+/*
+ * Blends the linear light channels of 2 pixels like lerp_linear with a weight per lane, and encodes the colors into the given vector,
+ * whose alpha lanes are kept. The high multiply rounds each product down on its own, exactly like the portable kernel.
+ */
+__attribute__((target("sse2")))
+static inline __m128i lerp_encode_2_pixels_sse2(__m128i src_linear, __m128i dst_linear, __m128i weight, __m128i out, const uint8_t* encode) {
+    __m128i inv_weight = _mm_xor_si128(weight, _mm_set1_epi16(-1)); // 65535 - weight
+    __m128i linear = _mm_add_epi16(_mm_mulhi_epu16(src_linear, weight), _mm_mulhi_epu16(dst_linear, inv_weight));
+    uint16_t indices[8];
+    _mm_storeu_si128((__m128i*)indices, _mm_srli_epi16(linear, 4));
+    out = _mm_insert_epi16(out, encode[indices[0]], 0);
+    out = _mm_insert_epi16(out, encode[indices[1]], 1);
+    out = _mm_insert_epi16(out, encode[indices[2]], 2);
+    out = _mm_insert_epi16(out, encode[indices[4]], 4);
+    out = _mm_insert_epi16(out, encode[indices[5]], 5);
+    out = _mm_insert_epi16(out, encode[indices[6]], 6);
+    return out;
+}
+
+/*
+ * SSE2 linear light over kernel, 4 pixels per iteration
+ * Groups of 4 pixels which are all transparent or opaque are handled in vectors, which is where most pixels of sprites and text are.
+ * Without gathers the six lookups per pixel cost far more than the blend itself, so mixed groups go through the portable kernel,
+ * which measured faster than feeding the lookups into vectors. Gives the same output as the portable kernel.
+ */
+__attribute__((target("sse2")))
+static void blend_row_over_linear_sse2(uint8_t* dst, const uint8_t* src, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i byte = _mm_set1_epi32(0xFF);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i alpha = _mm_srli_epi32(s, 24);
+        __m128i transparent = _mm_cmpeq_epi32(alpha, zero);
+        __m128i opaque = _mm_cmpeq_epi32(alpha, byte);
+        int transparent_mask = _mm_movemask_ps(_mm_castsi128_ps(transparent));
+        int opaque_mask = _mm_movemask_ps(_mm_castsi128_ps(opaque));
+        if ((transparent_mask | opaque_mask) != 0xF) {
+            blend_row_over_linear_scalar(dst + i * 4, src + i * 4, 4);
+        } else if (opaque_mask) {
+            __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+            _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_and_si128(opaque, s), _mm_andnot_si128(opaque, d)));
+        }
+    }
+    blend_row_over_linear_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+/*
+ * Like unpremultiply_channel for the 16 bit channels of 2 pixels, with the 16.16 reciprocals split into their high and low halves per lane
+ * The product is rebuilt from the halves, carrying the rounding bit of the low half, so it matches the 32 bit math exactly
+ */
+__attribute__((target("sse2")))
+static inline __m128i unpremultiply_2_pixels_sse2(__m128i value, __m128i factor_high, __m128i factor_low) {
+    __m128i low = _mm_mullo_epi16(value, factor_low);
+    __m128i straight = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(value, factor_high), _mm_mulhi_epu16(value, factor_low)), _mm_srli_epi16(low, 15));
+    return _mm_sub_epi16(straight, _mm_subs_epu16(straight, _mm_set1_epi16(255))); // Clamped to 255
+}
+
+/*
+ * SSE2 linear light premultiplied over kernel, 4 pixels per iteration
+ * Unpremultiplying, the blends in linear light and premultiplying the result are done 16 bits per lane, the table lookups stay scalar.
+ * Groups of 4 pixels which are all transparent, opaque or over transparency skip the lookups. Gives the same output as the portable kernel.
+ */
+__attribute__((target("sse2")))
+static void blend_row_over_linear_premultiplied_sse2(uint8_t* dst, const uint8_t* src, int count) {
+    const uint16_t* decode = linear_storage.tables.srgb_to_linear;
+    const uint8_t* encode = linear_storage.tables.linear_to_srgb;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i byte = _mm_set1_epi32(0xFF);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+        __m128i alpha = _mm_srli_epi32(s, 24);
+        __m128i transparent = _mm_cmpeq_epi32(alpha, zero);
+        __m128i replaces = _mm_andnot_si128(transparent, _mm_or_si128(_mm_cmpeq_epi32(alpha, byte), _mm_cmpeq_epi32(_mm_srli_epi32(d, 24), zero)));
+        int transparent_mask = _mm_movemask_ps(_mm_castsi128_ps(transparent));
+        int replaces_mask = _mm_movemask_ps(_mm_castsi128_ps(replaces));
+        if ((transparent_mask | replaces_mask) == 0xF) {
+            if (replaces_mask) _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_and_si128(replaces, s), _mm_andnot_si128(replaces, d)));
+            continue;
+        }
+
+        // Resulting alpha like the sRGB kernel and the source's share of it, per pixel
+        const uint8_t* s_bytes = src + i * 4;
+        const uint8_t* d_bytes = dst + i * 4;
+        uint32_t results[4], weights[4];
+        for (int p = 0; p < 4; p++) {
+            uint32_t src_alpha = s_bytes[p * 4 + 3];
+            results[p] = src_alpha + div255(d_bytes[p * 4 + 3] * (255 - src_alpha));
+            weights[p] = source_share(src_alpha, results[p]);
+        }
+        __m128i src_factors = _mm_set_epi32(unpremultiply_factors[s_bytes[15]], unpremultiply_factors[s_bytes[11]],
+                                            unpremultiply_factors[s_bytes[7]], unpremultiply_factors[s_bytes[3]]);
+        __m128i dst_factors = _mm_set_epi32(unpremultiply_factors[d_bytes[15]], unpremultiply_factors[d_bytes[11]],
+                                            unpremultiply_factors[d_bytes[7]], unpremultiply_factors[d_bytes[3]]);
+
+        __m128i halves[2];
+        for (int half = 0; half < 2; half++) {
+            int p = half * 2;
+            // Each pixel's 32 bit factor spread over its 4 lanes, split into its low and high 16 bits
+            __m128i src_pair = half ? _mm_unpackhi_epi32(src_factors, src_factors) : _mm_unpacklo_epi32(src_factors, src_factors);
+            __m128i dst_pair = half ? _mm_unpackhi_epi32(dst_factors, dst_factors) : _mm_unpacklo_epi32(dst_factors, dst_factors);
+#define SPREAD_HALF_SSE2(v, lane) _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(lane, lane, lane, lane)), _MM_SHUFFLE(lane, lane, lane, lane))
+            uint8_t src_straight[8], dst_straight[8];
+            _mm_storel_epi64((__m128i*)src_straight, _mm_packus_epi16(unpremultiply_2_pixels_sse2(half ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero),
+                                                                                                  SPREAD_HALF_SSE2(src_pair, 1), SPREAD_HALF_SSE2(src_pair, 0)), zero));
+            _mm_storel_epi64((__m128i*)dst_straight, _mm_packus_epi16(unpremultiply_2_pixels_sse2(half ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero),
+                                                                                                  SPREAD_HALF_SSE2(dst_pair, 1), SPREAD_HALF_SSE2(dst_pair, 0)), zero));
+#undef SPREAD_HALF_SSE2
+
+            __m128i weight = _mm_set_epi16(weights[p + 1], weights[p + 1], weights[p + 1], weights[p + 1], weights[p], weights[p], weights[p], weights[p]);
+            __m128i result = _mm_set_epi16(results[p + 1], results[p + 1], results[p + 1], results[p + 1], results[p], results[p], results[p], results[p]);
+            // The alpha lanes encode to 255, so premultiplying leaves the resulting alpha in them
+            __m128i encoded = lerp_encode_2_pixels_sse2(decode_2_pixels_sse2(src_straight, decode), decode_2_pixels_sse2(dst_straight, decode),
+                                                        weight, _mm_set1_epi16(255), encode);
+            halves[half] = div255_sse2(_mm_mullo_epi16(encoded, result));
+        }
+        __m128i out = _mm_packus_epi16(halves[0], halves[1]);
+
+        out = _mm_or_si128(_mm_and_si128(replaces, s), _mm_andnot_si128(replaces, out));
+        out = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, out));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), out);
+    }
+    blend_row_over_linear_premultiplied_scalar(dst + i * 4, src + i * 4, count - i);
+}
+#endif // NAGATO_X86_SIMD
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////// MIXED REPRESENTATION KERNELS ////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Kernels of one blend mode for a source and destination with different alpha representations
+ * The source is converted to the destination's representation, then blended with the fastest kernel for matching representations
+ */
+#define DEFINE_MIXED_MODE_KERNELS(mode, name) \
+static void blend_row_##name##_straight_onto_premultiplied(uint8_t* dst, const uint8_t* src, int count) { \
+    blend_row_converted(dst, src, count, premultiply_row, mode_kernels[mode][1]); \
+} \
+static void blend_row_##name##_premultiplied_onto_straight(uint8_t* dst, const uint8_t* src, int count) { \
+    blend_row_converted(dst, src, count, unpremultiply_row, mode_kernels[mode][0]); \
+}
+
+DEFINE_MIXED_MODE_KERNELS(BLEND_MULTIPLY, multiply)
+DEFINE_MIXED_MODE_KERNELS(BLEND_SCREEN, screen)
+DEFINE_MIXED_MODE_KERNELS(BLEND_ADDITIVE, additive)
+DEFINE_MIXED_MODE_KERNELS(BLEND_DARKEN, darken)
+DEFINE_MIXED_MODE_KERNELS(BLEND_LIGHTEN, lighten)
+DEFINE_MIXED_MODE_KERNELS(BLEND_OVER_LINEAR, over_linear)
+
+// Kernels for a straight source onto a premultiplied destination, and for a premultiplied source onto a straight destination, by mode
+static const Blend_Row_Function mixed_kernels[BLEND_MODE_COUNT][2] = {
+    [BLEND_OVER] = {blend_row_over_straight_onto_premultiplied, blend_row_over_premultiplied_onto_straight},
+    [BLEND_MULTIPLY] = {blend_row_multiply_straight_onto_premultiplied, blend_row_multiply_premultiplied_onto_straight},
+    [BLEND_SCREEN] = {blend_row_screen_straight_onto_premultiplied, blend_row_screen_premultiplied_onto_straight},
+    [BLEND_ADDITIVE] = {blend_row_additive_straight_onto_premultiplied, blend_row_additive_premultiplied_onto_straight},
+    [BLEND_DARKEN] = {blend_row_darken_straight_onto_premultiplied, blend_row_darken_premultiplied_onto_straight},
+    [BLEND_LIGHTEN] = {blend_row_lighten_straight_onto_premultiplied, blend_row_lighten_premultiplied_onto_straight},
+    [BLEND_REPLACE] = {premultiply_row, unpremultiply_row},
+    [BLEND_OVER_LINEAR] = {blend_row_over_linear_straight_onto_premultiplied, blend_row_over_linear_premultiplied_onto_straight},
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////// KERNEL SELECTION ////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Picks the fastest kernels the CPU supports, runs once per process
+ */
+static void select_kernels() {
+    // Every mode gets the kernels of the same instruction set, suffix is scalar, sse2 or avx2
+#define SELECT_MODE_KERNELS(suffix) \
+    mode_kernels[BLEND_OVER][0] = blend_row_over_##suffix; \
+    mode_kernels[BLEND_OVER][1] = blend_row_over_premultiplied_##suffix; \
+    mode_kernels[BLEND_MULTIPLY][0] = blend_row_multiply_##suffix; \
+    mode_kernels[BLEND_MULTIPLY][1] = blend_row_multiply_premultiplied_##suffix; \
+    mode_kernels[BLEND_SCREEN][0] = blend_row_screen_##suffix; \
+    mode_kernels[BLEND_SCREEN][1] = blend_row_screen_premultiplied_##suffix; \
+    mode_kernels[BLEND_ADDITIVE][0] = blend_row_additive_##suffix; \
+    mode_kernels[BLEND_ADDITIVE][1] = blend_row_additive_premultiplied_##suffix; \
+    mode_kernels[BLEND_DARKEN][0] = blend_row_darken_##suffix; \
+    mode_kernels[BLEND_DARKEN][1] = blend_row_darken_premultiplied_##suffix; \
+    mode_kernels[BLEND_LIGHTEN][0] = blend_row_lighten_##suffix; \
+    mode_kernels[BLEND_LIGHTEN][1] = blend_row_lighten_premultiplied_##suffix;
+
+    SELECT_MODE_KERNELS(scalar)
+    modulate_kernel = modulate_row_scalar;
+    mask_kernel = mask_row_scalar;
+    fill_kernel = fill_row_scalar;
+    bgrx_kernel = rgba_to_bgrx_scalar;
+    mode_kernels[BLEND_OVER_LINEAR][0] = blend_row_over_linear_scalar;
+    mode_kernels[BLEND_OVER_LINEAR][1] = blend_row_over_linear_premultiplied_scalar;
+#ifdef NAGATO_X86_SIMD
+    __builtin_cpu_init();
+#ifdef NAGATO_NO_AVX2
+    bool avx2 = false;
+#else
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    if (avx2) {
+        SELECT_MODE_KERNELS(avx2)
+        modulate_kernel = modulate_row_avx2;
+        mask_kernel = mask_row_avx2;
+        fill_kernel = fill_row_avx2;
+        bgrx_kernel = rgba_to_bgrx_avx2;
+        mode_kernels[BLEND_OVER_LINEAR][0] = blend_row_over_linear_avx2;
+        mode_kernels[BLEND_OVER_LINEAR][1] = blend_row_over_linear_premultiplied_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        SELECT_MODE_KERNELS(sse2)
+        modulate_kernel = modulate_row_sse2;
+        mask_kernel = mask_row_sse2;
+        fill_kernel = fill_row_sse2;
+        bgrx_kernel = rgba_to_bgrx_sse2;
+        mode_kernels[BLEND_OVER_LINEAR][0] = blend_row_over_linear_sse2;
+        mode_kernels[BLEND_OVER_LINEAR][1] = blend_row_over_linear_premultiplied_sse2;
+    }
+#endif
+#undef SELECT_MODE_KERNELS
+
+    // Copying is already as fast as it gets
+    mode_kernels[BLEND_REPLACE][0] = blend_row_replace;
+    mode_kernels[BLEND_REPLACE][1] = blend_row_replace;
+
+    // The linear light kernels look colors up in these tables
+    build_linear_light_tables();
+}
+
+/*
+ * Blends a row of RGBA pixels onto another using the source alpha, in place
+ * Uses 8 bit fixed point math, every channel becomes (src * alpha + dst * (255 - alpha)) / 255 rounded to nearest
+ * Dispatches to an AVX2 or SSE2 kernel when the CPU supports it, all kernels give bit identical output
+ */
+void blend_row_over(uint8_t* dst, const uint8_t* src, int count) {
+    pthread_once(&kernel_select_once, select_kernels);
+    mode_kernels[BLEND_OVER][0](dst, src, count);
+}
+
+/*
+ * Blends a row of premultiplied RGBA pixels onto another premultiplied row in place
+ * Every channel becomes src + dst * (255 - alpha) / 255 rounded to nearest, all kernels give bit identical output
+ */
+void blend_row_over_premultiplied(uint8_t* dst, const uint8_t* src, int count) {
+    pthread_once(&kernel_select_once, select_kernels);
+    mode_kernels[BLEND_OVER][1](dst, src, count);
+}
+
+/*
+ * Returns the over kernel matching the alpha representation of the source and destination rows
+ * Mixed representations use portable kernels which convert on the fly, matching representations use the SIMD kernels
+ */
+Blend_Row_Function get_blend_row_over(bool src_premultiplied, bool dst_premultiplied) {
+    return get_blend_row(BLEND_OVER, src_premultiplied, dst_premultiplied);
+}
+
+/*
+ * Returns the kernel for the given blend mode matching the alpha representation of the source and destination rows
+ * Straight alpha destinations are treated like the over kernel does: the mode picks the color, the source alpha weighs it against the destination.
+ * Premultiplied destinations follow the standard separable blend mode formulas, which account for the destination alpha as well.
+ * Mixed representations convert the source on the fly, matching representations use the SIMD kernels.
+ * Every mode is its own specialized kernel, so nothing branches on the mode per pixel.
+ */
+Blend_Row_Function get_blend_row(Blend_Mode mode, bool src_premultiplied, bool dst_premultiplied) {
+    pthread_once(&kernel_select_once, select_kernels);
+    if (mode < 0 || mode >= BLEND_MODE_COUNT) mode = BLEND_OVER;
+    if (src_premultiplied == dst_premultiplied) return mode_kernels[mode][dst_premultiplied];
+    return mixed_kernels[mode][src_premultiplied];
+}
+
+/*
+ * Computes the per channel factors which apply an opacity and an RGB tint to source pixels, for blend_row_modulated
+ * The tint is given as 0xRRGGBB and multiplies the colors, 0xFFFFFF leaves them unchanged. An opacity of 255 leaves the alpha unchanged.
+ * Premultiplied colors carry their alpha, so for premultiplied sources the opacity is folded into the color factors as well.
+ */
+void get_modulation_factors(uint8_t factors[4], uint8_t opacity, uint32_t tint, bool src_premultiplied) {
+    factors[0] = (tint >> 16) & 0xFF;
+    factors[1] = (tint >> 8) & 0xFF;
+    factors[2] = tint & 0xFF;
+    factors[3] = opacity;
+    if (src_premultiplied) {
+        for (int c = 0; c < 3; c++) {
+            factors[c] = div255(factors[c] * opacity);
+        }
+    }
+}
+
+/*
+ * Blends a row like the given kernel, after multiplying every source channel by its factor out of 255
+ * The source is modulated a small chunk at a time into a buffer on the stack, which stays in cache until the kernel reads it back,
+ * so no modified copy of the source image is ever made. The source row is left unchanged.
+ */
+void blend_row_modulated(Blend_Row_Function blend_row, uint8_t* dst, const uint8_t* src, int count, const uint8_t factors[4]) {
+    pthread_once(&kernel_select_once, select_kernels);
+    uint8_t modulated[CONVERT_CHUNK_PIXELS * 4];
+    for (int i = 0; i < count; i += CONVERT_CHUNK_PIXELS) {
+        int chunk = count - i < CONVERT_CHUNK_PIXELS ? count - i : CONVERT_CHUNK_PIXELS;
+        modulate_kernel(modulated, src + i * 4, chunk, factors);
+        blend_row(dst + i * 4, modulated, chunk);
+    }
+}
+
+/*
+ * Multiplies every channel of a row of RGBA pixels by its factor out of 255, from get_modulation_factors
+ * The rows may be the same row, to modulate in place
+ */
+void modulate_row(uint8_t* dst, const uint8_t* src, int count, const uint8_t factors[4]) {
+    pthread_once(&kernel_select_once, select_kernels);
+    modulate_kernel(dst, src, count, factors);
+}
+
+/*
+ * Multiplies the alpha of every pixel of a row by its coverage out of 255, one byte per pixel in mask, and the colors too when premultiplied
+ * The rows may be the same row, to mask in place
+ */
+void mask_row(uint8_t* dst, const uint8_t* src, const uint8_t* mask, int count, bool premultiplied) {
+    pthread_once(&kernel_select_once, select_kernels);
+    mask_kernel(dst, src, mask, count, premultiplied);
+}
+
+/*
+ * Blends a row like the given kernel, after masking the source by the coverage and modulating it by the factors if there are any
+ * Masking first gives the same pixels as blending a copy of the source masked beforehand.
+ * Like blend_row_modulated, the source is prepared a small chunk at a time into a buffer on the stack and the source row is left unchanged.
+ */
+void blend_row_masked(Blend_Row_Function blend_row, uint8_t* dst, const uint8_t* src, const uint8_t* mask, int count, const uint8_t* factors, bool src_premultiplied) {
+    pthread_once(&kernel_select_once, select_kernels);
+    uint8_t masked[CONVERT_CHUNK_PIXELS * 4];
+    for (int i = 0; i < count; i += CONVERT_CHUNK_PIXELS) {
+        int chunk = count - i < CONVERT_CHUNK_PIXELS ? count - i : CONVERT_CHUNK_PIXELS;
+        mask_kernel(masked, src + i * 4, mask + i, chunk, src_premultiplied);
+        if (factors) modulate_kernel(masked, masked, chunk, factors);
+        blend_row(dst + i * 4, masked, chunk);
+    }
+}
+
+/*
+ * Fills a row with count copies of the given RGBA pixel
+ * Whole vectors are stored at a time when the CPU supports AVX2 or SSE2, so filling runs at memset speed
+ */
+void fill_row(uint8_t* dst, const uint8_t pixel[4], int count) {
+    pthread_once(&kernel_select_once, select_kernels);
+    fill_kernel(dst, pixel, count);
+}
+
+/*
+ * Flattens a row of RGBA pixels onto an opaque matte color given as 0xRRGGBB and writes it as 32 bit BGRX pixels
+ * BGRX is the memory layout of the usual 24 and 32 bit TrueColor displays: blue, green, red, then an unused byte which is set to 255.
+ * The row is matted a small chunk at a time into a buffer on the stack and converted straight out of it, in a single pass over the source.
+ * Each chunk is read before it is written, so dst may be src to convert a row in place.
+ * An opaque matte looks the same in both alpha representations, so the over kernel of the source's representation does the matting.
+ */
+void matte_row_to_bgrx(uint8_t* dst, const uint8_t* src, int count, uint32_t matte, bool src_premultiplied) {
+    pthread_once(&kernel_select_once, select_kernels);
+    const uint8_t matte_pixel[4] = {(matte >> 16) & 0xFF, (matte >> 8) & 0xFF, matte & 0xFF, 255};
+    uint8_t matted[CONVERT_CHUNK_PIXELS * 4];
+    for (int i = 0; i < count; i += CONVERT_CHUNK_PIXELS) {
+        int chunk = count - i < CONVERT_CHUNK_PIXELS ? count - i : CONVERT_CHUNK_PIXELS;
+        fill_kernel(matted, matte_pixel, chunk);
+        mode_kernels[BLEND_OVER][src_premultiplied](matted, src + i * 4, chunk);
+        bgrx_kernel(dst + i * 4, matted, chunk);
+    }
+}
+
+/*
+ * Returns the tables between sRGB bytes and 16 bit linear light, built once per process
+ */
+const Linear_Light_Tables* get_linear_light_tables() {
+    pthread_once(&kernel_select_once, select_kernels);
+    return &linear_storage.tables;
+}
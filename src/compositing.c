@@ -1,38 +1,746 @@
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include "blending.h"
 #include "compositing.h"
+#include "thread_manager.h"
+
+// Tiles are 256 x 64 pixels, 64KB of canvas, so a tile and the layer rows feeding it stay in cache
+#define TILE_WIDTH 256
+#define TILE_HEIGHT 64
+// Canvases smaller than this are flattened on the calling thread, the pool overhead would outweigh the work
+#define PARALLEL_FLATTEN_MIN_PIXELS (512 * 512)
+// Past this many separate damaged regions they are merged into one bounding rectangle
+#define MAX_DAMAGE_RECTS 16
+// Layers searched ahead when matching display lists, past this many inserted or removed layers the rest is damaged as changed
+#define DAMAGE_MATCH_LOOKAHEAD 32
+// Stretched nine slice rows are gathered this many pixels at a time, small enough to stay in L1 on the stack
+#define SLICE_CHUNK_PIXELS 64
+// Fills which must be blended are blended from a row of this many copies of the color on the stack
+#define FILL_CHUNK_PIXELS 64
+// Clip of a layer pushed while no clip rectangle is active, larger than any canvas but far enough from the int limits to intersect safely
+#define NO_CLIP ((Image_Rect){INT_MIN / 2, INT_MIN / 2, INT_MAX, INT_MAX})
+
+/*
+ * Solid color rectangle drawn by a fill layer, which has no image and never materializes its pixels
+ */
+typedef struct Layer_Fill {
+    uint32_t rgba; // Straight alpha, as 0xRRGGBBAA
+    int width;
+    int height;
+    bool premultiplied; // Alpha representation of the frame when the fill is the background
+} Layer_Fill;
 
 /*
  * Holds an image and where it should go in the flattened image
  */
 typedef struct {
-    const PNG_Image *const image;
+    const PNG_Image *const image; // NULL for a fill layer
+    const Layer_Fill fill;
     const int x;
     const int y;
+    const Layer_Options options;
+    const Image_Rect clip; // The clip rectangles active when the image was pushed, intersected
+    Layer_Group *const group; // Group whose surface the image is, NULL for any other layer
 } PNG_Image_With_Loc;
 
 /*
  * Very basic stack for holding PNG_Image_With_Loc in the proper order
  * The last image to be pushed will be the first image used, becoming the background
+ * Items are stored by value and the storage is kept between frames, so pushing does not allocate once the stack has grown
  */
 typedef struct {
-    PNG_Image_With_Loc** items;
+    PNG_Image_With_Loc* items;
     int capacity;
     int top;
 } PNG_Image_Stack;
 
-PNG_Image_Stack global_stack = {NULL, 0, -1}; //TODO: can this be threadlocal?
-pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * One layer of a flatten, ordered from the background up
+ * visible is the part of the canvas the layer can still change once layers hidden behind opaque layers above are culled
+ */
+typedef struct Composite_Layer {
+    const PNG_Image* image; // NULL for a fill layer
+    Layer_Fill fill;
+    bool premultiplied; // Alpha representation of the layer, the background's becomes the frame's
+    int x;
+    int y;
+    Image_Rect visible; // Zero sized when the layer is completely hidden
+    Layer_Options options;
+    Image_Rect source; // Part of the image which is drawn, already clipped to the image
+    int width; // Size of the layer on the canvas
+    int height;
+    bool transformed; // Drawn through its transform, x, y, width and height then bound the transformed source
+    double inverse[6]; // Maps a canvas position to a source position as u = [0] * x + [1] * y + [2] and v = [3] * x + [4] * y + [5]
+    Image_Rect clip; // Part of the canvas the layer may draw to, NO_CLIP unless it was pushed inside clip rectangles or masked
+    int mask_x; // Canvas position of the top left of the mask, when the options have one
+    int mask_y;
+} Composite_Layer;
+
+/*
+ * Where composited pixels are written, either the pixel data of a PNG_Image or a buffer owned by the caller
+ * A BGRX target is never blended into directly, its tiles are composited as RGBA in its own memory and matted in place.
+ */
+typedef struct Composite_Target {
+    unsigned char* data; // RGBA pixels, or BGRX pixels when bgrx is set
+    int width;
+    int height;
+    size_t stride; // Bytes from the start of one row to the start of the next
+    bool premultiplied;
+    Image_Rect* opaque_region; // Cached opaque region which blending may invalidate, NULL when the target has none
+    bool bgrx; // Pixels are written in the display's BGRX layout, flattened onto the matte
+    uint32_t matte; // Opaque 0xRRGGBB color under a BGRX target
+} Composite_Target;
+
+/*
+ * How the rows of one layer are blended: the kernel, and what is applied to the source on its way into it
+ */
+typedef struct Layer_Blend {
+    Blend_Row_Function blend_row;
+    const uint8_t* factors; // Opacity and tint modulation, NULL when the layer has neither
+    const PNG_Image* mask; // Its alpha is multiplied into the source alpha, NULL when the layer is not masked
+    int mask_x; // Canvas position of the top left of the mask
+    int mask_y;
+    bool premultiplied; // Alpha representation of the source rows
+} Layer_Blend;
+
+/*
+ * A list of damaged regions of the flattened image
+ * Overlapping regions are merged as they are added, so no pixel is composited twice
+ */
+typedef struct Damage_List {
+    Image_Rect rects[MAX_DAMAGE_RECTS];
+    int count;
+} Damage_List;
+
+/*
+ * One entry of a display list: what a layer drew, where and how, used to work out what changed between flattens
+ * Images are fingerprinted by identity and generation, so an image whose pixels changed in place no longer matches
+ */
+typedef struct Layer_Snapshot {
+    const PNG_Image* image;
+    unsigned long generation; // Of the image when it was drawn
+    unsigned long mask_generation; // Of the mask when it was drawn, 0 without one
+    Layer_Fill fill;
+    Image_Rect bounds; // Where the layer was drawn on the canvas, and how large it was
+    Layer_Options options;
+    Image_Rect clip; // Part of the bounds the layer was allowed to draw to
+} Layer_Snapshot;
+
+// Shared state for one parallel flatten, kept by whoever flattens so the next flatten can reuse it
+typedef struct Flatten_Job Flatten_Job;
+
+/*
+ * A flattened frame kept between flattens along with the display list which produced it
+ * The next flatten records a new display list and only recomposites where it differs, an unchanged list costs no compositing at all
+ */
+typedef struct Frame_Cache {
+    PNG_Image* frame; // The last flattened frame, updated in place
+    Layer_Snapshot* layers; // Display list of the frame
+    int layer_count;
+    Layer_Snapshot* next_layers; // Display list being recorded, swapped with layers once the frame is updated
+    int capacity; // Of both display lists, which are kept between flattens so steady state frames do not allocate
+    Damage_List pending; // Regions marked with context_add_damage_rect since the last flatten, guarded by stack_lock
+    Damage_List damage; // Regions recomposited by the last flatten
+    Flatten_Job* job; // Reused by every parallel flatten of the frame
+} Frame_Cache;
+
+/*
+ * A retained layer, which stays in the scene between frames until it is destroyed
+ */
+struct Scene_Layer {
+    Composite_Context* context; // The context whose scene holds the layer
+    const PNG_Image* image; // Not owned by the layer, NULL for a fill layer
+    unsigned long generation; // Of the image when the layer was last flattened, a newer one means its pixels changed in place
+    Layer_Fill fill;
+    int x;
+    int y;
+    int z; // Layers with a higher z are drawn on top
+    unsigned long sequence; // Creation order, breaks ties between layers with the same z
+    bool visible;
+    Layer_Options options;
+    unsigned long mask_generation; // Of the mask when the layer was last flattened, 0 without one
+};
+
+/*
+ * The retained scene, every live layer sorted from the bottom up
+ * The last flattened frame is kept along with the damage done to it since, so only changed regions are recomposited
+ */
+typedef struct Scene {
+    Scene_Layer** layers; // Sorted by z, then by sequence
+    int count;
+    int capacity;
+    unsigned long next_sequence;
+    PNG_Image* frame; // The last flattened frame, updated in place
+    const PNG_Image* frame_background; // The image which defined the size of the frame, NULL for a fill
+    const Scene_Layer* frame_base; // The layer drawn as the background of the frame
+    Damage_List damage; // Regions changed since the frame was last flattened
+    Composite_Layer* scratch; // Reused every frame to hand the visible layers to the compositor
+    int scratch_capacity;
+    Flatten_Job* job; // Reused by every parallel flatten of the frame
+    pthread_mutex_t lock;
+} Scene;
+
+/*
+ * Everything one compositor needs between calls: its image stack, incremental flattening state, retained scene and scratch buffers.
+ * Nothing is shared between contexts, so separate contexts can be pushed to and flattened from different threads at the same time.
+ */
+struct Composite_Context {
+    PNG_Image_Stack stack; // Images pushed for the next flatten, guarded by stack_lock
+    Image_Rect* clips; // Active clip rectangles from the outermost in, each intersected with those before it, guarded by stack_lock
+    int clip_count;
+    int clip_capacity;
+    pthread_mutex_t stack_lock;
+
+    // Frames kept between stack flattens, so only what changed is composited again
+    Frame_Cache incremental; // Behind get_flattened_image_incremental, which hands out the frame itself
+    Frame_Cache memoized; // Behind get_flattened_image, which hands out copies
+    Composite_Layer* scratch; // Reused by every stack flatten to hand the layers to the compositor
+    int scratch_capacity;
+    Flatten_Job* target_job; // Reused by parallel flattens into targets owned by the caller
+    pthread_mutex_t flatten_lock; // Serializes stack flattens, guards the frame caches and scratch buffer
+
+    Scene scene; // The retained layer scene, guarded by its own lock
+    Damage_List reported_scene_damage; // Regions recomposited by the last scene flatten
+
+    // Asynchronous flattens wait in a queue drained by one pool task at a time, so they are composited in the order they were requested
+    Flatten_Handle* async_head; // Next flatten to composite, guarded by stack_lock
+    Flatten_Handle* async_tail; // Last flatten requested, guarded by stack_lock
+    bool async_draining; // True while a pool task is draining the queue, guarded by stack_lock
+};
+
+/*
+ * One version of the surface of a group, kept until no asynchronous flatten reads it anymore
+ */
+typedef struct Group_Surface {
+    PNG_Image* image;
+    int readers; // Asynchronous flattens which were handed the image and are not done with it yet, guarded by the lock of the group
+    struct Group_Surface* next; // Older version, replaced while it was still being read
+} Group_Surface;
+
+/*
+ * A group of layers flattened once into a cached surface, which is then drawn as a single layer
+ * The children live in the retained scene of a context of their own, so only what a changed child touches is flattened again.
+ * The scene frame is only ever written by the group, what it pushes is a copy brought up to date from it. A copy still being read by
+ * an asynchronous flatten is never written, a changed group gets a new copy instead and the old one is freed once its readers are done.
+ */
+struct Layer_Group {
+    Composite_Context* context; // Holds the children
+    Scene_Layer* canvas; // Transparent premultiplied fill below every child, sets the size of the surface
+    Group_Surface* surfaces; // Newest first, the first is what push_group hands out, guarded by lock
+    pthread_mutex_t lock; // Serializes bringing the surface up to date
+    pthread_cond_t released; // Broadcast whenever a surface loses its last reader
+};
+
+/*
+ * An asynchronous flatten, shared by the caller holding the handle and the pool task compositing it
+ * The layers are copied off the stack of the context when the flatten is requested, so the next frame can be pushed right away.
+ * The handle is reference counted because either side may let go of it first.
+ */
+struct Flatten_Handle {
+    Composite_Context* context;
+    PNG_Image_Stack stack; // The layers of the frame, owned by the handle
+    Flatten_Handle* next; // Next flatten in the queue of the context, guarded by its stack_lock
+    Flatten_Callback callback; // NULL if the caller collects the image itself
+    void* user_data;
+    PNG_Image* result; // The flattened image until someone takes it, guarded by lock
+    bool done; // Guarded by lock
+    int references; // Guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t finished; // Broadcast when done is set
+};
+
+/*
+ * Shared state for one parallel flatten
+ * Tiles are claimed through next_tile, so the calling thread and any number of pool tasks can work on the same flatten.
+ * The job is reference counted because pool tasks may only start after every tile is already finished.
+ * Whoever flattens keeps a reference between flattens, so a job nobody else holds anymore is reused without allocating.
+ */
+struct Flatten_Job {
+    Composite_Target target; // Where every tile is composited
+    Composite_Layer* layers; // Layers ordered from the background up
+    int layer_count;
+    int base_layer; // Lowest layer which is not hidden, copied instead of blended
+    Image_Rect* tiles; // Regions of the canvas, each composited independently
+    int tile_count;
+    int tile_capacity;
+    atomic_int next_tile; // Index of the next unclaimed tile
+    int tiles_done; // Finished tiles, guarded by lock
+    int references; // Threads still holding the job, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t all_done; // Signaled when tiles_done reaches tile_count
+};
+
+static long flatten_cores = 1; // Cores the parallel flattens spread over, counted once
+static pthread_once_t flatten_cores_once = PTHREAD_ONCE_INIT;
+
+// The context used by the functions which do not take one
+Composite_Context default_context = {
+    .stack = {NULL, 0, -1},
+    .stack_lock = PTHREAD_MUTEX_INITIALIZER,
+    .flatten_lock = PTHREAD_MUTEX_INITIALIZER,
+    .scene = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+void blend_image_clipped(const Composite_Target* target, const Composite_Layer* layer, Image_Rect clip);
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////// HELPER FUNCTIONS ///////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*
- * Initializes a PNG_Image_With_Loc struct.
- * This function violates the constness of the PNG_Image_With_Loc struct in order to dynamically allocate it and also gives it's fields values.
+ * Returns the overlap of two rectangles, zero sized if they do not overlap
+ */
+Image_Rect intersect_rects(Image_Rect a, Image_Rect b) {
+    int left = a.x > b.x ? a.x : b.x;
+    int top = a.y > b.y ? a.y : b.y;
+    int right = a.x + a.width < b.x + b.width ? a.x + a.width : b.x + b.width;
+    int bottom = a.y + a.height < b.y + b.height ? a.y + a.height : b.y + b.height;
+    if (right <= left || bottom <= top) return (Image_Rect){0, 0, 0, 0};
+    return (Image_Rect){left, top, right - left, bottom - top};
+}
+
+/*
+ * Returns a target which composites into the pixel data of the given image
+ */
+Composite_Target image_target(PNG_Image* image) {
+    return (Composite_Target){image->data, image->width, image->height, (size_t)image->width * 4, image->premultiplied, &image->opaque_region, false, 0};
+}
+
+/*
+ * Returns where the pixel at the given canvas position is stored in the target
+ * The position may lie left of the target, for rows addressed by where their first column would land
+ */
+unsigned char* target_pixel(const Composite_Target* target, int x, int y) {
+    return target->data + (ptrdiff_t)y * (ptrdiff_t)target->stride + (ptrdiff_t)x * 4;
+}
+
+/*
+ * Returns true if the rectangle has no area, false otherwise
+ */
+bool is_rect_empty(Image_Rect rect) {
+    return rect.width <= 0 || rect.height <= 0;
+}
+
+/*
+ * Returns true if the outer rectangle completely covers the inner rectangle, false otherwise
+ */
+bool rect_contains(Image_Rect outer, Image_Rect inner) {
+    return inner.x >= outer.x && inner.y >= outer.y
+        && inner.x + inner.width <= outer.x + outer.width
+        && inner.y + inner.height <= outer.y + outer.height;
+}
+
+/*
+ * Returns the smallest rectangle covering both rectangles
+ */
+Image_Rect union_rects(Image_Rect a, Image_Rect b) {
+    if (is_rect_empty(a)) return b;
+    if (is_rect_empty(b)) return a;
+    int left = a.x < b.x ? a.x : b.x;
+    int top = a.y < b.y ? a.y : b.y;
+    int right = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    int bottom = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+    return (Image_Rect){left, top, right - left, bottom - top};
+}
+
+/*
+ * Adds a damaged region to the list, merging it with any region it overlaps.
+ * Once the list holds MAX_DAMAGE_RECTS regions everything is merged into a single bounding rectangle.
+ */
+void add_damage(Damage_List* list, Image_Rect rect) {
+    if (is_rect_empty(rect)) return;
+
+    // Merging can make the grown region overlap regions checked earlier, so start over after every merge
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (int i = 0; i < list->count; i++) {
+            if (!is_rect_empty(intersect_rects(list->rects[i], rect))) {
+                rect = union_rects(list->rects[i], rect);
+                list->rects[i] = list->rects[--list->count]; // Swap remove
+                merged = true;
+                break;
+            }
+        }
+    }
+
+    if (list->count == MAX_DAMAGE_RECTS) {
+        for (int i = 0; i < list->count; i++) {
+            rect = union_rects(rect, list->rects[i]);
+        }
+        list->count = 0;
+    }
+
+    list->rects[list->count++] = rect;
+}
+
+/*
+ * Returns true if both sets of layer options draw a layer the same way, false otherwise
+ */
+bool layer_options_equal(const Layer_Options* a, const Layer_Options* b) {
+    return a->blend_mode == b->blend_mode && a->opacity == b->opacity && (a->tint & 0xFFFFFF) == (b->tint & 0xFFFFFF)
+        && !memcmp(&a->source, &b->source, sizeof(Image_Rect)) && !memcmp(&a->nine_slice, &b->nine_slice, sizeof(Nine_Slice))
+        && a->filter == b->filter && !memcmp(&a->transform, &b->transform, sizeof(Layer_Transform))
+        && a->mask == b->mask && a->mask_x == b->mask_x && a->mask_y == b->mask_y;
+}
+
+/*
+ * Returns true if the transform is set, an all zero transform draws the layer untransformed
+ */
+bool is_transform_set(const Layer_Transform* transform) {
+    return transform->a != 0 || transform->b != 0 || transform->c != 0 || transform->d != 0 || transform->tx != 0 || transform->ty != 0;
+}
+
+/*
+ * Returns the transform which scales the source around the given source point, then rotates it by the given angle in radians clockwise,
+ * and places that point at the given canvas offset from the layer's position. The offset may be fractional.
+ */
+Layer_Transform layer_transform_make(double origin_u, double origin_v, double scale_x, double scale_y, double radians, double offset_x, double offset_y) {
+    double cosine = cos(radians), sine = sin(radians);
+    Layer_Transform transform = {scale_x * cosine, scale_x * sine, -scale_y * sine, scale_y * cosine, 0, 0};
+    transform.tx = offset_x - (transform.a * origin_u + transform.c * origin_v);
+    transform.ty = offset_y - (transform.b * origin_u + transform.d * origin_v);
+    return transform;
+}
+
+/*
+ * Bounds the source of a layer drawn through its transform and sets up the inverse mapping the compositor samples it with.
+ * A transform which collapses the source onto a line or a point leaves the layer zero sized, so nothing is drawn.
+ */
+void transform_composite_layer(Composite_Layer* layer, int x, int y) {
+    const Layer_Transform* t = &layer->options.transform;
+    layer->transformed = true;
+    layer->width = 0;
+    layer->height = 0;
+
+    double determinant = t->a * t->d - t->b * t->c;
+    if (fabs(determinant) < 1e-9) return;
+
+    // The bounding box of the 4 transformed corners of the source
+    double origin_x = x + t->tx, origin_y = y + t->ty;
+    double min_x = origin_x, max_x = origin_x, min_y = origin_y, max_y = origin_y;
+    double corners[3][2] = {{layer->source.width, 0}, {0, layer->source.height}, {layer->source.width, layer->source.height}};
+    for (int i = 0; i < 3; i++) {
+        double corner_x = origin_x + t->a * corners[i][0] + t->c * corners[i][1];
+        double corner_y = origin_y + t->b * corners[i][0] + t->d * corners[i][1];
+        min_x = fmin(min_x, corner_x);
+        max_x = fmax(max_x, corner_x);
+        min_y = fmin(min_y, corner_y);
+        max_y = fmax(max_y, corner_y);
+    }
+    if (min_x < INT_MIN / 2 || max_x > INT_MAX / 2 || min_y < INT_MIN / 2 || max_y > INT_MAX / 2) return; // Far off any canvas
+    layer->x = (int)floor(min_x);
+    layer->y = (int)floor(min_y);
+    layer->width = (int)ceil(max_x) - layer->x;
+    layer->height = (int)ceil(max_y) - layer->y;
+
+    // Inverting the 2x2 part maps canvas offsets from the transformed origin back into the source
+    layer->inverse[0] = t->d / determinant;
+    layer->inverse[1] = -t->c / determinant;
+    layer->inverse[2] = -(layer->inverse[0] * origin_x + layer->inverse[1] * origin_y);
+    layer->inverse[3] = -t->b / determinant;
+    layer->inverse[4] = t->a / determinant;
+    layer->inverse[5] = -(layer->inverse[3] * origin_x + layer->inverse[4] * origin_y);
+}
+
+/*
+ * Builds the layer which draws the given image at the given X & Y coordinates with the given options, clipped only to its mask
+ * The source rectangle is clipped to the image once here, so the compositor can read it straight out of the image
+ */
+Composite_Layer make_composite_layer(const PNG_Image* image, const Layer_Fill* fill, int x, int y, const Layer_Options* options) {
+    Composite_Layer layer;
+    if (!image) { // Fills have no source to pick from or slice, they cover their own size
+        Image_Rect size = {0, 0, fill->width > 0 ? fill->width : 0, fill->height > 0 ? fill->height : 0};
+        layer = (Composite_Layer){NULL, *fill, fill->premultiplied, x, y, {0, 0, 0, 0}, *options, size, size.width, size.height, .clip = NO_CLIP};
+    } else {
+        Image_Rect whole_image = {0, 0, image->width, image->height};
+        Image_Rect source = is_rect_empty(options->source) ? whole_image : intersect_rects(options->source, whole_image);
+        layer = (Composite_Layer){image, {0, 0, 0, false}, image->premultiplied, x, y, {0, 0, 0, 0}, *options, source, source.width, source.height, .clip = NO_CLIP};
+        if (is_transform_set(&options->transform)) {
+            transform_composite_layer(&layer, x, y);
+        } else if (options->nine_slice.width > 0 && options->nine_slice.height > 0) {
+            layer.width = options->nine_slice.width;
+            layer.height = options->nine_slice.height;
+        }
+    }
+
+    // Everything outside the mask is masked out, so the mask clips the layer as well
+    if (options->mask) {
+        layer.mask_x = x + options->mask_x;
+        layer.mask_y = y + options->mask_y;
+        layer.clip = (Image_Rect){layer.mask_x, layer.mask_y, options->mask->width, options->mask->height};
+    }
+    return layer;
+}
+
+/*
+ * Returns the layer which draws the background of a flatten, the background defines the canvas so it is always drawn untransformed, unclipped
+ * and unmasked at the origin
+ */
+Composite_Layer make_background_layer(const PNG_Image* image, const Layer_Fill* fill, const Layer_Options* options) {
+    Layer_Options untransformed = *options;
+    untransformed.transform = (Layer_Transform){0};
+    untransformed.mask = NULL;
+    return make_composite_layer(image, fill, 0, 0, &untransformed);
+}
+
+/*
+ * Returns true when a layer is drawn at another size than its source without a transform, which makes it a nine slice
+ */
+bool is_layer_scaled(const Composite_Layer* layer) {
+    return !layer->transformed && (layer->width != layer->source.width || layer->height != layer->source.height);
+}
+
+/*
+ * Splits one axis of a nine slice into its low border, middle and high border
+ * Fills the start and length of each part in the source and in the destination. Borders are clamped to the source,
+ * then cut down to the size drawn, keeping their outer edges.
+ */
+void split_nine_slice_axis(int src_start, int src_size, int dest_start, int dest_size, int low, int high, int src_parts[3][2], int dest_parts[3][2]) {
+    low = low < 0 ? 0 : low > src_size ? src_size : low;
+    high = high < 0 ? 0 : high > src_size - low ? src_size - low : high;
+    int dest_low = low < dest_size ? low : dest_size;
+    int dest_high = high < dest_size - dest_low ? high : dest_size - dest_low;
+
+    src_parts[0][0] = src_start;
+    src_parts[0][1] = dest_low;
+    src_parts[1][0] = src_start + low;
+    src_parts[1][1] = src_size - low - high;
+    src_parts[2][0] = src_start + src_size - dest_high;
+    src_parts[2][1] = dest_high;
+
+    dest_parts[0][0] = dest_start;
+    dest_parts[0][1] = dest_low;
+    dest_parts[1][0] = dest_start + dest_low;
+    dest_parts[1][1] = dest_size - dest_low - dest_high;
+    dest_parts[2][0] = dest_start + dest_size - dest_high;
+    dest_parts[2][1] = dest_high;
+}
+
+/*
+ * Splits a nine slice layer into its 3x3 grid of corners, edges and center, row by row
+ * Fills where each part lands on the canvas and the part of the image it is drawn from
+ */
+void get_nine_slice_parts(const Composite_Layer* layer, Image_Rect dest[9], Image_Rect src[9]) {
+    const Nine_Slice* slice = &layer->options.nine_slice;
+    int src_columns[3][2], dest_columns[3][2], src_rows[3][2], dest_rows[3][2];
+    split_nine_slice_axis(layer->source.x, layer->source.width, layer->x, layer->width, slice->left, slice->right, src_columns, dest_columns);
+    split_nine_slice_axis(layer->source.y, layer->source.height, layer->y, layer->height, slice->top, slice->bottom, src_rows, dest_rows);
+    for (int row = 0; row < 3; row++) {
+        for (int column = 0; column < 3; column++) {
+            dest[row * 3 + column] = (Image_Rect){dest_columns[column][0], dest_rows[row][0], dest_columns[column][1], dest_rows[row][1]};
+            src[row * 3 + column] = (Image_Rect){src_columns[column][0], src_rows[row][0], src_columns[column][1], src_rows[row][1]};
+        }
+    }
+}
+
+/*
+ * Returns true when every pixel of a nine slice layer is drawn from its source
+ * A source without a middle leaves the middle of the layer undrawn
+ */
+bool nine_slice_covers_layer(const Composite_Layer* layer) {
+    Image_Rect dest[9], src[9];
+    get_nine_slice_parts(layer, dest, src);
+    for (int i = 0; i < 9; i++) {
+        if (!is_rect_empty(dest[i]) && is_rect_empty(src[i])) return false;
+    }
+    return true;
+}
+
+/*
+ * Returns true when two display list entries draw the same pixels in the same place the same way
+ * Images and masks must be the same images at the same generations, fills the same color
+ */
+bool snapshots_draw_same(const Layer_Snapshot* a, const Layer_Snapshot* b) {
+    if (a->mask_generation != b->mask_generation) return false;
+    if (a->image || b->image) {
+        if (a->image != b->image || a->generation != b->generation) return false;
+    } else if (a->fill.rgba != b->fill.rgba || a->fill.premultiplied != b->fill.premultiplied) {
+        return false;
+    }
+    return !memcmp(&a->bounds, &b->bounds, sizeof(Image_Rect)) && !memcmp(&a->clip, &b->clip, sizeof(Image_Rect))
+        && layer_options_equal(&a->options, &b->options);
+}
+
+/*
+ * Returns the part of the canvas a layer covers
+ */
+Image_Rect layer_bounds(const Composite_Layer* layer) {
+    return (Image_Rect){layer->x, layer->y, layer->width, layer->height};
+}
+
+/*
+ * Returns the part of the canvas a display list entry could change, its bounds cut down to its clip
+ */
+Image_Rect snapshot_drawn_rect(const Layer_Snapshot* snapshot) {
+    return intersect_rects(snapshot->bounds, snapshot->clip);
+}
+
+/*
+ * Returns true if two display list entries are the same layer, whether or not it moved or changed its options
+ * Images are the same layer when they are the same image at the same generation, fills when they are the same color at the same place
+ */
+bool snapshots_same_layer(const Layer_Snapshot* a, const Layer_Snapshot* b) {
+    if (a->image || b->image) return a->image == b->image && a->generation == b->generation;
+    return a->fill.rgba == b->fill.rgba && a->fill.premultiplied == b->fill.premultiplied && !memcmp(&a->bounds, &b->bounds, sizeof(Image_Rect));
+}
+
+/*
+ * Returns how many entries after the first of the list come before one which is the same layer as the given entry,
+ * or -1 if there is none within DAMAGE_MATCH_LOOKAHEAD entries
+ */
+int find_same_layer(const Layer_Snapshot* layer, const Layer_Snapshot* list, int count) {
+    if (count > DAMAGE_MATCH_LOOKAHEAD) count = DAMAGE_MATCH_LOOKAHEAD;
+    for (int i = 0; i < count; i++) {
+        if (snapshots_same_layer(layer, &list[i])) return i;
+    }
+    return -1;
+}
+
+/*
+ * Damages the canvas wherever the layers differ from the previous flatten.
+ * Layers are matched by identity rather than by position in the stack, so adding or removing one layer only damages where it is drawn.
+ * A layer which was added, removed, reordered past others, moved, resized, swapped for another image, changed in place
+ * or drawn with different options damages both where it was and where it is now.
+ */
+void damage_changed_layers(Damage_List* damage, const Layer_Snapshot* old_layers, int old_count, const Layer_Snapshot* new_layers, int new_count) {
+    int old_index = 1, new_index = 1; // The background is compared by the caller
+    while (old_index < old_count && new_index < new_count) {
+        const Layer_Snapshot* old_layer = &old_layers[old_index];
+        const Layer_Snapshot* new_layer = &new_layers[new_index];
+        if (!snapshots_same_layer(old_layer, new_layer)) {
+            // Skip whichever side has the fewest layers before the two lists line up again
+            int inserted = find_same_layer(old_layer, new_layers + new_index, new_count - new_index);
+            int removed = find_same_layer(new_layer, old_layers + old_index, old_count - old_index);
+            if (inserted >= 0 && (removed < 0 || inserted <= removed)) {
+                for (int i = 0; i < inserted; i++) add_damage(damage, snapshot_drawn_rect(&new_layers[new_index + i]));
+                new_index += inserted;
+                continue;
+            }
+            if (removed >= 0) {
+                for (int i = 0; i < removed; i++) add_damage(damage, snapshot_drawn_rect(&old_layers[old_index + i]));
+                old_index += removed;
+                continue;
+            }
+        }
+
+        // The same layer, or one layer swapped for another in its place
+        if (!snapshots_draw_same(old_layer, new_layer)) {
+            add_damage(damage, snapshot_drawn_rect(old_layer));
+            add_damage(damage, snapshot_drawn_rect(new_layer));
+        }
+        old_index++;
+        new_index++;
+    }
+
+    // Whatever is left over was added on top or removed from the top
+    for (; old_index < old_count; old_index++) add_damage(damage, snapshot_drawn_rect(&old_layers[old_index]));
+    for (; new_index < new_count; new_index++) add_damage(damage, snapshot_drawn_rect(&new_layers[new_index]));
+}
+
+/*
+ * Returns true for the modes which draw the source over the destination, in sRGB or in linear light
+ * Both give exactly the source where it is opaque and exactly the destination where it is transparent
+ */
+bool is_over_mode(Blend_Mode mode) {
+    return mode == BLEND_OVER || mode == BLEND_OVER_LINEAR;
+}
+
+/*
+ * Returns the part of the canvas which the given layer completely hides
+ * An over layer at full opacity hides what is below its opaque region and a replace layer hides everything below it,
+ * other blend modes hide nothing. Nothing outside the clip of the layer is hidden, and masked layers hide nothing.
+ */
+Image_Rect layer_opaque_rect(const Composite_Layer* layer, Image_Rect canvas_rect) {
+    if (layer->options.mask) return (Image_Rect){0, 0, 0, 0}; // The mask may make any pixel transparent
+    canvas_rect = intersect_rects(canvas_rect, layer->clip);
+    if (!layer->image) { // A fill is opaque everywhere or nowhere
+        bool hides = layer->options.blend_mode == BLEND_REPLACE
+            || (is_over_mode(layer->options.blend_mode) && layer->options.opacity == 255 && (layer->fill.rgba & 0xFF) == 255);
+        return hides ? intersect_rects(layer_bounds(layer), canvas_rect) : (Image_Rect){0, 0, 0, 0};
+    }
+
+    if (layer->transformed) return (Image_Rect){0, 0, 0, 0}; // Only the bounds are known, not which pixels the source lands on
+
+    if (is_layer_scaled(layer)) {
+        // A nine slice hides everything below it only when all of it is drawn from opaque pixels
+        bool hides = (layer->options.blend_mode == BLEND_REPLACE
+            || (is_over_mode(layer->options.blend_mode) && layer->options.opacity == 255 && rect_contains(layer->image->opaque_region, layer->source)))
+            && nine_slice_covers_layer(layer);
+        return hides ? intersect_rects(layer_bounds(layer), canvas_rect) : (Image_Rect){0, 0, 0, 0};
+    }
+
+    Image_Rect opaque;
+    switch (layer->options.blend_mode) {
+        case BLEND_OVER:
+        case BLEND_OVER_LINEAR:
+            if (layer->options.opacity != 255) return (Image_Rect){0, 0, 0, 0};
+            opaque = intersect_rects(layer->image->opaque_region, layer->source);
+            break;
+        case BLEND_REPLACE: opaque = layer->source; break;
+        default: return (Image_Rect){0, 0, 0, 0};
+    }
+    // From image coordinates to canvas coordinates
+    opaque.x += layer->x - layer->source.x;
+    opaque.y += layer->y - layer->source.y;
+    return intersect_rects(opaque, canvas_rect);
+}
+
+/*
+ * Shrinks the visible part of every layer by the opaque layers above it, and returns the lowest layer still worth drawing.
+ * Every layer starts out visible where its bounds, its clip and the canvas meet.
+ * Layers below a layer whose opaque region covers the whole canvas are hidden entirely.
+ * Otherwise a layer is hidden when one opaque region above covers it, and trimmed when one covers a full edge of it.
+ */
+int cull_hidden_layers(Composite_Layer* layers, int layer_count, Image_Rect canvas_rect) {
+    int base = 0;
+    for (int i = 0; i < layer_count; i++) {
+        layers[i].visible = intersect_rects(layer_bounds(&layers[i]), intersect_rects(canvas_rect, layers[i].clip));
+        if (i > 0 && rect_contains(layer_opaque_rect(&layers[i], canvas_rect), canvas_rect)) {
+            base = i; // Everything below this layer is covered
+        }
+    }
+
+    for (int i = base + 1; i < layer_count; i++) {
+        Image_Rect* visible = &layers[i].visible;
+        for (int above = i + 1; above < layer_count && !is_rect_empty(*visible); above++) {
+            Image_Rect opaque = layer_opaque_rect(&layers[above], canvas_rect);
+            if (is_rect_empty(opaque)) continue;
+
+            if (rect_contains(opaque, *visible)) {
+                *visible = (Image_Rect){0, 0, 0, 0};
+            } else if (opaque.x <= visible->x && opaque.x + opaque.width >= visible->x + visible->width) {
+                // Spans the full width, so the covered rows at the top or bottom can be dropped
+                if (opaque.y <= visible->y && opaque.y + opaque.height > visible->y) {
+                    visible->height -= opaque.y + opaque.height - visible->y;
+                    visible->y = opaque.y + opaque.height;
+                } else if (opaque.y < visible->y + visible->height && opaque.y + opaque.height >= visible->y + visible->height) {
+                    visible->height = opaque.y - visible->y;
+                }
+            } else if (opaque.y <= visible->y && opaque.y + opaque.height >= visible->y + visible->height) {
+                // Spans the full height, so the covered columns at the left or right can be dropped
+                if (opaque.x <= visible->x && opaque.x + opaque.width > visible->x) {
+                    visible->width -= opaque.x + opaque.width - visible->x;
+                    visible->x = opaque.x + opaque.width;
+                } else if (opaque.x < visible->x + visible->width && opaque.x + opaque.width >= visible->x + visible->width) {
+                    visible->width = opaque.x - visible->x;
+                }
+            }
+        }
+    }
+
+    return base;
+}
+
+/*
+ * Initializes a PNG_Image_With_Loc struct in the given slot of the stack.
+ * This function violates the constness of the PNG_Image_With_Loc struct in order to reuse its slot and also gives it's fields values.
  */
-PNG_Image_With_Loc* create_png_image_with_loc(const PNG_Image *const image, const int x, const int y) {
-    // Allocate memory for PNG_Image_With_Loc
-    PNG_Image_With_Loc* immutable = (PNG_Image_With_Loc*)malloc(sizeof(PNG_Image_With_Loc));
+PNG_Image_With_Loc* init_png_image_with_loc(PNG_Image_With_Loc* immutable, const PNG_Image *const image, const Layer_Fill fill, const int x, const int y, const Layer_Options options, const Image_Rect clip,
+                                            Layer_Group *const group) {
     if (immutable) {
         // Cast away the const-ness of the struct pointer to allow initialization
         PNG_Image_With_Loc* nonimm = (void*)immutable;
@@ -40,8 +748,12 @@ PNG_Image_With_Loc* create_png_image_with_loc(const PNG_Image *const image, cons
         // Since the fields themselves are const, it is necessary to cast the address of each field
         // and then use the dereferenced pointer to assign a value.
         *(const PNG_Image**)(&nonimm->image) = image;
+        *(Layer_Fill*)(&nonimm->fill) = fill;
         *(int*)(&nonimm->x) = x;
         *(int*)(&nonimm->y) = y;
+        *(Layer_Options*)(&nonimm->options) = options;
+        *(Image_Rect*)(&nonimm->clip) = clip;
+        *(Layer_Group**)(&nonimm->group) = group;
     }
     return immutable;
 }
@@ -49,60 +761,62 @@ PNG_Image_With_Loc* create_png_image_with_loc(const PNG_Image *const image, cons
 /* 
  * Pops an item of the top of the stack.
  */
-PNG_Image_With_Loc* pop_image() {
+const PNG_Image_With_Loc* pop_image(PNG_Image_Stack* stack) {
     // This function isnt exposed because the PNG_Image_With_Loc struct is not exposed.
-    if (global_stack.top == -1) {
+    if (stack->top == -1) {
         // Stack is empty, nothing to pop
-        pthread_mutex_unlock(&stack_lock);
         return NULL;
     }
 
-    // Retrieve the top item from the stack
-    PNG_Image_With_Loc* item = global_stack.items[global_stack.top];
+    // Retrieve the top item from the stack, it stays valid until the next push
+    const PNG_Image_With_Loc* item = &stack->items[stack->top];
     
     // Decrease the stack top index
-    global_stack.top--;
+    stack->top--;
 
     // Return the popped item
     return item;
 }
 
 /*
- * Initializes the fields of the global_stack, dynamically allocates memory for the items based on the given inital capacity.
+ * Initializes the fields of the given stack, dynamically allocates memory for the items based on the given inital capacity.
+ */
+void init_image_stack(PNG_Image_Stack* stack, int capacity) {
+    stack->items = (PNG_Image_With_Loc*)malloc(sizeof(PNG_Image_With_Loc) * capacity);
+    stack->capacity = capacity;
+    stack->top = -1;
+}
+
+/*
+ * Empties the stack but keeps its storage for the next frame.
  */
-void init_image_stack(int capacity) {
-    global_stack.items = (PNG_Image_With_Loc**)malloc(sizeof(PNG_Image_With_Loc*) * capacity);
-    global_stack.capacity = capacity;
-    global_stack.top = -1;
+void clear_image_stack(PNG_Image_Stack* stack){
+    stack->top = -1;
 }
 
 /*
  * Deallocates everything except the included PNG_Image* entries in the PNG_Image_With_Loc struct (separate function).
  * Resets everything to a default value.
  */
-void reset_image_stack(){
-    PNG_Image_With_Loc* current;
-    while((current = pop_image())){
-        if(current) free(current);
-    }
-    if(global_stack.items) free(global_stack.items);
-    global_stack.items = NULL;
-    global_stack.capacity = 0; // A capacity of 0 means that the stack will be resized next time an image is pushed
-    global_stack.top = -1;
+void reset_image_stack(PNG_Image_Stack* stack){
+    if(stack->items) free(stack->items);
+    stack->items = NULL;
+    stack->capacity = 0; // A capacity of 0 means that the stack will be resized next time an image is pushed
+    stack->top = -1;
 }
 
 /*
  * Resizes the stack.
  */
-void resize_stack() {
+void resize_stack(PNG_Image_Stack* stack) {
     //TODO: use a moving average instead
-    int new_capacity = (global_stack.capacity + 1) * 2; // +1 to avoid a case where the capacity is 0, and stays 0
-    // This will behave like malloc if globalstack.items is null
-    PNG_Image_With_Loc** new_items = (PNG_Image_With_Loc**)realloc(global_stack.items, sizeof(PNG_Image_With_Loc*) * new_capacity);
+    int new_capacity = (stack->capacity + 1) * 2; // +1 to avoid a case where the capacity is 0, and stays 0
+    // This will behave like malloc if stack->items is null
+    PNG_Image_With_Loc* new_items = (PNG_Image_With_Loc*)realloc(stack->items, sizeof(PNG_Image_With_Loc) * new_capacity);
 
     if (new_items) {
-        global_stack.items = new_items;
-        global_stack.capacity = new_capacity;
+        stack->items = new_items;
+        stack->capacity = new_capacity;
     } else {
         // Handle reallocation failure
         exit(EXIT_FAILURE); //TODO: too drastic, change this to something more graceful
@@ -116,117 +830,2091 @@ void resize_stack() {
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////// STACK FUNCTIONS ///////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////// PARALLEL FLATTENING //////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*
- * Mark the given image to be rendered in a single flat image, obtained by calling get_flattened_image().
- * Images pushed sooner will overlap with and draw on top of images pushed later.
- * Images are rendered at the given X & Y coordinates, where the top left corner is (0, 0). X increases going right and Y increases going down.
- * The last image to be pushed is used as the background, and pixels that fall outside of it's boundaries will be discarded.
- * Images pushed in this way are not deallocated.
+ * Composites every layer into one region of the canvas.
+ * The base layer covers the whole canvas, so its rows are copied into the region instead of blended.
+ * Every layer above it is blended on top, clipped to the region and to the part of the layer left visible by culling.
+ * BGRX targets have 4 bytes per pixel as well, so each tile is composited as RGBA right where it ends up and matted in place while it is
+ * still in cache. No scratch buffer is needed, which keeps the stacks of pool threads small.
  */
-void push_image_raw(const PNG_Image *const image, int x, int y) {
-    pthread_mutex_lock(&stack_lock);
+void composite_region(const Composite_Target* target, const Composite_Layer* layers, int layer_count, int base_layer, Image_Rect region) {
+    if (target->bgrx) {
+        Composite_Target rgba = *target;
+        rgba.bgrx = false;
+        for (int tile_y = region.y; tile_y < region.y + region.height; tile_y += TILE_HEIGHT) {
+            for (int tile_x = region.x; tile_x < region.x + region.width; tile_x += TILE_WIDTH) {
+                Image_Rect tile = intersect_rects(region, (Image_Rect){tile_x, tile_y, TILE_WIDTH, TILE_HEIGHT});
+                composite_region(&rgba, layers, layer_count, base_layer, tile);
+                for (int y = tile.y; y < tile.y + tile.height; y++) {
+                    unsigned char* row = target_pixel(target, tile.x, y);
+                    matte_row_to_bgrx(row, row, tile.width, target->matte, target->premultiplied);
+                }
+            }
+        }
+        return;
+    }
 
-    if (global_stack.top == global_stack.capacity - 1) {
-        // Resize the stack if it is full
-        resize_stack();
+    const Composite_Layer* base = &layers[base_layer];
+    bool modulated = base->options.opacity != 255 || (base->options.tint & 0xFFFFFF) != 0xFFFFFF;
+    if (!base->image || is_layer_scaled(base) || modulated || base->image->premultiplied != target->premultiplied) {
+        // The base of a region replaces what is there. Fills, nine slices, faded or tinted bases and bases in the other alpha representation
+        // are replaced in through the blend paths, which apply their opacity and tint and convert the representation on the way
+        Composite_Layer replaced = *base;
+        replaced.options.blend_mode = BLEND_REPLACE;
+        blend_image_clipped(target, &replaced, region);
+    } else {
+        // Compact bases are expanded straight into the target, RGBA bases are copied
+        for (int y = region.y; y < region.y + region.height; y++) {
+            png_expand_row(base->image, region.x - base->x + base->source.x, y - base->y + base->source.y, region.width, target_pixel(target, region.x, y));
+        }
     }
-    
-    global_stack.items[++global_stack.top] = create_png_image_with_loc(image, x, y);
 
-    pthread_mutex_unlock(&stack_lock);
+    for (int i = base_layer + 1; i < layer_count; i++) {
+        Image_Rect clip = intersect_rects(region, layers[i].visible);
+        if (is_rect_empty(clip)) continue;
+        blend_image_clipped(target, &layers[i], clip);
+    }
 }
 
 /*
- * Mark the given image to be rendered in a single flat image, obtained by calling get_flattened_image().
- * Images pushed sooner will overlap with and draw on top of images pushed later.
- * Images are rendered at the given X & Y coordinates, where the top left corner is (0, 0). X increases going right and Y increases going down.
- * The last image to be pushed is used as the background, and pixels that fall outside of it's boundaries will be discarded.
- * Images pushed in this way are automatically deallocated after get_flattened_image() is called.
+ * Drops one reference to a flatten job, the last thread out frees it
  */
-void push_image(PNG_Image* image, int x, int y) {
-    // TODO: Implement this
-    // Push the image and mark it for later deletion
+void release_flatten_job(Flatten_Job* job) {
+    pthread_mutex_lock(&job->lock);
+    bool last = --job->references == 0;
+    pthread_mutex_unlock(&job->lock);
+
+    if (last) {
+        pthread_cond_destroy(&job->all_done);
+        pthread_mutex_destroy(&job->lock);
+        free(job->tiles);
+        free(job);
+    }
 }
 
 /*
- * Flattens all the images pushed prior to calling this function into a single image and resets the stack.
- * Any PNG_Images not pushed with push_image_raw will be deallocated when you call this function.
- * Returns a pointer to a newly created PNG_Image which is the result of layer all the pushed images on top of each other.
- * The first image to be pushed will be the topmost layer, and the last image to be pushed will be the background layer.
+ * Claims and composites tiles until none are left
  */
-PNG_Image* get_flattened_image() {
-    pthread_mutex_lock(&stack_lock);
-    
-    if (global_stack.top < 0) { // No images to flatten
-        pthread_mutex_unlock(&stack_lock);
-        return NULL;
-    }
+void work_on_flatten_job(Flatten_Job* job) {
+    int tile;
+    while ((tile = atomic_fetch_add(&job->next_tile, 1)) < job->tile_count) {
+        composite_region(&job->target, job->layers, job->layer_count, job->base_layer, job->tiles[tile]);
 
-    // Create a new PNG_Image to serve as the canvas
-    // Assume background dimensions are set by the first image in the stack
-    PNG_Image_With_Loc* current;
-    PNG_Image* flattened = NULL;
-    // Iterate through the stack
-    while((current = pop_image())){
-        // For each image, blend it onto the flattened canvas considering its X, Y coordinates
-        if(!flattened){
-            flattened = png_copy_image(current->image);
-        } else {
-            PNG_Image* temp = blend_images(flattened, current->image, current->x, current->y);
-            png_destroy_image(&flattened);
-            flattened = temp;
+        pthread_mutex_lock(&job->lock);
+        if (++job->tiles_done == job->tile_count) {
+            pthread_cond_broadcast(&job->all_done);
         }
-        free(current); // Don't need this anymore
+        pthread_mutex_unlock(&job->lock);
     }
-
-    reset_image_stack();
-    
-    pthread_mutex_unlock(&stack_lock);
-    
-    return flattened;
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////// IMAGE MANIPULATION ///////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
 /*
- * Blends the given image onto the given canvas, dropping any pixels which fall out of bounds.
- * Specified X & Y determine where the topleft corner of the image is drawn on the canvas.
- * Returns a pointer to a newly created PNG_Image
+ * Pool task which helps with a flatten job, with a function signature acceptable for submit_task
  */
-PNG_Image* blend_images(const PNG_Image* const canvas, const PNG_Image* const image, int image_x, int image_y) {
-    // Make a deep copy of the canvas to use as a base for blending
-    PNG_Image* result = png_copy_image(canvas);
+void* flatten_tile_task(void* arg) {
+    Flatten_Job* job = (Flatten_Job*)arg;
+    work_on_flatten_job(job);
+    release_flatten_job(job);
+    return NULL;
+}
 
-    // Iterate over each pixel in the source image
-    for (int y = 0; y < image->height; y++) {
-        for (int x = 0; x < image->width; x++) {
-            // Calculate the destination pixel's position on the canvas
-            int dest_x = image_x + x;
-            int dest_y = image_y + y;
-            
-            // Check if the pixel is within the canvas boundaries
-            if (dest_x < 0 || dest_y < 0 || dest_x >= result->width || dest_y >= result->height) {
-                continue; // Skip this pixel, it's outside the canvas
-            }
-            
-            // Calculate the address of the current pixel in both the source and destination images
-            png_bytep src_pixel = &image->data[(y * image->width + x) * 4]; // Source pixel in the image
-            png_bytep dest_pixel = &result->data[(dest_y * result->width + dest_x) * 4]; // Destination pixel on the canvas copy
-            
-            // Perform alpha blending
-            double alpha = src_pixel[3] / 255.0; // Normalize alpha to [0, 1]
-            for (int i = 0; i < 3; i++) { // Blend RGB components
-                dest_pixel[i] = (png_byte)(alpha * src_pixel[i] + (1 - alpha) * dest_pixel[i]);
-            }
-            // Assuming the destination pixel's alpha should also consider the source pixel's alpha
-            dest_pixel[3] = (png_byte)(alpha * src_pixel[3] + (1 - alpha) * dest_pixel[3]);
+/*
+ * Splits the given region of the canvas into tiles, returns the number of tiles written to the tiles array
+ * The tiles array must have room for every tile in the region
+ */
+int split_into_tiles(Image_Rect region, Image_Rect* tiles) {
+    int count = 0;
+    for (int y = region.y; y < region.y + region.height; y += TILE_HEIGHT) {
+        for (int x = region.x; x < region.x + region.width; x += TILE_WIDTH) {
+            tiles[count].x = x;
+            tiles[count].y = y;
+            tiles[count].width = region.x + region.width - x < TILE_WIDTH ? region.x + region.width - x : TILE_WIDTH;
+            tiles[count].height = region.y + region.height - y < TILE_HEIGHT ? region.y + region.height - y : TILE_HEIGHT;
+            count++;
         }
     }
-    
+    return count;
+}
+
+/*
+ * Counts the cores available for parallel flattens, runs once per process
+ */
+static void count_flatten_cores() {
+    flatten_cores = sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/*
+ * Returns the job kept in the given storage with room for max_tiles tiles, ready to be filled in for a new flatten.
+ * A new job is only allocated when there is none yet or a pool task of an earlier flatten still holds the kept one,
+ * which it then frees itself. The storage keeps its reference, the caller does not release the job. Returns NULL if memory ran out.
+ */
+Flatten_Job* acquire_flatten_job(Flatten_Job** storage, int max_tiles) {
+    Flatten_Job* job = *storage;
+    if (job) {
+        pthread_mutex_lock(&job->lock);
+        bool shared = job->references > 1;
+        pthread_mutex_unlock(&job->lock);
+        if (shared) {
+            release_flatten_job(job);
+            job = *storage = NULL;
+        }
+    }
+
+    if (!job) {
+        job = calloc(1, sizeof(Flatten_Job));
+        if (!job) return NULL;
+        job->references = 1; // The storage
+        pthread_mutex_init(&job->lock, NULL);
+        pthread_cond_init(&job->all_done, NULL);
+        *storage = job;
+    }
+
+    // Grow the tiles only when a region has more of them than any before it
+    if (job->tile_capacity < max_tiles) {
+        Image_Rect* tiles = realloc(job->tiles, sizeof(Image_Rect) * max_tiles);
+        if (!tiles) return NULL;
+        job->tiles = tiles;
+        job->tile_capacity = max_tiles;
+    }
+    return job;
+}
+
+/*
+ * Composites every layer into the given region of the canvas using the cpu thread pool.
+ * The region is split into tiles which are composited independently, the calling thread works on tiles as well.
+ * Returns once every tile is finished. Small regions are composited on the calling thread alone.
+ * The job kept in the given storage is reused, so steady state flattens do not allocate.
+ */
+void composite_region_parallel(const Composite_Target* target, Composite_Layer* layers, int layer_count, int base_layer, Image_Rect region,
+                               Flatten_Job** kept_job) {
+    pthread_once(&flatten_cores_once, count_flatten_cores);
+    long cores = flatten_cores;
+    if (cores <= 1 || (long)region.width * region.height < PARALLEL_FLATTEN_MIN_PIXELS) {
+        composite_region(target, layers, layer_count, base_layer, region);
+        return;
+    }
+
+    int max_tiles = ((region.width + TILE_WIDTH - 1) / TILE_WIDTH) * ((region.height + TILE_HEIGHT - 1) / TILE_HEIGHT);
+    Flatten_Job* job = acquire_flatten_job(kept_job, max_tiles);
+    if (!job) {
+        // Not worth failing the frame over, fall back to a single thread
+        composite_region(target, layers, layer_count, base_layer, region);
+        return;
+    }
+
+    job->target = *target;
+    job->layers = layers;
+    job->layer_count = layer_count;
+    job->base_layer = base_layer;
+    job->tile_count = split_into_tiles(region, job->tiles);
+    atomic_store(&job->next_tile, 0);
+    job->tiles_done = 0;
+
+    // One helper per remaining core, but never more helpers than there are tiles to share
+    int helpers = cores - 1 < job->tile_count - 1 ? cores - 1 : job->tile_count - 1;
+    for (int i = 0; i < helpers; i++) {
+        pthread_mutex_lock(&job->lock);
+        job->references++;
+        pthread_mutex_unlock(&job->lock);
+
+        PoolTask task = {flatten_tile_task, job};
+        TaskID* id = submit_task(&task);
+        if (!id) {
+            // The task was never queued, so it will never drop its reference
+            release_flatten_job(job);
+            break;
+        }
+        free(id); // Completion is tracked through the job instead
+    }
+
+    // Work alongside the pool, then wait for any tiles still in progress elsewhere
+    work_on_flatten_job(job);
+    pthread_mutex_lock(&job->lock);
+    while (job->tiles_done < job->tile_count) {
+        pthread_cond_wait(&job->all_done, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Recomposites only the damaged regions of a kept frame, in place.
+ * Damaged regions are clipped to the frame, and the list is updated to hold exactly the regions which were recomposited.
+ */
+void composite_damage(PNG_Image* frame, Composite_Layer* layers, int layer_count, Damage_List* damage, Flatten_Job** kept_job) {
+    Image_Rect whole_canvas = {0, 0, frame->width, frame->height};
+    Composite_Target target = image_target(frame);
+
+    // Skip or trim layers hidden behind opaque layers before spending any time on them
+    int base_layer = cull_hidden_layers(layers, layer_count, whole_canvas);
+
+    int kept = 0;
+    for (int i = 0; i < damage->count; i++) {
+        Image_Rect region = intersect_rects(damage->rects[i], whole_canvas);
+        if (is_rect_empty(region)) continue;
+        composite_region_parallel(&target, layers, layer_count, base_layer, region, kept_job);
+        damage->rects[kept++] = region;
+    }
+    damage->count = kept;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////// FRAME CACHES /////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Starts the damage of the next update of a frame cache with the regions marked since the last one
+ * Must be called with the stack lock held
+ */
+void take_pending_damage(Frame_Cache* cache) {
+    cache->damage = cache->pending;
+    cache->pending.count = 0;
+}
+
+/*
+ * Records the display list of the given layers into the cache, without replacing the list of the last flatten yet.
+ * Returns the recorded list, or NULL if memory ran out.
+ */
+Layer_Snapshot* record_display_list(Frame_Cache* cache, const Composite_Layer* layers, int layer_count) {
+    // Grow both display lists together, only when a frame has more layers than any before it
+    if (cache->capacity < layer_count) {
+        Layer_Snapshot* grown_layers = realloc(cache->layers, sizeof(Layer_Snapshot) * layer_count);
+        if (grown_layers) cache->layers = grown_layers;
+        Layer_Snapshot* grown_next = realloc(cache->next_layers, sizeof(Layer_Snapshot) * layer_count);
+        if (grown_next) cache->next_layers = grown_next;
+        if (!grown_layers || !grown_next) {
+            perror("failed to allocate layers for flattening");
+            return NULL;
+        }
+        cache->capacity = layer_count;
+    }
+
+    // Record what each layer draws, to compare against now and the next call
+    Layer_Snapshot* snapshots = cache->next_layers;
+    for (int i = 0; i < layer_count; i++) {
+        const PNG_Image* image = layers[i].image;
+        const PNG_Image* mask = layers[i].options.mask;
+        snapshots[i] = (Layer_Snapshot){image, image ? image->generation : 0, mask ? mask->generation : 0, layers[i].fill, layer_bounds(&layers[i]),
+                                        layers[i].options, layers[i].clip};
+    }
+    return snapshots;
+}
+
+/*
+ * Makes the display list recorded last the one the next flatten is compared against
+ */
+void keep_display_list(Frame_Cache* cache, Layer_Snapshot* snapshots, int layer_count) {
+    cache->next_layers = cache->layers;
+    cache->layers = snapshots;
+    cache->layer_count = layer_count;
+}
+
+/*
+ * Brings the kept frame up to date with a display list recorded by record_display_list, then keeps the list.
+ * Only regions where the list differs from the previous one, or which were marked as damaged, are composited again.
+ * Returns the kept frame, or NULL if memory ran out.
+ */
+const PNG_Image* update_kept_frame(Frame_Cache* cache, Composite_Layer* layers, int layer_count, Layer_Snapshot* snapshots) {
+    const Composite_Layer* background = &layers[0];
+    Image_Rect whole_canvas = layer_bounds(background);
+
+    // A changed background, or a background of a different size or representation, invalidates the whole frame
+    PNG_Image* frame = cache->frame;
+    bool full_damage = !frame || cache->layer_count == 0 || !snapshots_draw_same(&cache->layers[0], &snapshots[0])
+        || frame->width != whole_canvas.width || frame->height != whole_canvas.height
+        || frame->premultiplied != background->premultiplied;
+
+    if (full_damage) {
+        png_destroy_image(&cache->frame);
+        cache->frame = png_allocate_image(whole_canvas.width, whole_canvas.height, background->premultiplied);
+        cache->damage.count = 0;
+        add_damage(&cache->damage, whole_canvas);
+    } else {
+        damage_changed_layers(&cache->damage, cache->layers, cache->layer_count, snapshots, layer_count);
+    }
+
+    if (!cache->frame) {
+        cache->layer_count = 0; // Nothing kept to compare the next call against
+        return NULL;
+    }
+
+    if (cache->damage.count > 0) {
+        composite_damage(cache->frame, layers, layer_count, &cache->damage, &cache->job);
+    }
+
+    // This display list is what the next call is compared against
+    keep_display_list(cache, snapshots, layer_count);
+
+    return cache->frame;
+}
+
+/*
+ * Records the display list of the given layers and brings the kept frame up to date with it.
+ * Only regions where the list differs from the previous one, or which were marked as damaged, are composited again,
+ * so pushing the same layers as last time costs nothing beyond recording the list. The damage list is left holding what was recomposited.
+ * Returns the kept frame, or NULL if there are no layers or memory ran out.
+ */
+const PNG_Image* update_frame_cache(Frame_Cache* cache, Composite_Layer* layers, int layer_count) {
+    if (layer_count == 0) return NULL; // No images to flatten
+
+    Layer_Snapshot* snapshots = record_display_list(cache, layers, layer_count);
+    if (!snapshots) return NULL;
+    return update_kept_frame(cache, layers, layer_count, snapshots);
+}
+
+/*
+ * Flattens the given layers into a new image which the caller owns, keeping a frame in the cache only while its display list repeats.
+ * With a kept frame, the caller gets a copy of it. Without one, the layers are composited straight into the returned image
+ * and only their display list is recorded. The first frame which does not repeat the last one drops the kept frame,
+ * so frames which stopped repeating cost neither a second frame of memory nor a copy. Returns NULL if there are no layers or memory ran out.
+ */
+PNG_Image* flatten_through_frame_cache(Frame_Cache* cache, Composite_Layer* layers, int layer_count) {
+    if (layer_count == 0) return NULL; // No images to flatten
+
+    Layer_Snapshot* snapshots = record_display_list(cache, layers, layer_count);
+    if (!snapshots) return NULL;
+
+    bool repeats = cache->damage.count == 0 && cache->layer_count == layer_count;
+    for (int i = 0; repeats && i < layer_count; i++) {
+        repeats = snapshots_draw_same(&cache->layers[i], &snapshots[i]);
+    }
+
+    if (!repeats) {
+        png_destroy_image(&cache->frame);
+
+        Image_Rect whole_canvas = layer_bounds(&layers[0]);
+        PNG_Image* flattened = png_allocate_image(whole_canvas.width, whole_canvas.height, layers[0].premultiplied);
+        if (!flattened) {
+            cache->layer_count = 0;
+            return NULL;
+        }
+        cache->damage.count = 0;
+        add_damage(&cache->damage, whole_canvas);
+        composite_damage(flattened, layers, layer_count, &cache->damage, &cache->job);
+        keep_display_list(cache, snapshots, layer_count);
+        return flattened;
+    }
+
+    // The display list repeated, so it is worth keeping a frame which the next repeats are copied from
+    const PNG_Image* frame = update_kept_frame(cache, layers, layer_count, snapshots);
+    return frame ? png_copy_image(frame) : NULL;
+}
+
+/*
+ * Deallocates the frame and display lists held by a frame cache
+ */
+void destroy_frame_cache(Frame_Cache* cache) {
+    png_destroy_image(&cache->frame);
+    free(cache->layers);
+    free(cache->next_layers);
+    if (cache->job) release_flatten_job(cache->job);
+    *cache = (Frame_Cache){0};
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////// COMPOSITE CONTEXTS //////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Creates an independent compositing context with its own image stack, incremental state and retained scene.
+ * Contexts share nothing, so different threads can each build and flatten frames in their own context without waiting on each other.
+ * Returns NULL on failure.
+ */
+Composite_Context* composite_context_create() {
+    Composite_Context* context = calloc(1, sizeof(Composite_Context));
+    if (!context) {
+        perror("failed to allocate compositing context");
+        return NULL;
+    }
+
+    context->stack.top = -1; // Empty, the items are allocated on the first push
+    pthread_mutex_init(&context->stack_lock, NULL);
+    pthread_mutex_init(&context->flatten_lock, NULL);
+    pthread_mutex_init(&context->scene.lock, NULL);
+
+    return context;
+}
+
+/*
+ * Deallocates a compositing context along with everything it still holds, including frames it returned and its retained layers.
+ * Images pushed to the context or drawn by its layers are not deallocated. Sets the given pointer to NULL.
+ * The context must not be in use by any other thread.
+ */
+void composite_context_destroy(Composite_Context** context_ptr) {
+    if (!context_ptr || !*context_ptr) return;
+    Composite_Context* context = *context_ptr;
+
+    reset_image_stack(&context->stack);
+    free(context->clips);
+    destroy_frame_cache(&context->incremental);
+    destroy_frame_cache(&context->memoized);
+    free(context->scratch);
+
+    for (int i = 0; i < context->scene.count; i++) {
+        free(context->scene.layers[i]);
+    }
+    free(context->scene.layers);
+    png_destroy_image(&context->scene.frame);
+    free(context->scene.scratch);
+    if (context->scene.job) release_flatten_job(context->scene.job);
+    if (context->target_job) release_flatten_job(context->target_job);
+
+    pthread_mutex_destroy(&context->stack_lock);
+    pthread_mutex_destroy(&context->flatten_lock);
+    pthread_mutex_destroy(&context->scene.lock);
+
+    free(context);
+    *context_ptr = NULL;
+}
+
+/*
+ * Returns the scratch layer list of the context with room for at least count layers, growing it if needed
+ * Must be called with the flatten lock held. Returns NULL on failure.
+ */
+Composite_Layer* context_scratch_layers(Composite_Context* context, int count) {
+    if (context->scratch_capacity < count) {
+        Composite_Layer* new_scratch = realloc(context->scratch, sizeof(Composite_Layer) * count);
+        if (!new_scratch) return NULL;
+        context->scratch = new_scratch;
+        context->scratch_capacity = count;
+    }
+    return context->scratch;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////// STACK FUNCTIONS ///////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Pushes an image or a fill onto the stack of the given context, to be drawn with the given layer options, NULL for the defaults
+ * The layer keeps the clip rectangles active on the context at the time. The group is the one whose surface the image is, if any.
+ */
+void context_push_layer(Composite_Context *const context, const PNG_Image *const image, Layer_Fill fill, int x, int y, const Layer_Options *const options,
+                        Layer_Group *const group) {
+    if (!context) return;
+    Layer_Options layer_options = options ? *options : LAYER_OPTIONS_DEFAULT;
+    pthread_mutex_lock(&context->stack_lock);
+
+    if (context->stack.top == context->stack.capacity - 1) {
+        // Resize the stack if it is full
+        resize_stack(&context->stack);
+    }
+    
+    context->stack.top++;
+    Image_Rect clip = context->clip_count > 0 ? context->clips[context->clip_count - 1] : NO_CLIP;
+    init_png_image_with_loc(&context->stack.items[context->stack.top], image, fill, x, y, layer_options, clip, group);
+
+    pthread_mutex_unlock(&context->stack_lock);
+}
+
+/*
+ * Same as push_image_raw(), but on the given context instead of the default one
+ */
+void context_push_image_raw(Composite_Context *const context, const PNG_Image *const image, int x, int y) {
+    context_push_image_with_options(context, image, x, y, NULL);
+}
+
+/*
+ * Same as push_image_with_options(), but on the given context instead of the default one
+ */
+void context_push_image_with_options(Composite_Context *const context, const PNG_Image *const image, int x, int y, const Layer_Options *const options) {
+    context_push_layer(context, image, (Layer_Fill){0, 0, 0, false}, x, y, options, NULL);
+}
+
+/*
+ * Mark the given image to be rendered in a single flat image, obtained by calling get_flattened_image().
+ * Images pushed sooner will overlap with and draw on top of images pushed later.
+ * Images are rendered at the given X & Y coordinates, where the top left corner is (0, 0). X increases going right and Y increases going down.
+ * The last image to be pushed is used as the background, and pixels that fall outside of it's boundaries will be discarded.
+ * Images pushed in this way are not deallocated.
+ */
+void push_image_raw(const PNG_Image *const image, int x, int y) {
+    context_push_image_raw(&default_context, image, x, y);
+}
+
+/*
+ * Same as push_image_raw(), but the image is drawn with the given layer options, NULL for the defaults.
+ * The options are copied, so they do not need to outlive the call.
+ */
+void push_image_with_options(const PNG_Image *const image, int x, int y, const Layer_Options *const options) {
+    context_push_image_with_options(&default_context, image, x, y, options);
+}
+
+/*
+ * Same as push_fill_rect_with_options(), but on the given context instead of the default one
+ */
+void context_push_fill_rect_with_options(Composite_Context *const context, uint32_t rgba, int x, int y, int width, int height, const Layer_Options *const options) {
+    context_push_layer(context, NULL, (Layer_Fill){rgba, width, height, png_get_premultiplied_loading()}, x, y, options, NULL);
+}
+
+/*
+ * Same as push_fill_rect(), but on the given context instead of the default one
+ */
+void context_push_fill_rect(Composite_Context *const context, uint32_t rgba, int x, int y, int width, int height) {
+    context_push_fill_rect_with_options(context, rgba, x, y, width, height, NULL);
+}
+
+/*
+ * Same as push_fill_rect(), but the fill is drawn with the given layer options, NULL for the defaults.
+ * Source rectangles and nine slices do not apply to fills.
+ */
+void push_fill_rect_with_options(uint32_t rgba, int x, int y, int width, int height, const Layer_Options *const options) {
+    context_push_fill_rect_with_options(&default_context, rgba, x, y, width, height, options);
+}
+
+/*
+ * Mark a rectangle of solid color, given as 0xRRGGBBAA, to be rendered by get_flattened_image().
+ * Fills are drawn straight into the frame and never allocate or hold pixels. Pushed last, a fill becomes the background and sets the size of the frame,
+ * in the alpha representation png_set_premultiplied_loading() asks for.
+ */
+void push_fill_rect(uint32_t rgba, int x, int y, int width, int height) {
+    context_push_fill_rect_with_options(&default_context, rgba, x, y, width, height, NULL);
+}
+
+/*
+ * Same as push_clip_rect(), but on the given context instead of the default one
+ */
+void context_push_clip_rect(Composite_Context *const context, int x, int y, int width, int height) {
+    if (!context) return;
+    pthread_mutex_lock(&context->stack_lock);
+
+    if (context->clip_count == context->clip_capacity) {
+        int new_capacity = (context->clip_capacity + 1) * 2;
+        Image_Rect* new_clips = realloc(context->clips, sizeof(Image_Rect) * new_capacity);
+        if (!new_clips) {
+            pthread_mutex_unlock(&context->stack_lock);
+            perror("failed to allocate clip rectangle");
+            return;
+        }
+        context->clips = new_clips;
+        context->clip_capacity = new_capacity;
+    }
+
+    // Stored already intersected with the enclosing clips, so pushing a layer only reads the innermost one
+    Image_Rect clip = {x, y, width > 0 ? width : 0, height > 0 ? height : 0};
+    if (context->clip_count > 0) clip = intersect_rects(clip, context->clips[context->clip_count - 1]);
+    context->clips[context->clip_count++] = clip;
+
+    pthread_mutex_unlock(&context->stack_lock);
+}
+
+/*
+ * Restricts every image and fill pushed from now on to the given rectangle of the canvas, until the matching pop_clip_rect().
+ * Clip rectangles nest, a layer is drawn only where every clip active when it was pushed overlaps.
+ * Clipping costs nothing per pixel, the part of each layer to draw is worked out once when flattening, so a scrolled list can be pushed
+ * whole and only its visible part is composited. The background defines the frame and is never clipped. Clips stay active across flattens.
+ */
+void push_clip_rect(int x, int y, int width, int height) {
+    context_push_clip_rect(&default_context, x, y, width, height);
+}
+
+/*
+ * Same as pop_clip_rect(), but on the given context instead of the default one
+ */
+void context_pop_clip_rect(Composite_Context *const context) {
+    if (!context) return;
+    pthread_mutex_lock(&context->stack_lock);
+    if (context->clip_count > 0) context->clip_count--;
+    pthread_mutex_unlock(&context->stack_lock);
+}
+
+/*
+ * Ends the innermost clip rectangle, layers pushed from now on are only restricted by the clips around it.
+ * Does nothing if no clip rectangle is active.
+ */
+void pop_clip_rect() {
+    context_pop_clip_rect(&default_context);
+}
+
+/*
+ * Same as push_image_nine_slice(), but on the given context instead of the default one
+ */
+void context_push_image_nine_slice(Composite_Context *const context, const PNG_Image *const image, const Nine_Slice *const nine_slice, int x, int y) {
+    Layer_Options options = LAYER_OPTIONS_DEFAULT;
+    if (nine_slice) options.nine_slice = *nine_slice;
+    context_push_image_with_options(context, image, x, y, &options);
+}
+
+/*
+ * Same as push_image_raw(), but the image is drawn as a nine slice at the size the given nine slice asks for.
+ * The corners are drawn unscaled and the edges and center are stretched or tiled while compositing, no scaled copy of the image is made.
+ */
+void push_image_nine_slice(const PNG_Image *const image, const Nine_Slice *const nine_slice, int x, int y) {
+    context_push_image_nine_slice(&default_context, image, nine_slice, x, y);
+}
+
+/*
+ * Same as push_image_scaled(), but on the given context instead of the default one
+ */
+void context_push_image_scaled(Composite_Context *const context, const PNG_Image *const image, int x, int y, int width, int height, Scale_Filter filter) {
+    Layer_Options options = LAYER_OPTIONS_DEFAULT;
+    options.nine_slice = (Nine_Slice){width, height, 0, 0, 0, 0, SLICE_STRETCH}; // A nine slice without borders scales as a whole
+    options.filter = filter;
+    context_push_image_with_options(context, image, x, y, &options);
+}
+
+/*
+ * Same as push_image_raw(), but the image is drawn scaled to the given width and height, sampled with the given filter.
+ * The compositor samples the image while it blends it, so no scaled copy of the image is made. Layers in the same frame can use different filters.
+ */
+void push_image_scaled(const PNG_Image *const image, int x, int y, int width, int height, Scale_Filter filter) {
+    context_push_image_scaled(&default_context, image, x, y, width, height, filter);
+}
+
+/*
+ * Same as push_image_transformed(), but on the given context instead of the default one
+ */
+void context_push_image_transformed(Composite_Context *const context, const PNG_Image *const image, int x, int y, const Layer_Transform *const transform, Scale_Filter filter) {
+    Layer_Options options = LAYER_OPTIONS_DEFAULT;
+    if (transform) options.transform = *transform;
+    options.filter = filter;
+    context_push_image_with_options(context, image, x, y, &options);
+}
+
+/*
+ * Same as push_image_raw(), but the image is drawn through the given affine transform, sampled with the given filter.
+ * Every canvas pixel is mapped back into the image while compositing, so rotating, zooming or smoothly scrolling a layer never re-rasterizes it.
+ */
+void push_image_transformed(const PNG_Image *const image, int x, int y, const Layer_Transform *const transform, Scale_Filter filter) {
+    context_push_image_transformed(&default_context, image, x, y, transform, filter);
+}
+
+/*
+ * Same as push_image_region(), but on the given context instead of the default one
+ */
+void context_push_image_region(Composite_Context *const context, const PNG_Image *const image, Image_Rect source, int x, int y) {
+    Layer_Options options = LAYER_OPTIONS_DEFAULT;
+    options.source = source;
+    context_push_image_with_options(context, image, x, y, &options);
+}
+
+/*
+ * Same as push_image_raw(), but only the given rectangle of the image is drawn, with its top left corner at the given X & Y coordinates.
+ * Pixels are read straight out of the image, so icons packed into one atlas image never need to be copied into images of their own.
+ * The rectangle is clipped to the image.
+ */
+void push_image_region(const PNG_Image *const image, Image_Rect source, int x, int y) {
+    context_push_image_region(&default_context, image, source, x, y);
+}
+
+/*
+ * Mark the given image to be rendered in a single flat image, obtained by calling get_flattened_image().
+ * Images pushed sooner will overlap with and draw on top of images pushed later.
+ * Images are rendered at the given X & Y coordinates, where the top left corner is (0, 0). X increases going right and Y increases going down.
+ * The last image to be pushed is used as the background, and pixels that fall outside of it's boundaries will be discarded.
+ * Images pushed in this way are automatically deallocated after get_flattened_image() is called.
+ */
+void push_image(PNG_Image* image, int x, int y) {
+    // TODO: Implement this
+    // Push the image and mark it for later deletion
+}
+
+/*
+ * Takes every image off the given stack into the scratch layer list of the context, ordered from the background up, and empties the stack.
+ * Must be called with the flatten lock held, and with the stack lock held when the stack is the context's own.
+ * Returns the number of layers, 0 if the stack was empty or on failure.
+ */
+int take_stack_layers(Composite_Context* context, PNG_Image_Stack* stack) {
+    int layer_count = stack->top + 1;
+    if (layer_count == 0) return 0;
+
+    Composite_Layer* layers = context_scratch_layers(context, layer_count);
+    if (!layers) {
+        perror("failed to allocate layers for flattening");
+        clear_image_stack(stack);
+        return 0;
+    }
+    for (int i = 0; i < layer_count; i++) {
+        const PNG_Image_With_Loc* current = pop_image(stack);
+        // The background defines the canvas, so it is always drawn whole at the origin
+        if (i == 0) {
+            layers[i] = make_background_layer(current->image, &current->fill, &current->options);
+        } else {
+            layers[i] = make_composite_layer(current->image, &current->fill, current->x, current->y, &current->options);
+            layers[i].clip = intersect_rects(layers[i].clip, current->clip);
+        }
+    }
+
+    // The storage is kept, so pushing the next frame does not allocate
+    clear_image_stack(stack);
+    return layer_count;
+}
+
+/*
+ * Same as get_flattened_image(), but on the given context instead of the default one
+ */
+PNG_Image* context_get_flattened_image(Composite_Context *const context) {
+    if (!context) return NULL;
+    pthread_mutex_lock(&context->flatten_lock);
+    pthread_mutex_lock(&context->stack_lock);
+
+    int layer_count = take_stack_layers(context, &context->stack);
+    take_pending_damage(&context->memoized); // Along with the layers
+
+    // The stack is free for the next frame while this one is composited
+    pthread_mutex_unlock(&context->stack_lock);
+
+    // Frames pushed the same way as the last one are not composited again, only what differs is
+    PNG_Image* flattened = flatten_through_frame_cache(&context->memoized, context->scratch, layer_count);
+
+    pthread_mutex_unlock(&context->flatten_lock);
+    
+    return flattened;
+}
+
+/*
+ * Flattens all the images pushed prior to calling this function into a single image and resets the stack.
+ * Returns a new PNG_Image holding all the pushed images layered on top of each other, which the caller owns and destroys with
+ * png_destroy_image(). The pushed images are not deallocated.
+ * The first image to be pushed will be the topmost layer, and the last image to be pushed will be the background layer.
+ * The result uses the alpha representation of the background layer, premultiplied layers compose correctly in any grouping.
+ * The display list of the last frame is kept, and once the same layers are pushed twice in a row the frame is kept as well.
+ * From then on pushing the same layers returns a copy of the kept frame without compositing, and when only some layers differ
+ * only the area they cover is composited again. Frames which differ every time are composited straight into the returned image.
+ */
+PNG_Image* get_flattened_image() {
+    return context_get_flattened_image(&default_context);
+}
+
+/*
+ * Flattens all the images pushed to the context into the given target, and resets its stack.
+ * Only the part of the target the background covers is written. Returns false if there was nothing to flatten, true otherwise.
+ */
+bool context_flatten_into_target(Composite_Context* context, Composite_Target* target) {
+    pthread_mutex_lock(&context->flatten_lock);
+    pthread_mutex_lock(&context->stack_lock);
+
+    int layer_count = take_stack_layers(context, &context->stack);
+
+    // The stack is free for the next frame while this one is composited
+    pthread_mutex_unlock(&context->stack_lock);
+
+    if (layer_count == 0 || is_rect_empty(layer_bounds(&context->scratch[0]))) { // No images to flatten
+        pthread_mutex_unlock(&context->flatten_lock);
+        return false;
+    }
+
+    // The background is drawn at the origin, so only the part of the target it covers can be composited
+    Composite_Layer* layers = context->scratch;
+    Image_Rect covered = intersect_rects((Image_Rect){0, 0, target->width, target->height}, layer_bounds(&layers[0]));
+    target->premultiplied = layers[0].premultiplied;
+
+    // Skip or trim layers hidden behind opaque layers before spending any time on them
+    int base_layer = cull_hidden_layers(layers, layer_count, covered);
+    composite_region_parallel(target, layers, layer_count, base_layer, covered, &context->target_job);
+
+    pthread_mutex_unlock(&context->flatten_lock);
+
+    return true;
+}
+
+/*
+ * Same as get_flattened_image_into(), but on the given context instead of the default one
+ */
+bool context_get_flattened_image_into(Composite_Context *const context, unsigned char* buffer, int width, int height, size_t stride) {
+    if (!context || !buffer || width <= 0 || height <= 0 || stride < (size_t)width * 4) return false;
+    Composite_Target target = {buffer, width, height, stride, false, NULL, false, 0};
+    return context_flatten_into_target(context, &target);
+}
+
+/*
+ * Flattens all the images pushed prior to calling this function into a buffer owned by the caller instead of a new PNG_Image, and resets the stack.
+ * The buffer holds width x height RGBA pixels, each row starting stride bytes after the previous one, and receives the alpha
+ * representation of the background layer. Only the part of the buffer the background covers is written, the rest is left untouched.
+ * Once a frame of similar size has been flattened no memory is allocated, so the buffer can be reused every frame.
+ * Returns false if there was nothing to flatten or the buffer is invalid, true otherwise.
+ */
+bool get_flattened_image_into(unsigned char* buffer, int width, int height, size_t stride) {
+    return context_get_flattened_image_into(&default_context, buffer, width, height, stride);
+}
+
+/*
+ * Same as get_flattened_image_into_bgrx(), but on the given context instead of the default one
+ */
+bool context_get_flattened_image_into_bgrx(Composite_Context *const context, unsigned char* buffer, int width, int height, size_t stride, uint32_t matte) {
+    if (!context || !buffer || width <= 0 || height <= 0 || stride < (size_t)width * 4) return false;
+    Composite_Target target = {buffer, width, height, stride, false, NULL, true, matte};
+    return context_flatten_into_target(context, &target);
+}
+
+/*
+ * Flattens all the images pushed prior to calling this function straight into a buffer in the display's BGRX layout, and resets the stack.
+ * The buffer holds width x height 32 bit pixels stored as blue, green, red and an unused byte, each row starting stride bytes after
+ * the previous one, such as the data of a 24 or 32 bit ZPixmap XImage. The frame is flattened onto the opaque matte color,
+ * given as 0xRRGGBB, on the way. Every tile is matted and converted while it is still in cache, so no RGBA frame is ever written.
+ * Only the part of the buffer the background covers is written, the rest is left untouched.
+ * Returns false if there was nothing to flatten or the buffer is invalid, true otherwise.
+ */
+bool get_flattened_image_into_bgrx(unsigned char* buffer, int width, int height, size_t stride, uint32_t matte) {
+    return context_get_flattened_image_into_bgrx(&default_context, buffer, width, height, stride, matte);
+}
+
+/*
+ * Same as add_damage_rect(), but on the given context instead of the default one
+ */
+void context_add_damage_rect(Composite_Context *const context, int x, int y, int width, int height) {
+    if (!context) return;
+    pthread_mutex_lock(&context->stack_lock);
+    add_damage(&context->incremental.pending, (Image_Rect){x, y, width, height});
+    add_damage(&context->memoized.pending, (Image_Rect){x, y, width, height});
+    pthread_mutex_unlock(&context->stack_lock);
+}
+
+/*
+ * Marks a region of the flattened image as changed, so the next flatten recomposites it.
+ * Rarely needed: moved and swapped layers are found automatically, and so are images changed in place as long as they got a new generation.
+ */
+void add_damage_rect(int x, int y, int width, int height) {
+    context_add_damage_rect(&default_context, x, y, width, height);
+}
+
+/*
+ * Same as get_flattened_image_incremental(), but on the given context instead of the default one
+ */
+const PNG_Image* context_get_flattened_image_incremental(Composite_Context *const context, const Image_Rect** damage_rects, int* damage_count) {
+    if (damage_rects) *damage_rects = NULL;
+    if (damage_count) *damage_count = 0;
+    if (!context) return NULL;
+
+    pthread_mutex_lock(&context->flatten_lock);
+    pthread_mutex_lock(&context->stack_lock);
+
+    int layer_count = take_stack_layers(context, &context->stack);
+    take_pending_damage(&context->incremental); // Along with the layers
+
+    // The stack is free for the next frame while this one is composited
+    pthread_mutex_unlock(&context->stack_lock);
+
+    const PNG_Image* result = update_frame_cache(&context->incremental, context->scratch, layer_count);
+    if (result) {
+        if (damage_rects) *damage_rects = context->incremental.damage.rects;
+        if (damage_count) *damage_count = context->incremental.damage.count;
+    }
+
+    pthread_mutex_unlock(&context->flatten_lock);
+
+    return result;
+}
+
+/*
+ * Flattens all the images pushed prior to calling this function like get_flattened_image(), but only recomposites what changed.
+ * The previous flattened image is kept, and only regions damaged by add_damage_rect() or by layers which were added, removed,
+ * moved, swapped for another image or changed in place since the previous call are composited again.
+ * Returns a pointer to the kept image, which is owned by the compositor and stays valid until the next call. Do not destroy it.
+ * If damage_rects and damage_count are given, they are set to the regions which changed, valid until the next call.
+ */
+const PNG_Image* get_flattened_image_incremental(const Image_Rect** damage_rects, int* damage_count) {
+    return context_get_flattened_image_incremental(&default_context, damage_rects, damage_count);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////// ASYNC FLATTENING ///////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Drops one reference to a flatten handle, the last one out frees it along with an image nobody took
+ */
+void release_flatten_handle(Flatten_Handle* handle) {
+    pthread_mutex_lock(&handle->lock);
+    bool last = --handle->references == 0;
+    pthread_mutex_unlock(&handle->lock);
+
+    if (last) {
+        png_destroy_image(&handle->result);
+        reset_image_stack(&handle->stack);
+        pthread_cond_destroy(&handle->finished);
+        pthread_mutex_destroy(&handle->lock);
+        free(handle);
+    }
+}
+
+/*
+ * Returns the version of the surface of a group which holds the given image, NULL if there is none
+ * Must be called with the lock of the group held
+ */
+Group_Surface* find_group_surface(Layer_Group* group, const PNG_Image* image) {
+    for (Group_Surface* surface = group->surfaces; surface; surface = surface->next) {
+        if (surface->image == image) return surface;
+    }
+    return NULL;
+}
+
+/*
+ * Marks the group surfaces among the given layers as read by an asynchronous flatten, so their groups replace them instead of writing to them
+ */
+void hold_group_surfaces(const PNG_Image_With_Loc* items, int count) {
+    for (int i = 0; i < count; i++) {
+        Layer_Group* group = items[i].group;
+        if (!group) continue;
+        pthread_mutex_lock(&group->lock);
+        Group_Surface* surface = find_group_surface(group, items[i].image);
+        if (surface) surface->readers++;
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+/*
+ * Lets go of the group surfaces marked by hold_group_surfaces, freeing the ones their groups have replaced since
+ */
+void release_group_surfaces(const PNG_Image_With_Loc* items, int count) {
+    for (int i = 0; i < count; i++) {
+        Layer_Group* group = items[i].group;
+        if (!group) continue;
+        pthread_mutex_lock(&group->lock);
+        Group_Surface* surface = find_group_surface(group, items[i].image);
+        if (surface && --surface->readers == 0) {
+            // Only the newest version is still used by the group, older ones were kept for their readers alone
+            if (surface != group->surfaces) {
+                Group_Surface** link = &group->surfaces;
+                while (*link != surface) link = &(*link)->next;
+                *link = surface->next;
+                png_destroy_image(&surface->image);
+                free(surface);
+            }
+            pthread_cond_broadcast(&group->released);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+/*
+ * Composites an asynchronous flatten and hands its image to the callback or the handle, then drops the reference of the queue
+ * The callback runs once the context is free again, so it may push and request the next frame itself.
+ */
+void flatten_async(Flatten_Handle* handle) {
+    Composite_Context* context = handle->context;
+
+    pthread_mutex_lock(&context->flatten_lock);
+    int pushed_count = handle->stack.top + 1; // Popping leaves the items in place, so their group surfaces can be released afterwards
+    int layer_count = take_stack_layers(context, &handle->stack);
+
+    // Damage is taken when the flatten runs rather than when it was requested, like a synchronous flatten would,
+    // so whichever flatten of the memoized frame runs next after add_damage_rect() recomposites the damaged regions
+    pthread_mutex_lock(&context->stack_lock);
+    take_pending_damage(&context->memoized);
+    pthread_mutex_unlock(&context->stack_lock);
+
+    // Same as context_get_flattened_image, only what differs from the last frame is composited
+    PNG_Image* flattened = flatten_through_frame_cache(&context->memoized, context->scratch, layer_count);
+    pthread_mutex_unlock(&context->flatten_lock);
+    release_group_surfaces(handle->stack.items, pushed_count);
+
+    if (handle->callback) {
+        handle->callback(flattened, handle->user_data);
+        flattened = NULL; // The callback owns it now
+    }
+
+    pthread_mutex_lock(&handle->lock);
+    handle->result = flattened;
+    handle->done = true;
+    pthread_cond_broadcast(&handle->finished);
+    pthread_mutex_unlock(&handle->lock);
+
+    release_flatten_handle(handle);
+}
+
+/*
+ * Pool task which drains the asynchronous flatten queue of a context, with a function signature acceptable for submit_task
+ * Only one of these runs per context, so frames come out in order and the memoized frame is updated in order
+ * without a pool thread ever waiting on another. Flattens requested while it runs, even from a callback, are picked up before it returns.
+ */
+void* flatten_async_task(void* arg) {
+    Composite_Context* context = (Composite_Context*)arg;
+    while (true) {
+        pthread_mutex_lock(&context->stack_lock);
+        Flatten_Handle* handle = context->async_head;
+        if (!handle) {
+            context->async_draining = false;
+            pthread_mutex_unlock(&context->stack_lock);
+            return NULL;
+        }
+        context->async_head = handle->next;
+        if (!context->async_head) context->async_tail = NULL;
+        pthread_mutex_unlock(&context->stack_lock);
+
+        flatten_async(handle);
+    }
+}
+
+/*
+ * Same as get_flattened_image_async(), but on the given context instead of the default one, which must outlive the flatten
+ */
+Flatten_Handle* context_get_flattened_image_async(Composite_Context *const context, Flatten_Callback callback, void* user_data) {
+    if (!context) return NULL;
+    Flatten_Handle* handle = calloc(1, sizeof(Flatten_Handle));
+    if (!handle) {
+        perror("failed to allocate flatten handle");
+        return NULL;
+    }
+    handle->context = context;
+    handle->stack.top = -1;
+    handle->callback = callback;
+    handle->user_data = user_data;
+    handle->references = 2; // The caller and the queue
+    pthread_mutex_init(&handle->lock, NULL);
+    pthread_cond_init(&handle->finished, NULL);
+
+    pthread_mutex_lock(&context->stack_lock);
+
+    // Copy the layers out, the stack is only cleared once the flatten is sure to run
+    int layer_count = context->stack.top + 1;
+    if (layer_count > 0) {
+        init_image_stack(&handle->stack, layer_count);
+        if (!handle->stack.items) {
+            pthread_mutex_unlock(&context->stack_lock);
+            perror("failed to allocate layers for flattening");
+            handle->references = 1;
+            release_flatten_handle(handle);
+            return NULL;
+        }
+        memcpy(handle->stack.items, context->stack.items, sizeof(PNG_Image_With_Loc) * layer_count);
+        handle->stack.top = context->stack.top;
+    }
+
+    // Start a task to drain the queue unless one is already draining it, which then picks this flatten up as well
+    if (!context->async_draining) {
+        PoolTask task = {flatten_async_task, context};
+        TaskID* id = submit_task(&task);
+        if (!id) {
+            // The pushed images stay on the stack, so the caller can still flatten them another way
+            pthread_mutex_unlock(&context->stack_lock);
+            perror("failed to submit flatten to the thread pool");
+            handle->references = 1;
+            release_flatten_handle(handle);
+            return NULL;
+        }
+        free(id); // Completion is tracked through the handles instead
+        context->async_draining = true; // The task cannot look at the queue before the lock is released
+    }
+
+    // Groups pushed onto the stack must leave their surfaces alone until this flatten is done with them
+    hold_group_surfaces(handle->stack.items, handle->stack.top + 1);
+
+    if (context->async_tail) {
+        context->async_tail->next = handle;
+    } else {
+        context->async_head = handle;
+    }
+    context->async_tail = handle;
+
+    clear_image_stack(&context->stack);
+
+    pthread_mutex_unlock(&context->stack_lock);
+
+    return handle;
+}
+
+/*
+ * Starts flattening all the images pushed prior to calling this function on the cpu thread pool and returns right away with a handle.
+ * The pushed images are taken off the stack before returning, so the next frame can be pushed while this one is composited.
+ * The result is the same image get_flattened_image() would return. If a callback is given it receives the image on a pool thread
+ * and owns it, NULL if there was nothing to flatten. Otherwise the image is collected from the handle with flatten_handle_wait().
+ * Flattens finish in the order they were requested. The pushed images must stay alive until the flatten is done.
+ * Returns NULL on failure, including when the thread pool cannot take the flatten, in which case the pushed images stay on the stack.
+ */
+Flatten_Handle* get_flattened_image_async(Flatten_Callback callback, void* user_data) {
+    return context_get_flattened_image_async(&default_context, callback, user_data);
+}
+
+/*
+ * Returns true once the flatten is done, including its callback if it has one, false while it is still in progress. Never blocks.
+ */
+bool flatten_handle_poll(Flatten_Handle *const handle) {
+    if (!handle) return false;
+    pthread_mutex_lock(&handle->lock);
+    bool done = handle->done;
+    pthread_mutex_unlock(&handle->lock);
+    return done;
+}
+
+/*
+ * Blocks until the flatten is done, then returns the flattened image, which the caller owns.
+ * Returns NULL if there was nothing to flatten, if a callback received the image, or if the image was already taken by an earlier call.
+ */
+PNG_Image* flatten_handle_wait(Flatten_Handle *const handle) {
+    if (!handle) return NULL;
+    pthread_mutex_lock(&handle->lock);
+    while (!handle->done) {
+        pthread_cond_wait(&handle->finished, &handle->lock);
+    }
+    PNG_Image* result = handle->result;
+    handle->result = NULL;
+    pthread_mutex_unlock(&handle->lock);
+    return result;
+}
+
+/*
+ * Lets go of a flatten handle without waiting for it. Sets the given pointer to NULL.
+ * A flatten still in progress runs to completion and its callback is still called, an image nobody took is deallocated.
+ */
+void flatten_handle_destroy(Flatten_Handle** handle_ptr) {
+    if (!handle_ptr || !*handle_ptr) return;
+    release_flatten_handle(*handle_ptr);
+    *handle_ptr = NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////// RETAINED LAYERS ////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Returns the part of the canvas a layer covers
+ */
+Image_Rect scene_layer_bounds(const Scene_Layer* layer) {
+    Composite_Layer resolved = make_composite_layer(layer->image, &layer->fill, layer->x, layer->y, &layer->options);
+    return layer_bounds(&resolved);
+}
+
+/*
+ * Returns true if layer a is drawn below layer b, false otherwise
+ */
+bool scene_layer_below(const Scene_Layer* a, const Scene_Layer* b) {
+    return a->z < b->z || (a->z == b->z && a->sequence < b->sequence);
+}
+
+/*
+ * Moves the layer at the given index of the scene until the scene is sorted again, assuming only that layer is out of place
+ */
+void scene_resort_layer(Scene* scene, int index) {
+    Scene_Layer** layers = scene->layers;
+    while (index > 0 && scene_layer_below(layers[index], layers[index - 1])) {
+        Scene_Layer* temp = layers[index];
+        layers[index] = layers[index - 1];
+        layers[--index] = temp;
+    }
+    while (index < scene->count - 1 && scene_layer_below(layers[index + 1], layers[index])) {
+        Scene_Layer* temp = layers[index];
+        layers[index] = layers[index + 1];
+        layers[++index] = temp;
+    }
+}
+
+/*
+ * Returns the index of the layer in the scene, or -1 if it is not in the scene
+ */
+int scene_find_layer(const Scene* scene, const Scene_Layer* layer) {
+    for (int i = 0; i < scene->count; i++) {
+        if (scene->layers[i] == layer) return i;
+    }
+    return -1;
+}
+
+/*
+ * Returns the lowest visible layer of the scene, which is drawn as the background, or NULL if no layer is visible
+ */
+const Scene_Layer* scene_background_layer(const Scene* scene) {
+    for (int i = 0; i < scene->count; i++) {
+        if (scene->layers[i]->visible) return scene->layers[i];
+    }
+    return NULL;
+}
+
+/*
+ * Damages the part of the canvas a visible layer covers, the background covers the canvas from the origin wherever it is placed
+ */
+void scene_damage_layer(Scene* scene, const Scene_Layer* layer) {
+    if (!layer->visible) return;
+    if (layer == scene_background_layer(scene)) {
+        Composite_Layer resolved = make_background_layer(layer->image, &layer->fill, &layer->options);
+        add_damage(&scene->damage, layer_bounds(&resolved));
+    } else {
+        add_damage(&scene->damage, scene_layer_bounds(layer));
+    }
+}
+
+/*
+ * Adds a layer drawing an image or a fill to the scene of the given context, returns NULL on failure
+ */
+Scene_Layer* scene_add_layer(Composite_Context *const context, const PNG_Image *const image, Layer_Fill fill, int x, int y, int z) {
+    if (!context) return NULL;
+
+    Scene_Layer* layer = malloc(sizeof(Scene_Layer));
+    if (!layer) {
+        perror("failed to allocate scene layer");
+        return NULL;
+    }
+
+    Scene* scene = &context->scene;
+    pthread_mutex_lock(&scene->lock);
+
+    if (scene->count == scene->capacity) {
+        int new_capacity = (scene->capacity + 1) * 2;
+        Scene_Layer** new_layers = realloc(scene->layers, sizeof(Scene_Layer*) * new_capacity);
+        if (!new_layers) {
+            pthread_mutex_unlock(&scene->lock);
+            perror("failed to grow scene");
+            free(layer);
+            return NULL;
+        }
+        scene->layers = new_layers;
+        scene->capacity = new_capacity;
+    }
+
+    *layer = (Scene_Layer){context, image, image ? image->generation : 0, fill, x, y, z, scene->next_sequence++, true, LAYER_OPTIONS_DEFAULT, 0};
+    scene->layers[scene->count++] = layer;
+    scene_resort_layer(scene, scene->count - 1);
+    scene_damage_layer(scene, layer);
+
+    pthread_mutex_unlock(&scene->lock);
+
+    return layer;
+}
+
+/*
+ * Same as layer_create(), but on the given context instead of the default one
+ */
+Scene_Layer* context_layer_create(Composite_Context *const context, const PNG_Image *const image, int x, int y, int z) {
+    if (!image) return NULL;
+    return scene_add_layer(context, image, (Layer_Fill){0, 0, 0, false}, x, y, z);
+}
+
+/*
+ * Creates a retained layer which draws the given image at the given X & Y coordinates until it is destroyed.
+ * Layers with a higher z are drawn on top of layers with a lower z, layers with the same z are drawn in creation order.
+ * The lowest visible layer is the background, which sets the size of the flattened scene and is drawn at (0, 0).
+ * The image is not deallocated by the layer and must outlive it. Returns NULL on failure.
+ */
+Scene_Layer* layer_create(const PNG_Image *const image, int x, int y, int z) {
+    return context_layer_create(&default_context, image, x, y, z);
+}
+
+/*
+ * Same as layer_create_fill(), but on the given context instead of the default one
+ */
+Scene_Layer* context_layer_create_fill(Composite_Context *const context, uint32_t rgba, int x, int y, int width, int height, int z) {
+    return scene_add_layer(context, NULL, (Layer_Fill){rgba, width, height, png_get_premultiplied_loading()}, x, y, z);
+}
+
+/*
+ * Creates a retained layer which fills a rectangle at the given X & Y coordinates with a solid color given as 0xRRGGBBAA until it is destroyed.
+ * The color is drawn straight into the frame, no pixels are ever allocated for it.
+ * As the background, the fill sets the size of the flattened scene, in the alpha representation png_set_premultiplied_loading() asks for.
+ * Returns NULL on failure.
+ */
+Scene_Layer* layer_create_fill(uint32_t rgba, int x, int y, int width, int height, int z) {
+    return context_layer_create_fill(&default_context, rgba, x, y, width, height, z);
+}
+
+/*
+ * Changes the color and size of a retained fill layer, layers which draw an image are left unchanged
+ */
+void layer_set_fill(Scene_Layer *const layer, uint32_t rgba, int width, int height) {
+    if (!layer || layer->image) return;
+    Scene* scene = &layer->context->scene;
+    pthread_mutex_lock(&scene->lock);
+    if (layer->fill.rgba != rgba || layer->fill.width != width || layer->fill.height != height) {
+        scene_damage_layer(scene, layer); // The old area
+        layer->fill.rgba = rgba;
+        layer->fill.width = width;
+        layer->fill.height = height;
+        scene_damage_layer(scene, layer); // The new area
+    }
+    pthread_mutex_unlock(&scene->lock);
+}
+
+/*
+ * Moves a retained layer so its top left corner is drawn at the given X & Y coordinates
+ */
+void layer_move(Scene_Layer *const layer, int x, int y) {
+    if (!layer) return;
+    Scene* scene = &layer->context->scene;
+    pthread_mutex_lock(&scene->lock);
+    if (layer->x != x || layer->y != y) {
+        scene_damage_layer(scene, layer); // Where it was
+        layer->x = x;
+        layer->y = y;
+        scene_damage_layer(scene, layer); // Where it is now
+    }
+    pthread_mutex_unlock(&scene->lock);
+}
+
+/*
+ * Changes the z order of a retained layer, layers with a higher z are drawn on top
+ */
+void layer_set_z(Scene_Layer *const layer, int z) {
+    if (!layer) return;
+    Scene* scene = &layer->context->scene;
+    pthread_mutex_lock(&scene->lock);
+    int index = scene_find_layer(scene, layer);
+    if (index >= 0 && layer->z != z) {
+        layer->z = z;
+        scene_resort_layer(scene, index);
+        scene_damage_layer(scene, layer);
+    }
+    pthread_mutex_unlock(&scene->lock);
+}
+
+/*
+ * Shows or hides a retained layer, hidden layers keep their place in the scene but are not drawn
+ */
+void layer_set_visible(Scene_Layer *const layer, bool visible) {
+    if (!layer) return;
+    Scene* scene = &layer->context->scene;
+    pthread_mutex_lock(&scene->lock);
+    if (layer->visible != visible) {
+        layer->visible = true;
+        scene_damage_layer(scene, layer);
+        layer->visible = visible;
+    }
+    pthread_mutex_unlock(&scene->lock);
+}
+
+/*
+ * Swaps the image a retained layer draws, the image is not deallocated by the layer and must outlive it
+ */
+void layer_set_image(Scene_Layer *const layer, const PNG_Image *const image) {
+    if (!layer || !image) return;
+    Scene* scene = &layer->context->scene;
+    pthread_mutex_lock(&scene->lock);
+    if (layer->image != image) {
+        scene_damage_layer(scene, layer); // The old image's area
+        layer->image = image;
+        layer->generation = image->generation;
+        scene_damage_layer(scene, layer); // The new image's area
+    }
+    pthread_mutex_unlock(&scene->lock);
+}
+
+/*
+ * Changes how a retained layer is drawn, NULL restores the defaults. The options are copied.
+ */
+void layer_set_options(Scene_Layer *const layer, const Layer_Options *const options) {
+    if (!layer) return;
+    Layer_Options new_options = options ? *options : LAYER_OPTIONS_DEFAULT;
+    Scene* scene = &layer->context->scene;
+    pthread_mutex_lock(&scene->lock);
+    if (!layer_options_equal(&layer->options, &new_options)) {
+        scene_damage_layer(scene, layer); // A new source rectangle can change the bounds, so damage both the old and new ones
+        layer->options = new_options;
+        layer->mask_generation = new_options.mask ? new_options.mask->generation : 0;
+        scene_damage_layer(scene, layer);
+    }
+    pthread_mutex_unlock(&scene->lock);
+}
+
+/*
+ * Marks a retained layer as changed, so it is recomposited on the next flatten
+ * Only needed after the pixels of its image or mask were modified in place without giving it a new generation
+ */
+void layer_mark_changed(Scene_Layer *const layer) {
+    if (!layer) return;
+    Scene* scene = &layer->context->scene;
+    pthread_mutex_lock(&scene->lock);
+    scene_damage_layer(scene, layer);
+    pthread_mutex_unlock(&scene->lock);
+}
+
+/*
+ * Removes a retained layer from the scene and deallocates it, the image it drew is not deallocated
+ * Sets the given pointer to NULL
+ */
+void layer_destroy(Scene_Layer** layer_ptr) {
+    if (!layer_ptr || !*layer_ptr) return;
+    Scene_Layer* layer = *layer_ptr;
+
+    Scene* scene = &layer->context->scene;
+    pthread_mutex_lock(&scene->lock);
+    int index = scene_find_layer(scene, layer);
+    if (index >= 0) {
+        scene_damage_layer(scene, layer);
+        if (scene->frame_base == layer) scene->frame_base = NULL; // Whichever layer takes its place redraws the whole frame
+        // Close the gap, keeping the rest of the scene in order
+        memmove(&scene->layers[index], &scene->layers[index + 1], sizeof(Scene_Layer*) * (scene->count - index - 1));
+        scene->count--;
+    }
+    pthread_mutex_unlock(&scene->lock);
+
+    free(layer);
+    *layer_ptr = NULL;
+}
+
+/*
+ * Same as get_flattened_scene(), but on the given context instead of the default one
+ */
+const PNG_Image* context_get_flattened_scene(Composite_Context *const context, const Image_Rect** damage_rects, int* damage_count) {
+    if (damage_rects) *damage_rects = NULL;
+    if (damage_count) *damage_count = 0;
+    if (!context) return NULL;
+
+    Scene* scene = &context->scene;
+    pthread_mutex_lock(&scene->lock);
+
+    // Grow the scratch list only when the scene outgrows it, so steady state frames do not allocate
+    if (scene->scratch_capacity < scene->count) {
+        Composite_Layer* new_scratch = realloc(scene->scratch, sizeof(Composite_Layer) * scene->count);
+        if (!new_scratch) {
+            pthread_mutex_unlock(&scene->lock);
+            perror("failed to allocate layers for flattening");
+            return NULL;
+        }
+        scene->scratch = new_scratch;
+        scene->scratch_capacity = scene->count;
+    }
+
+    // Gather the visible layers from the bottom up
+    int layer_count = 0;
+    for (int i = 0; i < scene->count; i++) {
+        Scene_Layer* layer = scene->layers[i];
+        if (!layer->visible) continue;
+        if (layer->image && layer->image->generation != layer->generation) { // Changed in place since the last flatten
+            scene_damage_layer(scene, layer);
+            layer->generation = layer->image->generation;
+        }
+        const PNG_Image* mask = layer->options.mask;
+        if (mask && mask->generation != layer->mask_generation) { // Same for its mask
+            scene_damage_layer(scene, layer);
+            layer->mask_generation = mask->generation;
+        }
+        // The background defines the canvas, so it is always drawn at the origin
+        bool background = layer_count == 0;
+        scene->scratch[layer_count++] = background ? make_background_layer(layer->image, &layer->fill, &layer->options)
+                                                   : make_composite_layer(layer->image, &layer->fill, layer->x, layer->y, &layer->options);
+    }
+
+    if (layer_count == 0) { // Nothing to flatten
+        pthread_mutex_unlock(&scene->lock);
+        return NULL;
+    }
+
+    // A new background, or a background of a different size or representation, invalidates the whole frame
+    const PNG_Image* background = scene->scratch[0].image;
+    const Scene_Layer* base = scene_background_layer(scene);
+    bool premultiplied = scene->scratch[0].premultiplied;
+    Image_Rect whole_canvas = layer_bounds(&scene->scratch[0]);
+    PNG_Image* frame = scene->frame;
+    if (!frame || scene->frame_background != background || frame->width != whole_canvas.width
+        || frame->height != whole_canvas.height || frame->premultiplied != premultiplied) {
+        png_destroy_image(&scene->frame);
+        scene->frame = png_allocate_image(whole_canvas.width, whole_canvas.height, premultiplied);
+        scene->frame_background = background;
+        scene->frame_base = base;
+        scene->damage.count = 0;
+        add_damage(&scene->damage, whole_canvas);
+        if (!scene->frame) {
+            pthread_mutex_unlock(&scene->lock);
+            return NULL;
+        }
+    } else if (scene->frame_base != base) {
+        // Another layer became the background, it is now drawn at the origin and the old one at its own position
+        scene->frame_base = base;
+        scene->damage.count = 0;
+        add_damage(&scene->damage, whole_canvas);
+    }
+
+    composite_damage(scene->frame, scene->scratch, layer_count, &scene->damage, &scene->job);
+
+    // Hand the damage to the caller and start collecting damage for the next frame
+    // The reported list stays valid until the next call because it is copied out of the live list
+    context->reported_scene_damage = scene->damage;
+    scene->damage.count = 0;
+    if (damage_rects) *damage_rects = context->reported_scene_damage.rects;
+    if (damage_count) *damage_count = context->reported_scene_damage.count;
+
+    const PNG_Image* result = scene->frame;
+    pthread_mutex_unlock(&scene->lock);
+
+    return result;
+}
+
+/*
+ * Flattens every visible retained layer into a single image, recompositing only what changed since the last call.
+ * Returns a pointer to the flattened scene, which is owned by the compositor and stays valid until the next call. Do not destroy it.
+ * If damage_rects and damage_count are given, they are set to the regions which changed, valid until the next call.
+ * Returns NULL if no layer is visible.
+ */
+const PNG_Image* get_flattened_scene(const Image_Rect** damage_rects, int* damage_count) {
+    return context_get_flattened_scene(&default_context, damage_rects, damage_count);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////// GROUP LAYERS /////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Creates an empty group with a transparent surface of the given size, which is the area its children are clipped to.
+ * Children are added with layer_group_add_image and layer_group_add_fill, and changed or destroyed with the usual retained layer functions.
+ * The group is drawn with push_group, which flattens only the regions changed children touched since it was last drawn and then blends
+ * the cached surface as a single layer, so a widget built from many static sprites costs one blend per frame. Returns NULL on failure.
+ */
+Layer_Group* layer_group_create(int width, int height) {
+    Layer_Group* group = malloc(sizeof(Layer_Group));
+    if (!group) {
+        perror("failed to allocate layer group");
+        return NULL;
+    }
+
+    group->context = composite_context_create();
+    if (!group->context) {
+        free(group);
+        return NULL;
+    }
+
+    // Children are flattened onto transparency, premultiplied alpha keeps their edges exactly as they would look drawn one by one
+    group->canvas = scene_add_layer(group->context, NULL, (Layer_Fill){0x00000000, width, height, true}, 0, 0, INT_MIN);
+    if (!group->canvas) {
+        composite_context_destroy(&group->context);
+        free(group);
+        return NULL;
+    }
+
+    group->surfaces = NULL;
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->released, NULL);
+    return group;
+}
+
+/*
+ * Changes the size of the surface of a group, its children are flattened again on the next draw
+ */
+void layer_group_resize(Layer_Group *const group, int width, int height) {
+    if (!group) return;
+    layer_set_fill(group->canvas, 0x00000000, width, height);
+}
+
+/*
+ * Adds a child to a group which draws the given image at the given X & Y coordinates on the group's surface until it is destroyed.
+ * Children with a higher z are drawn on top, like retained layers. The image is not deallocated by the layer and must outlive it.
+ * Returns NULL on failure.
+ */
+Scene_Layer* layer_group_add_image(Layer_Group *const group, const PNG_Image *const image, int x, int y, int z) {
+    if (!group) return NULL;
+    return context_layer_create(group->context, image, x, y, z);
+}
+
+/*
+ * Adds a child to a group which fills a rectangle of the group's surface with a solid color given as 0xRRGGBBAA until it is destroyed.
+ * Returns NULL on failure.
+ */
+Scene_Layer* layer_group_add_fill(Layer_Group *const group, uint32_t rgba, int x, int y, int width, int height, int z) {
+    if (!group) return NULL;
+    return context_layer_create_fill(group->context, rgba, x, y, width, height, z);
+}
+
+/*
+ * Copies the given regions of the scene frame of a group into the surface it hands out
+ */
+void copy_group_damage(PNG_Image* surface, const PNG_Image* frame, const Image_Rect* damage_rects, int damage_count) {
+    for (int i = 0; i < damage_count; i++) {
+        Image_Rect rect = damage_rects[i];
+        for (int y = rect.y; y < rect.y + rect.height; y++) {
+            size_t offset = ((size_t)y * frame->width + rect.x) * 4;
+            memcpy(surface->data + offset, frame->data + offset, (size_t)rect.width * 4);
+        }
+    }
+}
+
+/*
+ * Returns the surface of a group, a premultiplied image holding every visible child, after flattening the regions which changed since the last call.
+ * An unchanged group costs nothing to bring up to date. A surface handed to an asynchronous flatten is never written to,
+ * if the group changed it gets a new surface instead. The surface is owned by the group and stays valid until the group
+ * is resized, changed while an asynchronous flatten reads the surface, or destroyed. Returns NULL on failure.
+ */
+const PNG_Image* layer_group_get_surface(Layer_Group *const group) {
+    if (!group) return NULL;
+    pthread_mutex_lock(&group->lock);
+
+    const Image_Rect* damage_rects;
+    int damage_count = 0;
+    const PNG_Image* frame = context_get_flattened_scene(group->context, &damage_rects, &damage_count);
+    if (!frame) {
+        pthread_mutex_unlock(&group->lock);
+        return NULL;
+    }
+
+    Group_Surface* current = group->surfaces;
+    bool same_size = current && current->image->width == frame->width && current->image->height == frame->height;
+    bool changed = !same_size || damage_count > 0;
+    bool in_place = changed && same_size && current->readers == 0;
+    if (in_place) {
+        copy_group_damage(current->image, frame, damage_rects, damage_count);
+    } else if (changed) {
+        // A new surface, either the first one or one replacing a surface an asynchronous flatten still reads
+        Group_Surface* replacement = malloc(sizeof(Group_Surface));
+        PNG_Image* image = png_copy_image(frame);
+        if (!replacement || !image) {
+            free(replacement);
+            png_destroy_image(&image);
+            pthread_mutex_unlock(&group->lock);
+            perror("failed to allocate group surface");
+            return NULL;
+        }
+        *replacement = (Group_Surface){image, 0, current};
+        group->surfaces = replacement;
+
+        // Nobody reads the replaced surface anymore unless a flatten still does, in which case that flatten frees it
+        if (current && current->readers == 0) {
+            replacement->next = current->next;
+            png_destroy_image(&current->image);
+            free(current);
+        }
+    }
+
+    PNG_Image* surface = group->surfaces->image;
+    if (changed) {
+        // The surface is blended like any image, so refresh the opaque region and span index which let the compositor
+        // cull what it hides and copy or skip its runs instead of blending every pixel. This also gives it a new generation.
+        // A surface written in place only needs them refreshed where it was written, a new one needs them built whole.
+        if (in_place) {
+            for (int i = 0; i < damage_count; i++) {
+                png_update_opaque_region_rect(surface, damage_rects[i]);
+                png_update_span_index_rows(surface, damage_rects[i].y, damage_rects[i].height);
+            }
+        } else {
+            png_update_opaque_region(surface);
+            png_build_span_index(surface);
+        }
+    }
+
+    pthread_mutex_unlock(&group->lock);
+    return surface;
+}
+
+/*
+ * Deallocates a group along with its surface and every child still in it, the images the children drew are not deallocated.
+ * Waits for asynchronous flattens which were handed the surface to be done with it. Handles to its children must not be used afterwards.
+ * Sets the given pointer to NULL.
+ */
+void layer_group_destroy(Layer_Group** group_ptr) {
+    if (!group_ptr || !*group_ptr) return;
+    Layer_Group* group = *group_ptr;
+
+    pthread_mutex_lock(&group->lock);
+    while (group->surfaces && (group->surfaces->readers > 0 || group->surfaces->next)) {
+        pthread_cond_wait(&group->released, &group->lock);
+    }
+    pthread_mutex_unlock(&group->lock);
+
+    if (group->surfaces) {
+        png_destroy_image(&group->surfaces->image);
+        free(group->surfaces);
+    }
+    composite_context_destroy(&group->context);
+    pthread_cond_destroy(&group->released);
+    pthread_mutex_destroy(&group->lock);
+    free(group);
+    *group_ptr = NULL;
+}
+
+/*
+ * Same as push_group(), but on the given context instead of the default one
+ */
+void context_push_group(Composite_Context *const context, Layer_Group *const group, int x, int y, const Layer_Options *const options) {
+    const PNG_Image* surface = layer_group_get_surface(group);
+    if (!surface) return;
+    context_push_layer(context, surface, (Layer_Fill){0, 0, 0, false}, x, y, options, group);
+}
+
+/*
+ * Pushes a group onto the image stack, drawn at the given X & Y coordinates with the given options, NULL for the defaults.
+ * The group is brought up to date first, then its cached surface is pushed like an image, so it is blended as a single layer.
+ * The group must not be resized or destroyed until the stack was flattened or handed to an asynchronous flatten.
+ * An asynchronous flatten keeps the surface it was handed, so the group can be changed and pushed again for the next frame right away.
+ */
+void push_group(Layer_Group *const group, int x, int y, const Layer_Options *const options) {
+    context_push_group(&default_context, group, x, y, options);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////// IMAGE MANIPULATION ///////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Blends the given image onto the given canvas in place, dropping any pixels which fall out of bounds.
+ * Specified X & Y determine where the topleft corner of the image is drawn on the canvas.
+ * The canvas pixel data is modified directly, no new PNG_Image is allocated.
+ * The image may be in any pixel format, the canvas must be RGBA, other canvases are left unchanged.
+ */
+void blend_images_into(PNG_Image* const canvas, const PNG_Image* const image, int image_x, int image_y) {
+    blend_images_into_with_options(canvas, image, image_x, image_y, NULL);
+}
+
+/*
+ * Same as blend_images_into(), but the image is drawn with the given layer options, NULL for the defaults.
+ */
+void blend_images_into_with_options(PNG_Image* const canvas, const PNG_Image* const image, int image_x, int image_y, const Layer_Options *const options) {
+    if (!canvas || !image || canvas->format != PIXEL_FORMAT_RGBA) return;
+
+    // The canvas pixels are about to change, so its span index would go stale and frames cached from it are out of date
+    png_discard_span_index(canvas);
+    png_mark_changed(canvas);
+
+    Layer_Options layer_options = options ? *options : LAYER_OPTIONS_DEFAULT;
+    Composite_Layer layer = make_composite_layer(image, NULL, image_x, image_y, &layer_options);
+    Image_Rect whole_canvas = {0, 0, canvas->width, canvas->height};
+    Composite_Target target = image_target(canvas);
+    blend_image_clipped(&target, &layer, intersect_rects(whole_canvas, layer.clip));
+}
+
+/*
+ * Returns the coverage of count pixels of the mask, starting at the given canvas position, one byte per pixel
+ * A8 masks are read in place, the alpha of other masks is gathered into the buffer, which holds SLICE_CHUNK_PIXELS bytes
+ */
+const uint8_t* mask_coverage(const Layer_Blend* blend, int x, int y, int count, uint8_t* buffer) {
+    const PNG_Image* mask = blend->mask;
+    int mask_x = x - blend->mask_x, mask_y = y - blend->mask_y;
+    if (mask->format == PIXEL_FORMAT_A8) return mask->data + (size_t)mask_y * mask->width + mask_x;
+
+    const uint8_t* pixels;
+    uint8_t expanded[SLICE_CHUNK_PIXELS * 4];
+    if (mask->format == PIXEL_FORMAT_RGBA) {
+        pixels = mask->data + ((size_t)mask_y * mask->width + mask_x) * 4;
+    } else {
+        png_expand_row(mask, mask_x, mask_y, count, expanded);
+        pixels = expanded;
+    }
+    for (int i = 0; i < count; i++) {
+        buffer[i] = pixels[i * 4 + 3];
+    }
+    return buffer;
+}
+
+/*
+ * Blends one row of a layer onto the target at the given canvas position, applying the modulation factors and the mask on the way in
+ * Masked rows are blended a small chunk at a time, so the coverage of each chunk stays on the stack
+ */
+void blend_layer_row(const Layer_Blend* blend, const Composite_Target* target, int x, int y, const uint8_t* src, int count) {
+    uint8_t* dst = target_pixel(target, x, y);
+    if (blend->mask) {
+        uint8_t coverage[SLICE_CHUNK_PIXELS];
+        for (int i = 0; i < count; i += SLICE_CHUNK_PIXELS) {
+            int chunk = count - i < SLICE_CHUNK_PIXELS ? count - i : SLICE_CHUNK_PIXELS;
+            const uint8_t* mask = mask_coverage(blend, x + i, y, chunk, coverage);
+            blend_row_masked(blend->blend_row, dst + (size_t)i * 4, src + (size_t)i * 4, mask, chunk, blend->factors, blend->premultiplied);
+        }
+    } else if (blend->factors) {
+        blend_row_modulated(blend->blend_row, dst, src, count, blend->factors);
+    } else {
+        blend->blend_row(dst, src, count);
+    }
+}
+
+/*
+ * Blends count pixels of row y of the image, starting at column x, onto the target at the given canvas position like blend_layer_row
+ * RGBA rows are blended in place, compact rows are expanded a small chunk at a time into a buffer on the stack which stays in cache
+ * until the kernel reads it back, so a compact image is never expanded as a whole.
+ */
+void blend_image_pixels(const Layer_Blend* blend, const Composite_Target* target, int canvas_x, int canvas_y, const PNG_Image* image, int x, int y, int count) {
+    if (image->format == PIXEL_FORMAT_RGBA) {
+        blend_layer_row(blend, target, canvas_x, canvas_y, image->data + ((size_t)y * image->width + x) * 4, count);
+        return;
+    }
+
+    uint8_t expanded[SLICE_CHUNK_PIXELS * 4];
+    for (int i = 0; i < count; i += SLICE_CHUNK_PIXELS) {
+        int chunk = count - i < SLICE_CHUNK_PIXELS ? count - i : SLICE_CHUNK_PIXELS;
+        png_expand_row(image, x + i, y, chunk, expanded);
+        blend_layer_row(blend, target, canvas_x + i, canvas_y, expanded, chunk);
+    }
+}
+
+/*
+ * Blends a fill layer onto the given target in place, dropping any pixels which fall outside of the clip rectangle
+ * The color is resolved once into the target's alpha representation. Opaque fills and replacing fills are span filled unless masked,
+ * other fills are blended from a short row of the color on the stack, so no pixels are allocated either way.
+ */
+void blend_fill_clipped(const Composite_Target* target, const Composite_Layer* layer, Image_Rect clip) {
+    Image_Rect visible = intersect_rects(layer_bounds(layer), clip);
+    if (is_rect_empty(visible)) return;
+
+    const Layer_Options* options = &layer->options;
+    Blend_Mode mode = options->blend_mode;
+    if (options->opacity == 0 && mode != BLEND_REPLACE) return; // Fully faded out, nothing changes
+
+    // Unpack the color, apply the opacity and tint, then premultiply it if the target is premultiplied
+    uint32_t rgba = layer->fill.rgba;
+    uint8_t pixel[4] = {rgba >> 24, (rgba >> 16) & 0xFF, (rgba >> 8) & 0xFF, rgba & 0xFF};
+    uint8_t factors[4];
+    get_modulation_factors(factors, options->opacity, options->tint, false);
+    modulate_row(pixel, pixel, 1, factors);
+    if (target->premultiplied) {
+        uint8_t premultiply[4] = {pixel[3], pixel[3], pixel[3], 255};
+        modulate_row(pixel, pixel, 1, premultiply);
+    }
+    if (pixel[3] == 0 && mode != BLEND_REPLACE) return; // Transparent, every mode leaves the target unchanged
+
+    // Same rule as for images, with the color already in the target's representation
+    bool masked = options->mask != NULL;
+    bool may_lower_alpha = mode == BLEND_REPLACE || (!target->premultiplied && mode != BLEND_OVER);
+    if (target->opaque_region && may_lower_alpha && (pixel[3] != 255 || masked) && !is_rect_empty(intersect_rects(visible, *target->opaque_region))) {
+        *target->opaque_region = (Image_Rect){0, 0, 0, 0};
+    }
+
+    // The result is the color itself, write it at memset speed
+    if (!masked && (mode == BLEND_REPLACE || (is_over_mode(mode) && pixel[3] == 255))) {
+        for (int y = visible.y; y < visible.y + visible.height; y++) {
+            fill_row(target_pixel(target, visible.x, y), pixel, visible.width);
+        }
+        return;
+    }
+
+    uint8_t colors[FILL_CHUNK_PIXELS * 4];
+    fill_row(colors, pixel, FILL_CHUNK_PIXELS);
+    Layer_Blend blend = {get_blend_row(mode, target->premultiplied, target->premultiplied), NULL, options->mask, layer->mask_x, layer->mask_y, target->premultiplied};
+    for (int y = visible.y; y < visible.y + visible.height; y++) {
+        for (int x = visible.x; x < visible.x + visible.width; x += FILL_CHUNK_PIXELS) {
+            int chunk = visible.x + visible.width - x < FILL_CHUNK_PIXELS ? visible.x + visible.width - x : FILL_CHUNK_PIXELS;
+            blend_layer_row(&blend, target, x, y, colors, chunk);
+        }
+    }
+}
+
+/*
+ * Fills a rectangle of the canvas with a solid color given as 0xRRGGBBAA, drawn with the given layer options, NULL for the defaults.
+ * The color is drawn straight into the canvas, clipped to it, without allocating. Source rectangles and nine slices do not apply to fills.
+ */
+void fill_rect_into_with_options(PNG_Image* const canvas, uint32_t rgba, int x, int y, int width, int height, const Layer_Options *const options) {
+    if (!canvas || canvas->format != PIXEL_FORMAT_RGBA) return;
+
+    // The canvas pixels are about to change, so its span index would go stale and frames cached from it are out of date
+    png_discard_span_index(canvas);
+    png_mark_changed(canvas);
+
+    Layer_Options layer_options = options ? *options : LAYER_OPTIONS_DEFAULT;
+    Layer_Fill fill = {rgba, width, height, canvas->premultiplied};
+    Composite_Layer layer = make_composite_layer(NULL, &fill, x, y, &layer_options);
+    Image_Rect whole_canvas = {0, 0, canvas->width, canvas->height};
+    Composite_Target target = image_target(canvas);
+    blend_fill_clipped(&target, &layer, intersect_rects(whole_canvas, layer.clip));
+}
+
+/*
+ * Blends a rectangle of solid color given as 0xRRGGBBAA onto the canvas in place, clipped to the canvas.
+ * An opaque color is written at memset speed and nothing is allocated, which makes this the way to clear or matte a frame.
+ * The canvas must be RGBA, other canvases are left unchanged.
+ */
+void fill_rect_into(PNG_Image* const canvas, uint32_t rgba, int x, int y, int width, int height) {
+    fill_rect_into_with_options(canvas, rgba, x, y, width, height, NULL);
+}
+
+/*
+ * Blends one part of a nine slice onto the given target, dropping any pixels which fall outside of the clip rectangle
+ * The part is drawn from the src rectangle of the image into the dest rectangle of the target, stretched or tiled to fit.
+ * Unscaled and tiled rows are blended straight out of the image, as are nearest rows only stretched vertically.
+ * Other stretched rows are sampled with the filter a small chunk at a time into a buffer on the stack.
+ */
+void blend_nine_slice_part(const Composite_Target* target, const PNG_Image* image, Image_Rect dest, Image_Rect src, Image_Rect clip, Slice_Fill fill, Scale_Filter filter, const Layer_Blend* blend) {
+    Image_Rect visible = intersect_rects(dest, clip);
+    if (is_rect_empty(visible) || is_rect_empty(src)) return;
+
+    int end_x = visible.x + visible.width;
+
+    // Filters other than nearest blend neighboring rows as well, so they sample even parts stretched only vertically
+    bool sampled = fill == SLICE_STRETCH && (src.width != dest.width || (filter != SCALE_NEAREST && src.height != dest.height));
+    Scale_Row_Function scale_row = get_scale_row(filter, image->format);
+    uint8_t gathered[SLICE_CHUNK_PIXELS * 4];
+
+    for (int y = visible.y; y < visible.y + visible.height; y++) {
+        if (sampled) { // Sample the scaled source a chunk at a time
+            for (int x = visible.x; x < end_x; x += SLICE_CHUNK_PIXELS) {
+                int chunk = end_x - x < SLICE_CHUNK_PIXELS ? end_x - x : SLICE_CHUNK_PIXELS;
+                scale_row(gathered, image, src, dest.width, dest.height, x - dest.x, y - dest.y, chunk);
+                blend_layer_row(blend, target, x, y, gathered, chunk);
+            }
+            continue;
+        }
+
+        int offset_y = y - dest.y;
+        int src_y = src.y + (fill == SLICE_TILE ? offset_y % src.height : nearest_sample(offset_y, src.height, dest.height));
+
+        if (src.width == dest.width) { // Not scaled horizontally, blend the row as is
+            blend_image_pixels(blend, target, visible.x, y, image, src.x + visible.x - dest.x, src_y, visible.width);
+        } else { // Tiled, blend one tile at a time, each is a run of the source row
+            for (int x = visible.x; x < end_x;) {
+                int offset_x = (x - dest.x) % src.width;
+                int run = src.width - offset_x < end_x - x ? src.width - offset_x : end_x - x;
+                blend_image_pixels(blend, target, x, y, image, src.x + offset_x, src_y, run);
+                x += run;
+            }
+        }
+    }
+}
+
+/*
+ * Narrows [start, end) to the columns of a row whose pixel centers land inside one axis of a transformed layer's source
+ * Along the row the source position at column x is offset + slope * (x + 0.5), it must lie in [0, size)
+ */
+void clip_transformed_span(double slope, double offset, int size, int* start, int* end) {
+    if (*start >= *end) return;
+    if (fabs(slope) < 1e-12) { // The position does not change along the row
+        if (offset < 0 || offset >= size) *end = *start;
+        return;
+    }
+
+    double low = -offset / slope - 0.5; // Column whose center lands on the start of the axis
+    double high = (size - offset) / slope - 0.5; // Column whose center lands on its end
+    double first = slope > 0 ? ceil(low) : floor(high) + 1;
+    double past = slope > 0 ? ceil(high) : floor(low) + 1;
+    if (first > *start) *start = first < *end ? (int)first : *end;
+    if (past < *end) *end = past > *start ? (int)past : *start;
+}
+
+/*
+ * Blends a transformed layer onto the given target, dropping any pixels which fall outside of the clip rectangle
+ * The columns of each row which land inside the source are worked out once per row, then sampled a chunk at a time
+ * by stepping through the source in 16.16 fixed point, so nothing outside the source is sampled and nothing per pixel is tested.
+ */
+void blend_transformed_layer(const Composite_Target* target, const Composite_Layer* layer, Image_Rect clip, const Layer_Blend* blend) {
+    Image_Rect visible = intersect_rects(layer_bounds(layer), clip);
+    if (is_rect_empty(visible)) return;
+
+    const double* inverse = layer->inverse;
+    Affine_Row_Function sample_row = get_affine_row(layer->options.filter, layer->image->format);
+    int32_t step_u = (int32_t)lround(inverse[0] * 65536);
+    int32_t step_v = (int32_t)lround(inverse[3] * 65536);
+    uint8_t sampled[SLICE_CHUNK_PIXELS * 4];
+
+    for (int y = visible.y; y < visible.y + visible.height; y++) {
+        double center_y = y + 0.5;
+        double row_u = inverse[1] * center_y + inverse[2];
+        double row_v = inverse[4] * center_y + inverse[5];
+        int start = visible.x, end = visible.x + visible.width;
+        clip_transformed_span(inverse[0], row_u, layer->source.width, &start, &end);
+        clip_transformed_span(inverse[3], row_v, layer->source.height, &start, &end);
+
+        // Chunks start from an exact position on a grid of canvas columns, so fixed point steps never drift far and a pixel samples
+        // the same position whichever region of the canvas is being composited
+        for (int x = start; x < end;) {
+            int anchor = x - x % SLICE_CHUNK_PIXELS; // Composited columns lie within the canvas, never left of 0
+            int chunk = end - x < anchor + SLICE_CHUNK_PIXELS - x ? end - x : anchor + SLICE_CHUNK_PIXELS - x;
+            double center_x = anchor + 0.5;
+            int32_t u = (int32_t)lround((row_u + inverse[0] * center_x) * 65536) + step_u * (x - anchor);
+            int32_t v = (int32_t)lround((row_v + inverse[3] * center_x) * 65536) + step_v * (x - anchor);
+            sample_row(sampled, layer->image, layer->source, u, v, step_u, step_v, chunk);
+            blend_layer_row(blend, target, x, y, sampled, chunk);
+            x += chunk;
+        }
+    }
+}
+
+/*
+ * Blends the given layer onto the given target in place, dropping any pixels which fall outside of the clip rectangle.
+ * The clip rectangle must lie within the target.
+ */
+void blend_image_clipped(const Composite_Target* target, const Composite_Layer* layer, Image_Rect clip) {
+    if (!layer->image) {
+        blend_fill_clipped(target, layer, clip);
+        return;
+    }
+
+    const PNG_Image* image = layer->image;
+    const Layer_Options* options = &layer->options;
+    int image_x = layer->x;
+    int image_y = layer->y;
+
+    // Clip the layer against the clip rectangle once, instead of checking every pixel
+    int start_x = clip.x - image_x > 0 ? clip.x - image_x : 0; // First visible column of the layer
+    int start_y = clip.y - image_y > 0 ? clip.y - image_y : 0; // First visible row of the layer
+    int end_x = clip.x + clip.width - image_x < layer->width ? clip.x + clip.width - image_x : layer->width; // One past the last visible column
+    int end_y = clip.y + clip.height - image_y < layer->height ? clip.y + clip.height - image_y : layer->height; // One past the last visible row
+
+    if (start_x >= end_x || start_y >= end_y) return; // The layer is entirely outside the clip rectangle
+
+    int count = end_x - start_x; // Visible pixels per row
+
+    // Pick the kernel once for the whole image, so nothing branches on the blend mode or alpha representation per pixel
+    Blend_Mode mode = options->blend_mode;
+    Blend_Row_Function blend_row = get_blend_row(mode, image->premultiplied, target->premultiplied);
+
+    // Opacity and tint are applied to the source on its way into the kernel, the image itself is never modified or copied
+    if (options->opacity == 0 && mode != BLEND_REPLACE) return; // Fully faded out, nothing changes
+    uint8_t modulation[4];
+    const uint8_t* factors = NULL;
+    if (options->opacity != 255 || (options->tint & 0xFFFFFF) != 0xFFFFFF) {
+        get_modulation_factors(modulation, options->opacity, options->tint, image->premultiplied);
+        factors = modulation;
+    }
+    // Masks are multiplied into the source alpha on its way into the kernel as well, the mask must cover the clip rectangle
+    Layer_Blend blend = {blend_row, factors, options->mask, layer->mask_x, layer->mask_y, image->premultiplied};
+
+    // Replacing, and blending onto straight alpha with anything but premultiplied over, can lower the target alpha,
+    // which may break its cached opaque region
+    bool may_lower_alpha = mode == BLEND_REPLACE || (!target->premultiplied && (mode != BLEND_OVER || !image->premultiplied));
+    bool source_opaque = rect_contains(image->opaque_region, layer->source) && options->opacity == 255 && !options->mask;
+    if (target->opaque_region && may_lower_alpha && !source_opaque) {
+        Image_Rect blended = {image_x + start_x, image_y + start_y, count, end_y - start_y};
+        if (!is_rect_empty(intersect_rects(blended, *target->opaque_region))) {
+            *target->opaque_region = (Image_Rect){0, 0, 0, 0};
+        }
+    }
+
+    // Transformed layers map every canvas pixel back into the source
+    if (layer->transformed) {
+        blend_transformed_layer(target, layer, clip, &blend);
+        return;
+    }
+
+    // Nine slices draw each part of the grid straight from the source, scaling the edges and center on the fly
+    if (is_layer_scaled(layer)) {
+        Image_Rect dest[9], src[9];
+        get_nine_slice_parts(layer, dest, src);
+        for (int i = 0; i < 9; i++) {
+            blend_nine_slice_part(target, image, dest[i], src[i], clip, options->nine_slice.fill, options->filter, &blend);
+        }
+        return;
+    }
+
+    // Blending a transparent pixel yields the destination under every mode, and an opaque pixel drawn over yields the source,
+    // so the output is unchanged when they are skipped or copied. Opaque pixels only get copied for unmodulated and unmasked over,
+    // anything else still changes them.
+    bool copy_opaque = is_over_mode(mode) && !factors && !options->mask;
+
+    // RGB565 images are opaque everywhere, so drawn over without modulation they are expanded straight into the target without blending
+    if (image->format == PIXEL_FORMAT_RGB565 && copy_opaque) {
+        for (int y = start_y; y < end_y; y++) {
+            png_expand_row(image, layer->source.x + start_x, layer->source.y + y, count, target_pixel(target, image_x + start_x, image_y + y));
+        }
+        return;
+    }
+
+    // Without a span index blend each visible row with the fastest available kernel, replacing never skips pixels
+    // Layers may draw a part of a larger image, so rows are read with the image's stride
+    if (!image->span_index || mode == BLEND_REPLACE) {
+        for (int y = start_y; y < end_y; y++) {
+            blend_image_pixels(&blend, target, image_x + start_x, image_y + y, image, layer->source.x + start_x, layer->source.y + y, count);
+        }
+        return;
+    }
+
+    // With a span index skip transparent runs and copy opaque runs, only partial runs go through the kernel
+    const Image_Span_Index* index = image->span_index;
+    // Spans are indexed by image column, shift the visible columns into image coordinates
+    int first_column = layer->source.x + start_x;
+    int end_column = layer->source.x + end_x;
+    for (int y = start_y; y < end_y; y++) {
+        int image_row = layer->source.y + y;
+        png_bytep dest_row = target_pixel(target, image_x - layer->source.x, image_y + y); // Where the first image column would land
+        for (int s = index->row_starts[image_row]; s < index->row_starts[image_row + 1]; s++) {
+            const Image_Span* span = &index->spans[s];
+            if (span->start >= end_column) break; // Spans are sorted, the rest of the row is clipped
+            if (span->kind == SPAN_TRANSPARENT) continue;
+
+            // Clip the span against the visible columns
+            int span_start = span->start > first_column ? span->start : first_column;
+            int span_end = span->start + span->length < end_column ? span->start + span->length : end_column;
+            if (span_start >= span_end) continue;
+
+            if (span->kind == SPAN_OPAQUE && copy_opaque) {
+                png_expand_row(image, span_start, image_row, span_end - span_start, dest_row + span_start * 4);
+            } else {
+                blend_image_pixels(&blend, target, image_x - layer->source.x + span_start, image_y + y, image, span_start, image_row, span_end - span_start);
+            }
+        }
+    }
+}
+
+/*
+ * Blends the given image onto the given canvas, dropping any pixels which fall out of bounds.
+ * Specified X & Y determine where the topleft corner of the image is drawn on the canvas.
+ * Returns a pointer to a newly created PNG_Image, the given canvas is left unchanged
+ */
+PNG_Image* blend_images(const PNG_Image* const canvas, const PNG_Image* const image, int image_x, int image_y) {
+    // Make a deep copy of the canvas to use as a base for blending
+    PNG_Image* result = png_copy_image(canvas);
+    if (!result) return NULL;
+
+    blend_images_into(result, image, image_x, image_y);
+
     return result;
 }
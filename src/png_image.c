@@ -1,7 +1,9 @@
 #include <png.h>
 #include <setjmp.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <string.h>
+#include "blending.h"
 #include "png_image.h"
 
 typedef struct {
@@ -10,6 +12,49 @@ typedef struct {
     size_t current_pos;
 } memory_reader_state;
 
+// Transparent and opaque runs shorter than this are folded into the surrounding partial runs
+// The blend kernels already handle a few transparent or opaque pixels cheaply, a separate span would cost more than it saves
+#define MIN_SPAN_LENGTH 16
+
+atomic_bool load_premultiplied = ATOMIC_VAR_INIT(false); // When true loaded and created images are converted to premultiplied alpha
+atomic_bool load_compact = ATOMIC_VAR_INIT(false); // When true loaded images keep a compact pixel format when it loses nothing
+atomic_ulong next_generation = ATOMIC_VAR_INIT(1); // Handed out to images as they are created or change, so no two versions share one
+
+/*
+ * Multiplies a color channel by an alpha value, both in the range [0, 255], rounding to nearest
+ */
+static inline unsigned char premultiply_channel(unsigned int channel, unsigned int alpha) {
+    unsigned int x = channel * alpha + 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/*
+ * Returns the 4 bytes of an RGBA pixel as one word, so the expanders store whole pixels and the compiler can vectorize them
+ */
+static inline uint32_t rgba_word(uint32_t red, uint32_t green, uint32_t blue, uint32_t alpha) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return (red << 24) | (green << 16) | (blue << 8) | alpha;
+#else
+    return red | (green << 8) | (blue << 16) | (alpha << 24);
+#endif
+}
+
+/*
+ * Expands a packed RGB565 color to an opaque RGBA pixel, replicating the top bits so 0 and full intensity map to 0 and 255
+ */
+static inline uint32_t expand_rgb565(uint16_t color) {
+    uint32_t red = color >> 11, green = (color >> 5) & 0x3F, blue = color & 0x1F;
+    return rgba_word((red << 3) | (red >> 2), (green << 2) | (green >> 4), (blue << 3) | (blue >> 2), 255);
+}
+
+/*
+ * Packs the color of an RGBA pixel into RGB565, rounding every channel to nearest
+ */
+static inline uint16_t pack_rgb565(const uint8_t* pixel) {
+    uint32_t red = (pixel[0] * 31 + 127) / 255, green = (pixel[1] * 63 + 127) / 255, blue = (pixel[2] * 31 + 127) / 255;
+    return (uint16_t)((red << 11) | (green << 5) | blue);
+}
+
 /*
  * Extract color components from RGBA hex code
  */
@@ -19,14 +64,23 @@ int extract_color_component(uint32_t rgba, int shift) {
 
 /*
  * A series of transformations on a PNG image's color and bit depth to standardize its format to RGBA 8 bits
+ * Palette images are read as one palette index per byte instead when keep_palette is true
  * Uses libpng to manipulate PNG image data directly
  */
-void apply_color_transformations(png_structp png, png_infop info) {
+void apply_color_transformations(png_structp png, png_infop info, bool keep_palette) {
     // Retrieve the color type of the image (e.g., RGB, grayscale, palette)
     png_byte color_type = png_get_color_type(png, info);
     // Retrieve the color type of the image (e.g., RGB, grayscale, palette)
     png_byte bit_depth = png_get_bit_depth(png, info);
 
+    // Indexed images only need indices below 8 bits unpacked, the palette itself is read separately
+    if (keep_palette && color_type == PNG_COLOR_TYPE_PALETTE) {
+        if (bit_depth < 8) {
+            png_set_packing(png);
+        }
+        return;
+    }
+
     // If the image's bit depth is 16, reduce it to 8 by stripping the least significant bits
     if (bit_depth == 16) {
         png_set_strip_16(png);
@@ -109,9 +163,81 @@ PNG_Image* create_empty_png_image_struct() {
     }
     // Initialize with default values or leave uninitialized to be set later
     img->data = NULL; // Will be allocated later
+    img->format = PIXEL_FORMAT_RGBA; // Loaders switch to a compact format only when asked to
+    img->palette = NULL;
+    img->premultiplied = false; // Loaders convert after reading if premultiplied loading is enabled
+    img->opaque_region = (Image_Rect){0, 0, 0, 0}; // Nothing is known to be opaque until the pixels are scanned
+    img->span_index = NULL; // Only built on request
+    img->generation = atomic_fetch_add(&next_generation, 1);
     return img;
 }
 
+/*
+ * Returns true if the PNG should be read as an indexed image, which is the case for palette PNGs while compact loading is enabled
+ */
+bool should_keep_palette(png_structp png, png_infop info) {
+    return atomic_load(&load_compact) && png_get_color_type(png, info) == PNG_COLOR_TYPE_PALETTE;
+}
+
+/*
+ * Reads the palette of a palette PNG into the RGBA palette of an indexed image, colors without a tRNS entry are opaque
+ * Unused entries are transparent black. Returns false if the palette could not be allocated.
+ */
+bool load_png_palette(png_structp png, png_infop info, PNG_Image* img) {
+    img->palette = calloc(256, 4);
+    if (!img->palette) {
+        fprintf(stderr, "Failed to allocate memory for palette\n");
+        return false;
+    }
+
+    png_colorp colors = NULL;
+    int color_count = 0;
+    png_get_PLTE(png, info, &colors, &color_count);
+    png_bytep alphas = NULL;
+    int alpha_count = 0;
+    if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_get_tRNS(png, info, &alphas, &alpha_count, NULL);
+    }
+
+    for (int i = 0; i < color_count && i < 256; i++) {
+        img->palette[i * 4] = colors[i].red;
+        img->palette[i * 4 + 1] = colors[i].green;
+        img->palette[i * 4 + 2] = colors[i].blue;
+        img->palette[i * 4 + 3] = i < alpha_count ? alphas[i] : 255;
+    }
+    img->format = PIXEL_FORMAT_INDEXED;
+    return true;
+}
+
+/*
+ * Returns true if every pixel of a straight alpha RGBA image which is not fully transparent is white, so A8 stores it without loss
+ */
+bool is_white_mask(const PNG_Image *const image) {
+    size_t size = (size_t)image->width * image->height * 4;
+    for (size_t i = 0; i < size; i += 4) {
+        if (image->data[i + 3] != 0 && (image->data[i] & image->data[i + 1] & image->data[i + 2]) != 255) return false;
+    }
+    return true;
+}
+
+/*
+ * Final steps shared by the loaders once the pixels are read: the compact format, premultiplication and the opaque region
+ */
+void finish_loaded_image(PNG_Image* img) {
+    // Glyphs and masks are stored white with alpha, only the alpha is worth keeping
+    if (atomic_load(&load_compact) && img->format == PIXEL_FORMAT_RGBA && is_white_mask(img)) {
+        png_convert_format(img, PIXEL_FORMAT_A8);
+    }
+
+    // Convert once at load time so compositing never has to
+    if (atomic_load(&load_premultiplied)) {
+        png_premultiply_image(img);
+    }
+
+    // Find the opaque part once so the compositor can skip whatever it hides
+    png_update_opaque_region(img);
+}
+
 /*
  * Loads a PNG image from a memory buffer into a custom PNG_Image structure
  */
@@ -137,22 +263,23 @@ PNG_Image* png_load_from_memory(const unsigned char *const memory, size_t memory
         return NULL;
     }
 
+    // Make a copy of the memory parameter to preserve const-ness, before the jump point so error handling can free it
+    unsigned char* memory_copy = malloc(memory_size);
+    if (!memory_copy) {
+        // Handle memory allocation failure
+        perror("Failed to allocate memory for data copy");
+        exit(EXIT_FAILURE); //TODO: too sever handle this better
+    }
+
     // Set up error handling. If an error occurs, control jumps to this point
     if (setjmp(png_jmpbuf(png))) {
         // On error, clean up and return NULL
         fprintf(stderr, "Error during PNG initialization\n");
+        free(memory_copy);
         png_destroy_read_struct(&png, &info, NULL);
         return NULL;
     }
 
-    // Make a copy of the memory parameter to preserve const-ness
-    unsigned char* memory_copy = malloc(memory_size);
-    if (!memory_copy) {
-        // Handle memory allocation failure
-        perror("Failed to allocate memory for data copy");
-        exit(EXIT_FAILURE); //TODO: too sever handle this better
-    }
-
     // Initialize memory_reader_state here to closely align with the XImage version
     memory_reader_state state = {memcpy(memory_copy, memory, memory_size), memory_size, 0};
 
@@ -163,7 +290,8 @@ PNG_Image* png_load_from_memory(const unsigned char *const memory, size_t memory
     png_read_info(png, info);
 
     // Apply transformations to standardize the image data format
-    apply_color_transformations(png, info);
+    bool keep_palette = should_keep_palette(png, info);
+    apply_color_transformations(png, info, keep_palette);
 
     // Update the PNG structure with the transformations
     png_read_update_info(png, info);
@@ -174,6 +302,15 @@ PNG_Image* png_load_from_memory(const unsigned char *const memory, size_t memory
     // Check for failure
     if (!img) {
         // If allocation fails, clean up and return NULL
+        free(memory_copy);
+        png_destroy_read_struct(&png, &info, NULL);
+        return NULL;
+    }
+
+    // Indexed images carry their palette along
+    if (keep_palette && !load_png_palette(png, info, img)) {
+        free(img);
+        free(memory_copy);
         png_destroy_read_struct(&png, &info, NULL);
         return NULL;
     }
@@ -191,7 +328,9 @@ PNG_Image* png_load_from_memory(const unsigned char *const memory, size_t memory
     // Check for failure
     if (!img->data) {
         // If allocation fails, clean up and return NULL
+        free(img->palette);
         free(img);
+        free(memory_copy);
         png_destroy_read_struct(&png, &info, NULL);
         return NULL;
     }
@@ -211,6 +350,8 @@ PNG_Image* png_load_from_memory(const unsigned char *const memory, size_t memory
     free(memory_copy);
     png_destroy_read_struct(&png, &info, NULL); // Clean up PNG read and info structures
 
+    finish_loaded_image(img);
+
     // Return the pointer to the PNG_Image structure containing the loaded image data
     return img;
 }
@@ -265,7 +406,8 @@ PNG_Image* png_load_from_file(const char *const filepath) {
     png_read_info(png, info);
 
     // Apply transformations to standardize the image data format
-    apply_color_transformations(png, info);
+    bool keep_palette = should_keep_palette(png, info);
+    apply_color_transformations(png, info, keep_palette);
 
     // Update the PNG structure with the transformations
     png_read_update_info(png, info);
@@ -285,16 +427,26 @@ PNG_Image* png_load_from_file(const char *const filepath) {
         return NULL; // Memory allocation failed
     }
 
+    // Indexed images carry their palette along
+    if (keep_palette && !load_png_palette(png, info, img)) {
+        free(img);
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(fp);
+        return NULL;
+    }
+
     // Set the image properties and allocate memory for the image data
     img->width = width;
     img->height = height;
+    size_t row_bytes = (size_t)width * png_bytes_per_pixel(img->format);
 
     // Allocate memory for data
-    img->data = (unsigned char*)malloc(width * height * 4); // 4 bytes per pixel (RGBA)
+    img->data = (unsigned char*)malloc(row_bytes * height);
 
     // Check for failure
     if (!img->data) {
         // If allocation fails, clean up and return NULL
+        free(img->palette);
         free(img);
         png_destroy_read_struct(&png, &info, NULL);
         fclose(fp);
@@ -306,7 +458,7 @@ PNG_Image* png_load_from_file(const char *const filepath) {
 
     // Copy the image data from the row pointers into the img->data buffer
     for (int y = 0; y < height; y++) {
-        memcpy(img->data + (y * width * 4), row_pointers[y], width * 4);
+        memcpy(img->data + (y * row_bytes), row_pointers[y], row_bytes);
     }
     
     // Clean up the memory allocated for the row pointers
@@ -319,6 +471,8 @@ PNG_Image* png_load_from_file(const char *const filepath) {
     png_destroy_read_struct(&png, &info, NULL);
     fclose(fp);
 
+    finish_loaded_image(img);
+
     // Return the pointer to the PNG_Image structure containing the loaded image data
     return img;
 }
@@ -345,6 +499,14 @@ PNG_Image* png_create_image(int width, int height, uint32_t rgba) {
     int blue = extract_color_component(rgba, 8);
     int alpha = extract_color_component(rgba, 0); // Extract Alpha; if invalid, will assume full opacity later
 
+    // Premultiply the fill color once instead of every pixel
+    bool premultiplied = atomic_load(&load_premultiplied);
+    if (premultiplied) {
+        red = premultiply_channel(red, alpha);
+        green = premultiply_channel(green, alpha);
+        blue = premultiply_channel(blue, alpha);
+    }
+
     // Allocate memory for the PNG_Image struct
     PNG_Image* img = create_empty_png_image_struct();
     if (!img) {
@@ -355,6 +517,7 @@ PNG_Image* png_create_image(int width, int height, uint32_t rgba) {
     // Initialize the structure fields with the provided parameters
     img->width = width;
     img->height = height;
+    img->premultiplied = premultiplied;
 
     // Calculate the number of bytes needed for the image data
     size_t dataSize = width * height * 4; // 4 bytes per pixel for RGBA
@@ -370,12 +533,15 @@ PNG_Image* png_create_image(int width, int height, uint32_t rgba) {
         return NULL;
     }
 
-    // Initialize the image data to fully opaque white
-    for (size_t i = 0; i < dataSize; i += 4) {
-        img->data[i] = red;
-        img->data[i + 1] = green;
-        img->data[i + 2] = blue;
-        img->data[i + 3] = alpha; // Check if alpha is unspecified or invalid, assume full opacity
+    // Fill the image data with the color, a row at a time with the span fill kernel
+    const uint8_t pixel[4] = {red, green, blue, alpha};
+    for (int y = 0; y < height; y++) {
+        fill_row(img->data + (size_t)y * width * 4, pixel, width);
+    }
+
+    // A solid color is either opaque everywhere or nowhere
+    if (alpha == 255) {
+        img->opaque_region = (Image_Rect){0, 0, width, height};
     }
 
     // Return the pointer to the newly created PNG_Image structure
@@ -383,7 +549,58 @@ PNG_Image* png_create_image(int width, int height, uint32_t rgba) {
 }
 
 /*
- * Creates a deep copy of a PNG_Image assuming RGBA format
+ * Allocates a new PNG_Image structure without initializing its pixel data
+ * Meant for callers which are about to overwrite every pixel anyway
+ */
+PNG_Image* png_allocate_image(int width, int height, bool premultiplied) {
+    // Allocate memory for the PNG_Image struct
+    PNG_Image* img = create_empty_png_image_struct();
+    if (!img) {
+        return NULL;
+    }
+
+    img->width = width;
+    img->height = height;
+    img->premultiplied = premultiplied;
+
+    // Allocate memory for the image data, 4 bytes per pixel for RGBA
+    img->data = (unsigned char*)malloc((size_t)width * height * 4);
+    if (!img->data) {
+        fprintf(stderr, "Failed to allocate memory for image data\n");
+        free(img);
+        return NULL;
+    }
+
+    return img;
+}
+
+/*
+ * Deep copies the span index of an image with the given height, returns NULL if it could not be allocated
+ * The copy is optional, without it the compositor simply blends every pixel of the image
+ */
+static Image_Span_Index* copy_span_index(const Image_Span_Index* source, int height) {
+    size_t total = source->row_starts[height];
+    Image_Span_Index* index = malloc(sizeof(Image_Span_Index));
+    int* row_starts = malloc(sizeof(int) * (height + 1));
+    Image_Span* spans = malloc(sizeof(Image_Span) * (total > 0 ? total : 1));
+    if (!index || !row_starts || !spans) {
+        fprintf(stderr, "Failed to allocate memory for span index copy\n");
+        free(index);
+        free(row_starts);
+        free(spans);
+        return NULL;
+    }
+
+    memcpy(row_starts, source->row_starts, sizeof(int) * (height + 1));
+    memcpy(spans, source->spans, sizeof(Image_Span) * total);
+    index->row_starts = row_starts;
+    index->spans = spans;
+
+    return index;
+}
+
+/*
+ * Creates a deep copy of a PNG_Image, in the same pixel format
  */
 PNG_Image* png_copy_image(const PNG_Image *const source) {
     if (source == NULL) return NULL;
@@ -398,22 +615,633 @@ PNG_Image* png_copy_image(const PNG_Image *const source) {
     // Copy basic attributes directly
     copy->width = source->width;
     copy->height = source->height;
+    copy->premultiplied = source->premultiplied;
+    copy->opaque_region = source->opaque_region;
+    copy->generation = atomic_fetch_add(&next_generation, 1); // A different image, even though the pixels match
+    copy->format = source->format;
 
-    // Since we're assuming RGBA format, we calculate the data size as width * height * 4
-    size_t dataSize = source->width * source->height * 4; // 4 bytes per pixel for RGBA
+    size_t dataSize = (size_t)source->width * source->height * png_bytes_per_pixel(source->format);
     copy->data = (unsigned char*)malloc(dataSize);
-    if (copy->data == NULL) {
+    copy->palette = source->palette ? malloc(256 * 4) : NULL;
+    if (copy->data == NULL || (source->palette && !copy->palette)) {
         fprintf(stderr, "Failed to allocate memory for image data copy\n");
+        free(copy->data);
+        free(copy->palette);
         free(copy); // Free the allocated PNG_Image structure if data allocation fails
         return NULL;
     }
 
     // Copy the image data
     memcpy(copy->data, source->data, dataSize);
+    if (source->palette) {
+        memcpy(copy->palette, source->palette, 256 * 4);
+    }
+
+    // The pixels are identical, so the span index still applies and is copied rather than rebuilt
+    copy->span_index = NULL;
+    if (source->span_index) {
+        copy->span_index = copy_span_index(source->span_index, source->height);
+    }
 
     return copy;
 }
 
+/*
+ * Sets whether images loaded or created from now on are converted to premultiplied alpha
+ */
+void png_set_premultiplied_loading(bool enabled) {
+    atomic_store(&load_premultiplied, enabled);
+}
+
+/*
+ * Returns true if images loaded or created from now on are converted to premultiplied alpha, false otherwise
+ */
+bool png_get_premultiplied_loading() {
+    return atomic_load(&load_premultiplied);
+}
+
+/*
+ * Sets whether images loaded from now on keep a compact pixel format when it loses nothing
+ */
+void png_set_compact_loading(bool enabled) {
+    atomic_store(&load_compact, enabled);
+}
+
+/*
+ * Returns true if images loaded from now on keep a compact pixel format when it loses nothing, false otherwise
+ */
+bool png_get_compact_loading() {
+    return atomic_load(&load_compact);
+}
+
+/*
+ * Returns the number of bytes one pixel takes in the given format
+ */
+int png_bytes_per_pixel(Pixel_Format format) {
+    switch (format) {
+        case PIXEL_FORMAT_A8:
+        case PIXEL_FORMAT_INDEXED: return 1;
+        case PIXEL_FORMAT_RGB565: return 2;
+        default: return 4;
+    }
+}
+
+/*
+ * Expands A8 pixels to white with their alpha, which premultiplied is the alpha in every channel
+ * Each representation has its own loop, so neither branches per pixel
+ */
+static void expand_row_a8(uint8_t* out, const uint8_t* alphas, int count, bool premultiplied) {
+    if (premultiplied) {
+        for (int i = 0; i < count; i++) {
+            uint32_t pixel = alphas[i] * 0x01010101u;
+            memcpy(out + i * 4, &pixel, 4);
+        }
+    } else {
+        for (int i = 0; i < count; i++) {
+            uint32_t pixel = rgba_word(255, 255, 255, alphas[i]);
+            memcpy(out + i * 4, &pixel, 4);
+        }
+    }
+}
+
+/*
+ * Expands RGB565 pixels to opaque RGBA
+ */
+static void expand_row_rgb565(uint8_t* out, const uint16_t* colors, int count) {
+    for (int i = 0; i < count; i++) {
+        uint32_t pixel = expand_rgb565(colors[i]);
+        memcpy(out + i * 4, &pixel, 4);
+    }
+}
+
+/*
+ * Expands palette indices to the RGBA colors they select
+ */
+static void expand_row_indexed(uint8_t* out, const uint8_t* indices, int count, const uint8_t* palette) {
+    for (int i = 0; i < count; i++) {
+        memcpy(out + i * 4, palette + indices[i] * 4, 4);
+    }
+}
+
+/*
+ * Writes count pixels of row y of the image, starting at column x, as RGBA in the alpha representation of the image
+ * Every format has its own loop, so compact images are expanded a row at a time without branching per pixel
+ */
+void png_expand_row(const PNG_Image *const image, int x, int y, int count, uint8_t* out) {
+    size_t first = (size_t)y * image->width + x;
+    switch (image->format) {
+        case PIXEL_FORMAT_A8:
+            expand_row_a8(out, image->data + first, count, image->premultiplied);
+            break;
+        case PIXEL_FORMAT_RGB565:
+            expand_row_rgb565(out, (const uint16_t*)image->data + first, count);
+            break;
+        case PIXEL_FORMAT_INDEXED:
+            expand_row_indexed(out, image->data + first, count, image->palette);
+            break;
+        default:
+            memcpy(out, image->data + first * 4, (size_t)count * 4);
+            break;
+    }
+}
+
+/*
+ * Writes the pixels at the given indices of the image, each y * width + x, as RGBA in the alpha representation of the image
+ * Used by the scalers to sample compact images without expanding them first
+ */
+void png_gather_pixels(const PNG_Image *const image, const uint32_t* indices, int count, uint8_t* out) {
+    switch (image->format) {
+        case PIXEL_FORMAT_A8:
+            for (int i = 0; i < count; i++) {
+                expand_row_a8(out + i * 4, image->data + indices[i], 1, image->premultiplied);
+            }
+            break;
+        case PIXEL_FORMAT_RGB565:
+            for (int i = 0; i < count; i++) {
+                uint32_t pixel = expand_rgb565(((const uint16_t*)image->data)[indices[i]]);
+                memcpy(out + i * 4, &pixel, 4);
+            }
+            break;
+        case PIXEL_FORMAT_INDEXED:
+            for (int i = 0; i < count; i++) {
+                memcpy(out + i * 4, image->palette + image->data[indices[i]] * 4, 4);
+            }
+            break;
+        default:
+            for (int i = 0; i < count; i++) {
+                memcpy(out + i * 4, image->data + (size_t)indices[i] * 4, 4);
+            }
+            break;
+    }
+}
+
+/*
+ * Returns the palette entry holding the given RGBA pixel, adding it if there is room
+ * Returns -1 if the palette is full and does not hold the pixel
+ */
+int find_palette_entry(uint8_t* palette, int* color_count, const uint8_t* pixel) {
+    for (int i = 0; i < *color_count; i++) {
+        if (memcmp(palette + i * 4, pixel, 4) == 0) return i;
+    }
+    if (*color_count == 256) return -1;
+    memcpy(palette + *color_count * 4, pixel, 4);
+    return (*color_count)++;
+}
+
+/*
+ * Converts the pixels of a PNG_Image to another format in place
+ * Converting to A8 keeps only the alpha, the color is left to the layer tint. Converting to RGB565 fails unless the image is opaque,
+ * and converting to indexed fails if the image has more than 256 distinct colors. Returns false on failure, leaving the image unchanged.
+ */
+bool png_convert_format(PNG_Image *const image, Pixel_Format format) {
+    if (!image || !image->data || format < 0 || format >= PIXEL_FORMAT_COUNT) return false;
+    if (image->format == format) return true;
+    if (format == PIXEL_FORMAT_RGB565 && !png_is_opaque(image)) return false; // Nowhere to keep the alpha
+
+    size_t pixel_count = (size_t)image->width * image->height;
+    unsigned char* data = malloc(pixel_count * png_bytes_per_pixel(format));
+    uint8_t* palette = format == PIXEL_FORMAT_INDEXED ? calloc(256, 4) : NULL;
+    uint8_t* row = malloc((size_t)(image->width > 0 ? image->width : 1) * 4);
+    if (!data || !row || (format == PIXEL_FORMAT_INDEXED && !palette)) {
+        fprintf(stderr, "Failed to allocate memory for image conversion\n");
+        free(data);
+        free(palette);
+        free(row);
+        return false;
+    }
+
+    // Every row is expanded to RGBA, then packed into the new format
+    int color_count = 0;
+    for (int y = 0; y < image->height; y++) {
+        png_expand_row(image, 0, y, image->width, row);
+        size_t first = (size_t)y * image->width;
+        for (int x = 0; x < image->width; x++) {
+            const uint8_t* pixel = row + x * 4;
+            switch (format) {
+                case PIXEL_FORMAT_A8:
+                    data[first + x] = pixel[3];
+                    break;
+                case PIXEL_FORMAT_RGB565:
+                    ((uint16_t*)data)[first + x] = pack_rgb565(pixel);
+                    break;
+                case PIXEL_FORMAT_INDEXED: {
+                    int entry = find_palette_entry(palette, &color_count, pixel);
+                    if (entry < 0) { // Too many colors
+                        free(data);
+                        free(palette);
+                        free(row);
+                        return false;
+                    }
+                    data[first + x] = entry;
+                    break;
+                }
+                default:
+                    memcpy(data + (first + x) * 4, pixel, 4);
+                    break;
+            }
+        }
+    }
+    free(row);
+
+    free(image->data);
+    free(image->palette);
+    image->data = data;
+    image->palette = palette;
+    image->format = format;
+
+    // The alpha of every pixel is kept, so the opaque region still holds, but colors may have changed
+    png_mark_changed(image);
+    if (image->span_index) {
+        png_build_span_index(image);
+    }
+    return true;
+}
+
+/*
+ * Returns the RGBA pixels which hold the colors of an image and their count, the palette of indexed images
+ * A8 and RGB565 images hold no colors, their pixels expand to the right representation by themselves
+ */
+size_t get_color_pixels(PNG_Image *const image, unsigned char** pixels) {
+    switch (image->format) {
+        case PIXEL_FORMAT_RGBA:
+            *pixels = image->data;
+            return (size_t)image->width * image->height;
+        case PIXEL_FORMAT_INDEXED:
+            *pixels = image->palette;
+            return 256;
+        default:
+            *pixels = NULL;
+            return 0;
+    }
+}
+
+/*
+ * Converts a straight alpha PNG_Image to premultiplied alpha in place, does nothing if it is already premultiplied
+ * Indexed images only convert their palette
+ */
+void png_premultiply_image(PNG_Image *const image) {
+    if (!image || !image->data || image->premultiplied) return;
+
+    unsigned char* pixels;
+    size_t dataSize = get_color_pixels(image, &pixels) * 4; // 4 bytes per pixel for RGBA
+    for (size_t i = 0; i < dataSize; i += 4) {
+        unsigned int alpha = pixels[i + 3];
+        if (alpha == 255) continue; // Opaque pixels are the same either way
+        pixels[i] = premultiply_channel(pixels[i], alpha);
+        pixels[i + 1] = premultiply_channel(pixels[i + 1], alpha);
+        pixels[i + 2] = premultiply_channel(pixels[i + 2], alpha);
+    }
+
+    image->premultiplied = true;
+    png_mark_changed(image);
+}
+
+/*
+ * Converts a premultiplied alpha PNG_Image back to straight alpha in place, does nothing if it is already straight
+ * Color precision lost to premultiplication in very transparent pixels is not recovered. Indexed images only convert their palette.
+ */
+void png_unpremultiply_image(PNG_Image *const image) {
+    if (!image || !image->data || !image->premultiplied) return;
+
+    unsigned char* pixels;
+    size_t dataSize = get_color_pixels(image, &pixels) * 4; // 4 bytes per pixel for RGBA
+    for (size_t i = 0; i < dataSize; i += 4) {
+        unsigned int alpha = pixels[i + 3];
+        if (alpha == 255 || alpha == 0) continue; // Nothing to divide out
+        for (int c = 0; c < 3; c++) {
+            unsigned int channel = (pixels[i + c] * 255 + alpha / 2) / alpha;
+            pixels[i + c] = channel > 255 ? 255 : channel;
+        }
+    }
+
+    image->premultiplied = false;
+    png_mark_changed(image);
+}
+
+/*
+ * Returns the alpha of the pixel at the given index of an image, y * width + x, in any format
+ */
+static inline unsigned char pixel_alpha(const PNG_Image *const image, size_t index) {
+    switch (image->format) {
+        case PIXEL_FORMAT_A8: return image->data[index];
+        case PIXEL_FORMAT_RGB565: return 255;
+        case PIXEL_FORMAT_INDEXED: return image->palette[image->data[index] * 4 + 3];
+        default: return image->data[index * 4 + 3];
+    }
+}
+
+/*
+ * Returns true if the pixels from start_x up to end_x in the given row are all fully opaque, false otherwise
+ */
+bool is_row_span_opaque(const PNG_Image *const image, int row, int start_x, int end_x) {
+    size_t first = (size_t)row * image->width;
+    for (int x = start_x; x < end_x; x++) {
+        if (pixel_alpha(image, first + x) != 255) return false;
+    }
+    return true;
+}
+
+/*
+ * Recomputes the cached opaque region of a PNG_Image from its pixel data
+ * The longest opaque run of the middle row is grown up and down for as long as the rows above and below stay opaque across it.
+ * This finds the whole image for opaque images, and the body of panels with rounded or soft edges, in a single pass at worst.
+ */
+void png_update_opaque_region(PNG_Image *const image) {
+    if (!image) return;
+    png_mark_changed(image); // Called after the pixels were written, so they may have changed
+    image->opaque_region = (Image_Rect){0, 0, 0, 0};
+    if (!image->data || image->width <= 0 || image->height <= 0) return;
+
+    // RGB565 has no alpha to scan
+    if (image->format == PIXEL_FORMAT_RGB565) {
+        image->opaque_region = (Image_Rect){0, 0, image->width, image->height};
+        return;
+    }
+
+    // Find the longest run of opaque pixels in the middle row
+    int middle = image->height / 2;
+    size_t row = (size_t)middle * image->width;
+    int best_start = 0, best_length = 0, run_start = 0;
+    for (int x = 0; x <= image->width; x++) {
+        if (x < image->width && pixel_alpha(image, row + x) == 255) continue;
+        if (x - run_start > best_length) {
+            best_start = run_start;
+            best_length = x - run_start;
+        }
+        run_start = x + 1;
+    }
+    if (best_length == 0) return; // Nothing opaque in the middle, treat the image as see through
+
+    // Grow the run into a rectangle
+    int top = middle;
+    while (top > 0 && is_row_span_opaque(image, top - 1, best_start, best_start + best_length)) top--;
+    int bottom = middle + 1;
+    while (bottom < image->height && is_row_span_opaque(image, bottom, best_start, best_start + best_length)) bottom++;
+
+    image->opaque_region = (Image_Rect){best_start, top, best_length, bottom - top};
+}
+
+/*
+ * Updates the cached opaque region of a PNG_Image after the pixels in the given rectangle changed, scanning only that rectangle.
+ * A fully opaque rectangle replaces the region when it is larger, otherwise the region is cut down to its largest part outside the rectangle.
+ * The result is always opaque but may be smaller than what png_update_opaque_region would find. Also gives the image a new generation.
+ */
+void png_update_opaque_region_rect(PNG_Image *const image, Image_Rect rect) {
+    if (!image) return;
+    png_mark_changed(image);
+    if (!image->data || image->format == PIXEL_FORMAT_RGB565) return; // Always opaque, the region stays the whole image
+
+    // Clip the rectangle to the image
+    int left = rect.x > 0 ? rect.x : 0;
+    int top = rect.y > 0 ? rect.y : 0;
+    int right = rect.x + rect.width < image->width ? rect.x + rect.width : image->width;
+    int bottom = rect.y + rect.height < image->height ? rect.y + rect.height : image->height;
+    if (left >= right || top >= bottom) return;
+
+    bool opaque = true;
+    for (int y = top; y < bottom && opaque; y++) {
+        opaque = is_row_span_opaque(image, y, left, right);
+    }
+
+    Image_Rect region = image->opaque_region;
+    if (opaque) {
+        if ((long)(right - left) * (bottom - top) > (long)region.width * region.height) {
+            image->opaque_region = (Image_Rect){left, top, right - left, bottom - top};
+        }
+        return;
+    }
+
+    // Nothing to cut when the rectangle missed the region
+    int region_right = region.x + region.width;
+    int region_bottom = region.y + region.height;
+    if (left >= region_right || right <= region.x || top >= region_bottom || bottom <= region.y) return;
+
+    // Keep the largest of the parts of the region above, below, left and right of the rectangle
+    Image_Rect parts[4] = {
+        {region.x, region.y, region.width, top - region.y},
+        {region.x, bottom, region.width, region_bottom - bottom},
+        {region.x, region.y, left - region.x, region.height},
+        {right, region.y, region_right - right, region.height},
+    };
+    Image_Rect best = {0, 0, 0, 0};
+    for (int i = 0; i < 4; i++) {
+        if (parts[i].width <= 0 || parts[i].height <= 0) continue;
+        if ((long)parts[i].width * parts[i].height > (long)best.width * best.height) best = parts[i];
+    }
+    image->opaque_region = best;
+}
+
+/*
+ * Gives the image a new generation, so compositors which cached frames drawn from it draw it again
+ * Functions which modify an image in place do this already, as does png_update_opaque_region
+ */
+void png_mark_changed(PNG_Image *const image) {
+    if (!image) return;
+    image->generation = atomic_fetch_add(&next_generation, 1);
+}
+
+/*
+ * Returns true if the cached opaque region of a PNG_Image covers the whole image, false otherwise
+ */
+bool png_is_opaque(const PNG_Image *const image) {
+    return image && image->opaque_region.width == image->width && image->opaque_region.height == image->height;
+}
+
+/*
+ * Returns the Span_Kind of a single pixel
+ * A premultiplied pixel with an alpha of 0 but nonzero color still adds light when blended, so it only counts as transparent when all zero
+ */
+Span_Kind span_kind_of(const unsigned char* pixel, bool premultiplied) {
+    if (pixel[3] == 255) return SPAN_OPAQUE;
+    if (pixel[3] == 0 && (!premultiplied || (pixel[0] | pixel[1] | pixel[2]) == 0)) return SPAN_TRANSPARENT;
+    return SPAN_PARTIAL;
+}
+
+/*
+ * Appends a span to a row, folding short transparent and opaque runs into partial runs and joining neighbors of the same kind
+ * Returns the new number of spans in the row
+ */
+int append_span(Image_Span* row_spans, int count, Image_Span span) {
+    if (span.kind != SPAN_PARTIAL && span.length < MIN_SPAN_LENGTH) {
+        span.kind = SPAN_PARTIAL;
+    }
+    if (count > 0 && row_spans[count - 1].kind == span.kind) {
+        row_spans[count - 1].length += span.length;
+        return count;
+    }
+    row_spans[count] = span;
+    return count + 1;
+}
+
+/*
+ * Splits one row of an image into spans, written to row_spans which must have room for one span per pixel
+ * Compact formats are expanded into the given row buffer first, which must hold width RGBA pixels. Returns the number of spans.
+ */
+static int split_row_into_spans(const PNG_Image *const image, int y, Image_Span* row_spans, unsigned char* expanded) {
+    const unsigned char* row = image->data + (size_t)y * image->width * 4;
+    if (expanded) {
+        png_expand_row(image, 0, y, image->width, expanded);
+        row = expanded;
+    }
+
+    // Split the row into runs of the same kind
+    int count = 0;
+    int run_start = 0;
+    for (int x = 1; x <= image->width; x++) {
+        Span_Kind kind = span_kind_of(row + run_start * 4, image->premultiplied);
+        if (x < image->width && span_kind_of(row + x * 4, image->premultiplied) == kind) continue;
+        count = append_span(row_spans, count, (Image_Span){run_start, x - run_start, kind});
+        run_start = x;
+    }
+    return count;
+}
+
+/*
+ * Builds and caches the span index of a PNG_Image, replacing any index it already had
+ * With an index the compositor skips transparent runs and copies opaque runs instead of blending them, which pays off for sprites and icons
+ * Call it again after writing to the pixel data directly. Returns false if the index could not be allocated.
+ */
+bool png_build_span_index(PNG_Image *const image) {
+    if (!image || !image->data) return false;
+    png_discard_span_index(image);
+
+    // Worst case every pixel starts a new span, the spans are trimmed to size afterwards
+    Image_Span_Index* index = malloc(sizeof(Image_Span_Index));
+    int* row_starts = malloc(sizeof(int) * (image->height + 1));
+    Image_Span* row_spans = malloc(sizeof(Image_Span) * (image->width > 0 ? image->width : 1));
+    size_t capacity = 64;
+    Image_Span* spans = malloc(sizeof(Image_Span) * capacity);
+    // Compact rows are expanded one at a time, so their spans come out the same as those of the RGBA image
+    unsigned char* expanded = image->format != PIXEL_FORMAT_RGBA ? malloc((size_t)(image->width > 0 ? image->width : 1) * 4) : NULL;
+    if (!index || !row_starts || !row_spans || !spans || (image->format != PIXEL_FORMAT_RGBA && !expanded)) {
+        fprintf(stderr, "Failed to allocate memory for span index\n");
+        free(index);
+        free(row_starts);
+        free(row_spans);
+        free(spans);
+        free(expanded);
+        return false;
+    }
+
+    size_t total = 0;
+    for (int y = 0; y < image->height; y++) {
+        int count = split_row_into_spans(image, y, row_spans, expanded);
+
+        if (total + count > capacity) {
+            while (total + count > capacity) capacity *= 2;
+            Image_Span* new_spans = realloc(spans, sizeof(Image_Span) * capacity);
+            if (!new_spans) {
+                fprintf(stderr, "Failed to allocate memory for span index\n");
+                free(index);
+                free(row_starts);
+                free(row_spans);
+                free(spans);
+                free(expanded);
+                return false;
+            }
+            spans = new_spans;
+        }
+
+        row_starts[y] = total;
+        memcpy(spans + total, row_spans, sizeof(Image_Span) * count);
+        total += count;
+    }
+    row_starts[image->height] = total;
+    free(row_spans);
+    free(expanded);
+
+    // Give back the unused part of the span array
+    Image_Span* trimmed = realloc(spans, sizeof(Image_Span) * (total > 0 ? total : 1));
+    index->spans = trimmed ? trimmed : spans;
+    index->row_starts = row_starts;
+    image->span_index = index;
+
+    return true;
+}
+
+/*
+ * Rebuilds the span index of a PNG_Image for the given rows only, after their pixels changed. The spans of the other rows are moved, not rebuilt.
+ * Builds the whole index if the image has none yet. Returns false if the index could not be allocated, in which case the image is left without one.
+ */
+bool png_update_span_index_rows(PNG_Image *const image, int first_row, int row_count) {
+    if (!image || !image->data) return false;
+    if (!image->span_index) return png_build_span_index(image);
+
+    int end_row = first_row + row_count < image->height ? first_row + row_count : image->height;
+    if (first_row < 0) first_row = 0;
+    if (first_row >= end_row) return true;
+
+    // Worst case every pixel of the rows starts a new span
+    Image_Span* new_spans = malloc(sizeof(Image_Span) * (size_t)(end_row - first_row) * (image->width > 0 ? image->width : 1));
+    int* new_counts = malloc(sizeof(int) * (end_row - first_row));
+    unsigned char* expanded = image->format != PIXEL_FORMAT_RGBA ? malloc((size_t)(image->width > 0 ? image->width : 1) * 4) : NULL;
+    if (!new_spans || !new_counts || (image->format != PIXEL_FORMAT_RGBA && !expanded)) {
+        fprintf(stderr, "Failed to allocate memory for span index\n");
+        free(new_spans);
+        free(new_counts);
+        free(expanded);
+        png_discard_span_index(image); // The old spans of the rows no longer match their pixels
+        return false;
+    }
+
+    size_t added = 0;
+    for (int y = first_row; y < end_row; y++) {
+        new_counts[y - first_row] = split_row_into_spans(image, y, new_spans + added, expanded);
+        added += new_counts[y - first_row];
+    }
+    free(expanded);
+
+    Image_Span_Index* index = image->span_index;
+    size_t before = index->row_starts[first_row];
+    size_t removed = index->row_starts[end_row] - before;
+    size_t after = index->row_starts[image->height] - index->row_starts[end_row];
+    size_t total = before + added + after;
+
+    // Grow before moving the spans of the rows below up, shrink after moving them down
+    if (added > removed) {
+        Image_Span* grown = realloc(index->spans, sizeof(Image_Span) * total);
+        if (!grown) {
+            fprintf(stderr, "Failed to allocate memory for span index\n");
+            free(new_spans);
+            free(new_counts);
+            png_discard_span_index(image);
+            return false;
+        }
+        index->spans = grown;
+    }
+    memmove(index->spans + before + added, index->spans + before + removed, sizeof(Image_Span) * after);
+    memcpy(index->spans + before, new_spans, sizeof(Image_Span) * added);
+    if (added < removed) {
+        Image_Span* trimmed = realloc(index->spans, sizeof(Image_Span) * (total > 0 ? total : 1));
+        if (trimmed) index->spans = trimmed;
+    }
+
+    // Point the rows at their new spans
+    size_t start = before;
+    for (int y = first_row; y < end_row; y++) {
+        index->row_starts[y] = start;
+        start += new_counts[y - first_row];
+    }
+    for (int y = end_row; y <= image->height; y++) {
+        index->row_starts[y] += (int)added - (int)removed;
+    }
+
+    free(new_spans);
+    free(new_counts);
+    return true;
+}
+
+/*
+ * Deallocates the span index of a PNG_Image, if it has one
+ */
+void png_discard_span_index(PNG_Image *const image) {
+    if (!image || !image->span_index) return;
+    free(image->span_index->row_starts);
+    free(image->span_index->spans);
+    free(image->span_index);
+    image->span_index = NULL;
+}
+
 /*
  * Safely deallocate memory used by a PNG_Image structure, including its image data, and then the structure itself
  */
@@ -425,6 +1253,11 @@ void png_destroy_image(PNG_Image** imgPtr) {
             free((*imgPtr)->data);
             (*imgPtr)->data = NULL; // Avoid dangling pointer
         }
+        // Free the palette of indexed images
+        free((*imgPtr)->palette);
+        (*imgPtr)->palette = NULL;
+        // Free the span index if one was built
+        png_discard_span_index(*imgPtr);
         // Free the image struct itself
         free(*imgPtr);
         // Set the user's pointer to NULL to avoid dangling pointer usage outside this function
@@ -1,8 +1,24 @@
 #include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h> // perror
+#include <string.h>
+#include "blending.h"
 #include "scaling.h"
 
+// x86 builds get AVX2 gather kernels for the affine samplers, picked at runtime, define NAGATO_NO_SIMD to build the portable kernels only
+#if !defined(NAGATO_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NAGATO_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Compact format sources are sampled this many pixels at a time, gathering into buffers on the stack small enough to stay in L1
+#define GATHER_CHUNK_PIXELS 64
+
+// Fastest affine sampler of every filter supported by this CPU, picked once
+static Affine_Row_Function affine_kernels[SCALE_FILTER_COUNT];
+static pthread_once_t affine_select_once = PTHREAD_ONCE_INIT; // Guards the kernel selection
+
 //TODO: Bicubic interpolation
 //TODO: Lanczos Resampling
 //TODO: Box Sampling
@@ -34,12 +50,26 @@ unsigned int getB(unsigned int color) {
     return (color & 0x000000FF);
 }
 
+/*
+ * extracts the alpha component of a color
+ * uses a bitwise AND operation with the mask 0xFF000000 to isolate the bits representing the alpha component in the color
+ * shifts these bits 24 places to the right, resulting in an 8-bit value (0-255) that corresponds to the opacity
+ */
+unsigned int getA(unsigned int color) {
+    return (color & 0xFF000000) >> 24;
+}
+
 /*
  * scales an image to a new width and height using nearest neighbor scaling
  * returns a newly created PNG_Image struct
  * does not deallocate the original PNG_Image at all
  */
 PNG_Image* nearest_neighbor_scale(const PNG_Image *const orig, int new_width, int new_height) {
+    // Compact sources are read by the row samplers, which sample them without expanding them first
+    if (orig->format != PIXEL_FORMAT_RGBA) {
+        return scale_image_by_rows(orig, new_width, new_height, SCALE_NEAREST);
+    }
+
     // Calculate the ratio of old width to new width, shifted left by 16 bits for fixed-point arithmetic, and add 1 for rounding
     int x_ratio = (int)((orig->width << 16) / new_width) + 1;
     // Calculate the ratio of old height to new height, similarly adjusted for fixed-point arithmetic
@@ -56,6 +86,9 @@ PNG_Image* nearest_neighbor_scale(const PNG_Image *const orig, int new_width, in
         return NULL;
     }
 
+    // Pixels are copied unchanged, so the alpha representation carries over
+    scaled->premultiplied = orig->premultiplied;
+
     // Loop over each pixel in the new (scaled) image height
     for (int i = 0; i < new_height; i++) {
         // Loop over each pixel in the new (scaled) image width
@@ -76,6 +109,9 @@ PNG_Image* nearest_neighbor_scale(const PNG_Image *const orig, int new_width, in
         }
     }
 
+    // The pixels were overwritten, so the opaque region of the fill color no longer applies
+    png_update_opaque_region(scaled);
+
     return scaled;
 }
 
@@ -85,6 +121,11 @@ PNG_Image* nearest_neighbor_scale(const PNG_Image *const orig, int new_width, in
  * does not deallocate the original PNG_Image at all
  */
 PNG_Image* bilinear_interpolation_scale(const PNG_Image *const orig, int new_width, int new_height) {
+    // Compact sources are read by the row samplers, which sample them without expanding them first
+    if (orig->format != PIXEL_FORMAT_RGBA) {
+        return scale_image_by_rows(orig, new_width, new_height, SCALE_BILINEAR);
+    }
+
     // Create a new PNG_Image structure for the scaled image
     PNG_Image* scaled = png_create_image(new_width, new_height, 0xFFFFFF);
 
@@ -95,6 +136,9 @@ PNG_Image* bilinear_interpolation_scale(const PNG_Image *const orig, int new_wid
         return NULL; // Return NULL on failure
     }
 
+    // Interpolating premultiplied pixels keeps transparent neighbors from bleeding their color into the result
+    scaled->premultiplied = orig->premultiplied;
+
     // Calculate the ratio of the old dimensions to the new dimensions minus one to avoid accessing out of bounds
     double x_ratio = (double)(orig->width - 1) / new_width;
     double y_ratio = (double)(orig->height - 1) / new_height;
@@ -129,12 +173,534 @@ PNG_Image* bilinear_interpolation_scale(const PNG_Image *const orig, int new_wid
             unsigned int r = (unsigned int)(getR(p1) * (1 - fx) * (1 - fy) + getR(p2) * fx * (1 - fy) + getR(p3) * (1 - fx) * fy + getR(p4) * fx * fy);
             unsigned int g = (unsigned int)(getG(p1) * (1 - fx) * (1 - fy) + getG(p2) * fx * (1 - fy) + getG(p3) * (1 - fx) * fy + getG(p4) * fx * fy);
             unsigned int b = (unsigned int)(getB(p1) * (1 - fx) * (1 - fy) + getB(p2) * fx * (1 - fy) + getB(p3) * (1 - fx) * fy + getB(p4) * fx * fy);
+            unsigned int a = (unsigned int)(getA(p1) * (1 - fx) * (1 - fy) + getA(p2) * fx * (1 - fy) + getA(p3) * (1 - fx) * fy + getA(p4) * fx * fy);
 
             // Combine the interpolated components back into a single pixel value and store it in the scaled image
-            *((unsigned int*)(scaled->data + i * (scaled->width * 4) + j * 4)) = (r << 16) | (g << 8) | b;
+            *((unsigned int*)(scaled->data + i * (scaled->width * 4) + j * 4)) = (a << 24) | (r << 16) | (g << 8) | b;
         }
     }
 
+    // The pixels were overwritten, so the opaque region of the fill color no longer applies
+    png_update_opaque_region(scaled);
+
     // Return the pointer to the scaled image
     return scaled;
-}
\ No newline at end of file
+}
+
+/*
+ * Returns the source offset sampled by nearest neighbor scaling for an offset into a size scaled from src_size to dest_size pixels
+ * Samples the nearest pixel to the center of the destination pixel, in 16.16 fixed point
+ */
+int nearest_sample(int offset, int src_size, int dest_size) {
+    int64_t step = ((int64_t)src_size << 16) / dest_size;
+    return (int)((step * offset + step / 2) >> 16);
+}
+
+/*
+ * Samples a row of a scaled source rectangle taking the nearest pixel to the center of every destination pixel
+ */
+void scale_row_nearest(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y, int count) {
+    int src_y = source.y + nearest_sample(dest_y, source.height, dest_height);
+    const uint8_t* src_row = image->data + ((size_t)src_y * image->width + source.x) * 4;
+
+    // Step through the row in 16.16 fixed point, the same positions nearest_sample gives
+    int64_t step = ((int64_t)source.width << 16) / dest_width;
+    int64_t position = step * dest_x + step / 2;
+    for (int i = 0; i < count; i++, position += step) {
+        memcpy(out + i * 4, src_row + (position >> 16) * 4, 4);
+    }
+}
+
+/*
+ * Splits a 16.16 fixed point bilinear source position into the first of the 2 source pixels to blend and the weight of the second out of 256
+ * Positions are clamped to the source, the last pixel has no second pixel to blend with
+ */
+void split_bilinear_position(int64_t position, int src_size, int* first, int* weight) {
+    if (position < 0) position = 0;
+    *first = (int)(position >> 16);
+    *weight = (int)((position >> 8) & 0xFF);
+    if (*first >= src_size - 1) {
+        *first = src_size - 1;
+        *weight = 0;
+    }
+}
+
+/*
+ * Blends the 4 pixels around a scaled sample with 8 bit weights for the right pixels and the lower pixels, rounding once at the end
+ */
+static inline void blend_scaled_samples(uint8_t* out, const uint8_t* top_left, const uint8_t* top_right, const uint8_t* bottom_left, const uint8_t* bottom_right,
+                                        int weight_x, int weight_y) {
+    for (int c = 0; c < 4; c++) {
+        uint32_t upper = top_left[c] * (256 - weight_x) + top_right[c] * weight_x;
+        uint32_t lower = bottom_left[c] * (256 - weight_x) + bottom_right[c] * weight_x;
+        out[c] = (uint8_t)((upper * (256 - weight_y) + lower * weight_y + 32768) >> 16);
+    }
+}
+
+/*
+ * Samples a row of a scaled source rectangle blending the 4 pixels around the center of every destination pixel
+ * Uses 16.16 fixed point positions and 8 bit weights, the edges of the source rectangle are clamped
+ */
+void scale_row_bilinear(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y, int count) {
+    // Pixel centers sit half a pixel in, on both sides of the scale
+    int64_t step_y = ((int64_t)source.height << 16) / dest_height;
+    int row, weight_y;
+    split_bilinear_position(step_y * dest_y + step_y / 2 - 32768, source.height, &row, &weight_y);
+    size_t stride = (size_t)image->width * 4;
+    const uint8_t* top = image->data + (size_t)(source.y + row) * stride + (size_t)source.x * 4;
+    const uint8_t* bottom = weight_y ? top + stride : top;
+
+    int64_t step_x = ((int64_t)source.width << 16) / dest_width;
+    int64_t position = step_x * dest_x + step_x / 2 - 32768;
+    for (int i = 0; i < count; i++, position += step_x) {
+        int column, weight_x;
+        split_bilinear_position(position, source.width, &column, &weight_x);
+        int next = weight_x ? 4 : 0; // Clamped pixels blend with themselves
+        const uint8_t* t = top + column * 4;
+        const uint8_t* b = bottom + column * 4;
+        blend_scaled_samples(out + i * 4, t, t + next, b, b + next, weight_x, weight_y);
+    }
+}
+
+/*
+ * Blends the 4 pixels around a sample in linear light, with 8 bit weights for the right pixels and the lower pixels
+ * Colors are decoded to 16 bit linear light and weighted by their alpha, so transparent pixels never darken their neighbors,
+ * then divided by the blended alpha and encoded back. Premultiplied pixels are unpremultiplied on the way in and premultiplied on the way out.
+ * Rows are blended first and rounded, then the columns, the same order and rounding as the sRGB samplers, so the alpha channel matches them.
+ */
+static void blend_linear_samples(uint8_t* out, const uint8_t* top_left, const uint8_t* top_right, const uint8_t* bottom_left, const uint8_t* bottom_right,
+                                 int weight_x, int weight_y, bool premultiplied, const Linear_Light_Tables* tables) {
+    const uint8_t* pixels[4] = {top_left, top_right, bottom_left, bottom_right};
+    uint32_t weighted[4][4]; // Alpha weighted linear colors then the alpha, all out of 65535
+    for (int p = 0; p < 4; p++) {
+        uint32_t alpha = pixels[p][3];
+        for (int c = 0; c < 3; c++) {
+            uint32_t color = pixels[p][c];
+            if (premultiplied) color = alpha == 0 ? 0 : (color * 255 + alpha / 2) / alpha;
+            if (color > 255) color = 255;
+            weighted[p][c] = (tables->srgb_to_linear[color] * alpha + 127) / 255;
+        }
+        weighted[p][3] = alpha * 257;
+    }
+
+    uint32_t blended[4];
+    for (int c = 0; c < 4; c++) {
+        uint32_t upper = (weighted[0][c] * (256 - weight_x) + weighted[1][c] * weight_x + 128) >> 8;
+        uint32_t lower = (weighted[2][c] * (256 - weight_x) + weighted[3][c] * weight_x + 128) >> 8;
+        blended[c] = (upper * (256 - weight_y) + lower * weight_y + 128) >> 8;
+    }
+
+    uint32_t alpha = (blended[3] + 128) / 257;
+    for (int c = 0; c < 3; c++) {
+        uint32_t linear = blended[3] == 0 ? 0 : (blended[c] * 65535 + blended[3] / 2) / blended[3];
+        uint32_t color = tables->linear_to_srgb[(linear > 65535 ? 65535 : linear) >> 4];
+        out[c] = (uint8_t)(premultiplied ? (color * alpha + 127) / 255 : color);
+    }
+    out[3] = (uint8_t)alpha;
+}
+
+/*
+ * Samples a row of a scaled source rectangle like scale_row_bilinear, blending the 4 pixels around every sample in linear light
+ * Downscaled photos and soft edges keep their brightness, at the cost of table lookups and a division per channel
+ */
+void scale_row_bilinear_linear(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y, int count) {
+    const Linear_Light_Tables* tables = get_linear_light_tables();
+    int64_t step_y = ((int64_t)source.height << 16) / dest_height;
+    int row, weight_y;
+    split_bilinear_position(step_y * dest_y + step_y / 2 - 32768, source.height, &row, &weight_y);
+    size_t stride = (size_t)image->width * 4;
+    const uint8_t* top = image->data + (size_t)(source.y + row) * stride + (size_t)source.x * 4;
+    const uint8_t* bottom = weight_y ? top + stride : top;
+
+    int64_t step_x = ((int64_t)source.width << 16) / dest_width;
+    int64_t position = step_x * dest_x + step_x / 2 - 32768;
+    for (int i = 0; i < count; i++, position += step_x) {
+        int column, weight_x;
+        split_bilinear_position(position, source.width, &column, &weight_x);
+        int next = weight_x ? 4 : 0; // Clamped pixels blend with themselves
+        const uint8_t* t = top + column * 4;
+        const uint8_t* b = bottom + column * 4;
+        blend_linear_samples(out + i * 4, t, t + next, b, b + next, weight_x, weight_y, image->premultiplied, tables);
+    }
+}
+
+/*
+ * Scales an image to a new width and height blending in linear light, sampling pixel centers like the compositor does
+ * Returns a newly created PNG_Image struct, in the alpha representation of the original, or NULL on failure
+ * Does not deallocate the original PNG_Image at all
+ */
+PNG_Image* bilinear_interpolation_scale_linear(const PNG_Image *const orig, int new_width, int new_height) {
+    return scale_image_by_rows(orig, new_width, new_height, SCALE_BILINEAR_LINEAR);
+}
+
+/*
+ * Scales a whole image to a new width and height with the row sampler of the given filter, sampling pixel centers like the compositor does
+ * Returns a newly created RGBA PNG_Image, in the alpha representation of the original, or NULL on failure
+ */
+PNG_Image* scale_image_by_rows(const PNG_Image *const orig, int new_width, int new_height, Scale_Filter filter) {
+    PNG_Image* scaled = png_allocate_image(new_width, new_height, orig->premultiplied);
+    if (!scaled) {
+        perror("Scaling by rows");
+        return NULL;
+    }
+
+    Scale_Row_Function scale_row = get_scale_row(filter, orig->format);
+    Image_Rect whole = {0, 0, orig->width, orig->height};
+    for (int y = 0; y < new_height; y++) {
+        scale_row(scaled->data + (size_t)y * new_width * 4, orig, whole, new_width, new_height, 0, y, new_width);
+    }
+
+    // The pixels were overwritten, so the opaque region has to be found again
+    png_update_opaque_region(scaled);
+    return scaled;
+}
+
+/*
+ * Clamps a 16.16 fixed point position to the pixels of a source axis and returns the pixel it falls in
+ */
+static inline int32_t clamp_sample(int32_t position, int size) {
+    int32_t pixel = position >> 16;
+    return pixel < 0 ? 0 : pixel >= size ? size - 1 : pixel;
+}
+
+/*
+ * Portable affine sampler, takes the pixel each position falls in
+ */
+static void affine_row_nearest_scalar(uint8_t* out, const PNG_Image* image, Image_Rect source, int32_t u, int32_t v, int32_t du, int32_t dv, int count) {
+    const uint8_t* origin = image->data + ((size_t)source.y * image->width + source.x) * 4;
+    for (int i = 0; i < count; i++, u += du, v += dv) {
+        int32_t x = clamp_sample(u, source.width);
+        int32_t y = clamp_sample(v, source.height);
+        memcpy(out + i * 4, origin + ((size_t)y * image->width + x) * 4, 4);
+    }
+}
+
+/*
+ * Blends the 4 pixels around an affine sample with 8 bit weights, rounding the rows to 8 bits before blending them like the AVX2 kernel
+ */
+static inline void blend_affine_samples(uint8_t* out, const uint8_t* top_left, const uint8_t* top_right, const uint8_t* bottom_left, const uint8_t* bottom_right,
+                                        int weight_x, int weight_y) {
+    for (int c = 0; c < 4; c++) {
+        uint32_t upper = (top_left[c] * (256 - weight_x) + top_right[c] * weight_x + 128) >> 8;
+        uint32_t lower = (bottom_left[c] * (256 - weight_x) + bottom_right[c] * weight_x + 128) >> 8;
+        out[c] = (uint8_t)((upper * (256 - weight_y) + lower * weight_y + 128) >> 8);
+    }
+}
+
+/*
+ * Portable affine sampler, blends the 4 pixels around each position with 8 bit weights
+ * Rows are blended first and rounded to 8 bits, then the columns, so every intermediate value fits the 16 bit lanes of the AVX2 kernel
+ */
+static void affine_row_bilinear_scalar(uint8_t* out, const PNG_Image* image, Image_Rect source, int32_t u, int32_t v, int32_t du, int32_t dv, int count) {
+    const uint8_t* origin = image->data + ((size_t)source.y * image->width + source.x) * 4;
+    size_t stride = (size_t)image->width * 4;
+    for (int i = 0; i < count; i++, u += du, v += dv) {
+        // Pixel centers sit half a pixel in
+        int32_t left_u = u - 32768, top_v = v - 32768;
+        int weight_x = (left_u >> 8) & 0xFF, weight_y = (top_v >> 8) & 0xFF;
+        int32_t x0 = clamp_sample(left_u, source.width), x1 = clamp_sample(left_u + 65536, source.width);
+        int32_t y0 = clamp_sample(top_v, source.height), y1 = clamp_sample(top_v + 65536, source.height);
+        const uint8_t* top = origin + (size_t)y0 * stride;
+        const uint8_t* bottom = origin + (size_t)y1 * stride;
+        blend_affine_samples(out + i * 4, top + x0 * 4, top + x1 * 4, bottom + x0 * 4, bottom + x1 * 4, weight_x, weight_y);
+    }
+}
+
+/*
+ * Portable affine sampler, blends the 4 pixels around each position in linear light
+ * There is no SIMD version, the table lookups and divisions per channel outweigh the arithmetic
+ */
+static void affine_row_bilinear_linear(uint8_t* out, const PNG_Image* image, Image_Rect source, int32_t u, int32_t v, int32_t du, int32_t dv, int count) {
+    const Linear_Light_Tables* tables = get_linear_light_tables();
+    const uint8_t* origin = image->data + ((size_t)source.y * image->width + source.x) * 4;
+    size_t stride = (size_t)image->width * 4;
+    for (int i = 0; i < count; i++, u += du, v += dv) {
+        int32_t left_u = u - 32768, top_v = v - 32768;
+        int weight_x = (left_u >> 8) & 0xFF, weight_y = (top_v >> 8) & 0xFF;
+        int32_t x0 = clamp_sample(left_u, source.width), x1 = clamp_sample(left_u + 65536, source.width);
+        int32_t y0 = clamp_sample(top_v, source.height), y1 = clamp_sample(top_v + 65536, source.height);
+        const uint8_t* top = origin + (size_t)y0 * stride;
+        const uint8_t* bottom = origin + (size_t)y1 * stride;
+        blend_linear_samples(out + i * 4, top + x0 * 4, top + x1 * 4, bottom + x0 * 4, bottom + x1 * 4, weight_x, weight_y, image->premultiplied, tables);
+    }
+}
+
+#ifdef NAGATO_X86_SIMD
+/*
+ * Clamps 8 16.16 fixed point positions to the pixels of a source axis, like clamp_sample
+ */
+__attribute__((target("avx2")))
+static inline __m256i clamp_sample_avx2(__m256i position, int size) {
+    __m256i pixel = _mm256_srai_epi32(position, 16);
+    return _mm256_min_epi32(_mm256_max_epi32(pixel, _mm256_setzero_si256()), _mm256_set1_epi32(size - 1));
+}
+
+/*
+ * AVX2 affine sampler, takes the pixel each position falls in, gathering 8 pixels per iteration
+ */
+__attribute__((target("avx2")))
+static void affine_row_nearest_avx2(uint8_t* out, const PNG_Image* image, Image_Rect source, int32_t u, int32_t v, int32_t du, int32_t dv, int count) {
+    const uint8_t* origin = image->data + ((size_t)source.y * image->width + source.x) * 4;
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i width = _mm256_set1_epi32(image->width);
+    __m256i us = _mm256_add_epi32(_mm256_set1_epi32(u), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(du)));
+    __m256i vs = _mm256_add_epi32(_mm256_set1_epi32(v), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(dv)));
+    const __m256i step_u = _mm256_set1_epi32(du * 8), step_v = _mm256_set1_epi32(dv * 8);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i x = clamp_sample_avx2(us, source.width);
+        __m256i y = clamp_sample_avx2(vs, source.height);
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(y, width), x);
+        _mm256_storeu_si256((__m256i*)(out + i * 4), _mm256_i32gather_epi32((const int*)origin, index, 4));
+        us = _mm256_add_epi32(us, step_u);
+        vs = _mm256_add_epi32(vs, step_v);
+    }
+    _mm256_zeroupper(); // The scalar kernel is not VEX encoded, clear the upper halves so it does not stall
+    affine_row_nearest_scalar(out + i * 4, image, source, u + du * i, v + dv * i, du, dv, count - i);
+}
+
+/*
+ * Blends two rows of 4 unpacked 16 bit pixels by a 16 bit weight per channel out of 256, rounding to 8 bits like the scalar kernel
+ */
+__attribute__((target("avx2")))
+static inline __m256i lerp_avx2(__m256i a, __m256i b, __m256i weight) {
+    __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(a, _mm256_sub_epi16(_mm256_set1_epi16(256), weight)), _mm256_mullo_epi16(b, weight));
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(128)), 8);
+}
+
+/*
+ * AVX2 affine sampler, blends the 4 pixels around each position with 8 bit weights, gathering 8 pixels per iteration
+ * Bit identical to the portable kernel, the weights of every pixel are spread over its 4 channels to blend 16 bit lanes
+ */
+__attribute__((target("avx2")))
+static void affine_row_bilinear_avx2(uint8_t* out, const PNG_Image* image, Image_Rect source, int32_t u, int32_t v, int32_t du, int32_t dv, int count) {
+    const uint8_t* origin = image->data + ((size_t)source.y * image->width + source.x) * 4;
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i width = _mm256_set1_epi32(image->width);
+    const __m256i one = _mm256_set1_epi32(65536);
+    const __m256i weight_mask = _mm256_set1_epi32(0xFF);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i us = _mm256_add_epi32(_mm256_set1_epi32(u - 32768), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(du)));
+    __m256i vs = _mm256_add_epi32(_mm256_set1_epi32(v - 32768), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(dv)));
+    const __m256i step_u = _mm256_set1_epi32(du * 8), step_v = _mm256_set1_epi32(dv * 8);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i x0 = clamp_sample_avx2(us, source.width), x1 = clamp_sample_avx2(_mm256_add_epi32(us, one), source.width);
+        __m256i y0 = clamp_sample_avx2(vs, source.height), y1 = clamp_sample_avx2(_mm256_add_epi32(vs, one), source.height);
+        __m256i row0 = _mm256_mullo_epi32(y0, width), row1 = _mm256_mullo_epi32(y1, width);
+        __m256i p00 = _mm256_i32gather_epi32((const int*)origin, _mm256_add_epi32(row0, x0), 4);
+        __m256i p01 = _mm256_i32gather_epi32((const int*)origin, _mm256_add_epi32(row0, x1), 4);
+        __m256i p10 = _mm256_i32gather_epi32((const int*)origin, _mm256_add_epi32(row1, x0), 4);
+        __m256i p11 = _mm256_i32gather_epi32((const int*)origin, _mm256_add_epi32(row1, x1), 4);
+
+        // Each weight is copied into both 16 bit halves of its lane, then each lane is doubled so the 4 channels of a pixel share it
+        __m256i weight_x = _mm256_and_si256(_mm256_srli_epi32(us, 8), weight_mask);
+        __m256i weight_y = _mm256_and_si256(_mm256_srli_epi32(vs, 8), weight_mask);
+        weight_x = _mm256_or_si256(weight_x, _mm256_slli_epi32(weight_x, 16));
+        weight_y = _mm256_or_si256(weight_y, _mm256_slli_epi32(weight_y, 16));
+        __m256i wx_lo = _mm256_unpacklo_epi32(weight_x, weight_x), wx_hi = _mm256_unpackhi_epi32(weight_x, weight_x);
+        __m256i wy_lo = _mm256_unpacklo_epi32(weight_y, weight_y), wy_hi = _mm256_unpackhi_epi32(weight_y, weight_y);
+
+        __m256i upper_lo = lerp_avx2(_mm256_unpacklo_epi8(p00, zero), _mm256_unpacklo_epi8(p01, zero), wx_lo);
+        __m256i upper_hi = lerp_avx2(_mm256_unpackhi_epi8(p00, zero), _mm256_unpackhi_epi8(p01, zero), wx_hi);
+        __m256i lower_lo = lerp_avx2(_mm256_unpacklo_epi8(p10, zero), _mm256_unpacklo_epi8(p11, zero), wx_lo);
+        __m256i lower_hi = lerp_avx2(_mm256_unpackhi_epi8(p10, zero), _mm256_unpackhi_epi8(p11, zero), wx_hi);
+        __m256i result = _mm256_packus_epi16(lerp_avx2(upper_lo, lower_lo, wy_lo), lerp_avx2(upper_hi, lower_hi, wy_hi));
+        _mm256_storeu_si256((__m256i*)(out + i * 4), result);
+
+        us = _mm256_add_epi32(us, step_u);
+        vs = _mm256_add_epi32(vs, step_v);
+    }
+    _mm256_zeroupper(); // The scalar kernel is not VEX encoded, clear the upper halves so it does not stall
+    affine_row_bilinear_scalar(out + i * 4, image, source, u + du * i, v + dv * i, du, dv, count - i);
+}
+#endif
+
+/*
+ * Compact format scaled sampler, takes the nearest pixel like scale_row_nearest, gathering the samples a chunk at a time
+ */
+static void scale_row_nearest_compact(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y, int count) {
+    uint32_t row = (uint32_t)(source.y + nearest_sample(dest_y, source.height, dest_height)) * image->width + source.x;
+    int64_t step = ((int64_t)source.width << 16) / dest_width;
+    int64_t position = step * dest_x + step / 2;
+    uint32_t indices[GATHER_CHUNK_PIXELS];
+    for (int i = 0; i < count; i += GATHER_CHUNK_PIXELS) {
+        int chunk = count - i < GATHER_CHUNK_PIXELS ? count - i : GATHER_CHUNK_PIXELS;
+        for (int j = 0; j < chunk; j++, position += step) {
+            indices[j] = row + (uint32_t)(position >> 16);
+        }
+        png_gather_pixels(image, indices, chunk, out + i * 4);
+    }
+}
+
+/*
+ * Compact format scaled sampler, blends the 4 pixels around every sample like scale_row_bilinear or in linear light
+ * The corners of a chunk of samples are gathered into 4 buffers, then blended with the same math as the RGBA samplers
+ */
+static void scale_row_bilinear_compact_filtered(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y,
+                                                int count, bool linear) {
+    const Linear_Light_Tables* tables = linear ? get_linear_light_tables() : NULL;
+    int64_t step_y = ((int64_t)source.height << 16) / dest_height;
+    int row, weight_y;
+    split_bilinear_position(step_y * dest_y + step_y / 2 - 32768, source.height, &row, &weight_y);
+    uint32_t top = (uint32_t)(source.y + row) * image->width + source.x;
+    uint32_t bottom = weight_y ? top + image->width : top;
+
+    int64_t step_x = ((int64_t)source.width << 16) / dest_width;
+    int64_t position = step_x * dest_x + step_x / 2 - 32768;
+    uint32_t indices[4][GATHER_CHUNK_PIXELS];
+    uint8_t corners[4][GATHER_CHUNK_PIXELS * 4];
+    int weights[GATHER_CHUNK_PIXELS];
+    for (int i = 0; i < count; i += GATHER_CHUNK_PIXELS) {
+        int chunk = count - i < GATHER_CHUNK_PIXELS ? count - i : GATHER_CHUNK_PIXELS;
+        for (int j = 0; j < chunk; j++, position += step_x) {
+            int column;
+            split_bilinear_position(position, source.width, &column, &weights[j]);
+            int next = weights[j] ? 1 : 0; // Clamped pixels blend with themselves
+            indices[0][j] = top + column;
+            indices[1][j] = top + column + next;
+            indices[2][j] = bottom + column;
+            indices[3][j] = bottom + column + next;
+        }
+        for (int k = 0; k < 4; k++) {
+            png_gather_pixels(image, indices[k], chunk, corners[k]);
+        }
+        for (int j = 0; j < chunk; j++) {
+            const uint8_t* c[4] = {corners[0] + j * 4, corners[1] + j * 4, corners[2] + j * 4, corners[3] + j * 4};
+            if (linear) {
+                blend_linear_samples(out + (i + j) * 4, c[0], c[1], c[2], c[3], weights[j], weight_y, image->premultiplied, tables);
+            } else {
+                blend_scaled_samples(out + (i + j) * 4, c[0], c[1], c[2], c[3], weights[j], weight_y);
+            }
+        }
+    }
+}
+
+/*
+ * Compact format scaled sampler matching scale_row_bilinear
+ */
+static void scale_row_bilinear_compact(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y, int count) {
+    scale_row_bilinear_compact_filtered(out, image, source, dest_width, dest_height, dest_x, dest_y, count, false);
+}
+
+/*
+ * Compact format scaled sampler matching scale_row_bilinear_linear
+ */
+static void scale_row_bilinear_linear_compact(uint8_t* out, const PNG_Image* image, Image_Rect source, int dest_width, int dest_height, int dest_x, int dest_y, int count) {
+    scale_row_bilinear_compact_filtered(out, image, source, dest_width, dest_height, dest_x, dest_y, count, true);
+}
+
+/*
+ * Compact format affine sampler for every filter, matching the RGBA samplers
+ * The pixels each chunk of positions needs are gathered into buffers on the stack, then blended with the same math
+ */
+static void affine_row_compact(uint8_t* out, const PNG_Image* image, Image_Rect source, int32_t u, int32_t v, int32_t du, int32_t dv, int count, Scale_Filter filter) {
+    const Linear_Light_Tables* tables = filter == SCALE_BILINEAR_LINEAR ? get_linear_light_tables() : NULL;
+    uint32_t origin = (uint32_t)source.y * image->width + source.x;
+    uint32_t indices[4][GATHER_CHUNK_PIXELS];
+    uint8_t corners[4][GATHER_CHUNK_PIXELS * 4];
+    int weights_x[GATHER_CHUNK_PIXELS], weights_y[GATHER_CHUNK_PIXELS];
+    for (int i = 0; i < count; i += GATHER_CHUNK_PIXELS) {
+        int chunk = count - i < GATHER_CHUNK_PIXELS ? count - i : GATHER_CHUNK_PIXELS;
+        if (filter == SCALE_NEAREST) {
+            for (int j = 0; j < chunk; j++, u += du, v += dv) {
+                indices[0][j] = origin + (uint32_t)clamp_sample(v, source.height) * image->width + clamp_sample(u, source.width);
+            }
+            png_gather_pixels(image, indices[0], chunk, out + i * 4);
+            continue;
+        }
+
+        for (int j = 0; j < chunk; j++, u += du, v += dv) {
+            // Pixel centers sit half a pixel in
+            int32_t left_u = u - 32768, top_v = v - 32768;
+            weights_x[j] = (left_u >> 8) & 0xFF;
+            weights_y[j] = (top_v >> 8) & 0xFF;
+            uint32_t x0 = clamp_sample(left_u, source.width), x1 = clamp_sample(left_u + 65536, source.width);
+            uint32_t y0 = clamp_sample(top_v, source.height), y1 = clamp_sample(top_v + 65536, source.height);
+            indices[0][j] = origin + y0 * image->width + x0;
+            indices[1][j] = origin + y0 * image->width + x1;
+            indices[2][j] = origin + y1 * image->width + x0;
+            indices[3][j] = origin + y1 * image->width + x1;
+        }
+        for (int k = 0; k < 4; k++) {
+            png_gather_pixels(image, indices[k], chunk, corners[k]);
+        }
+        for (int j = 0; j < chunk; j++) {
+            const uint8_t* c[4] = {corners[0] + j * 4, corners[1] + j * 4, corners[2] + j * 4, corners[3] + j * 4};
+            if (tables) {
+                blend_linear_samples(out + (i + j) * 4, c[0], c[1], c[2], c[3], weights_x[j], weights_y[j], image->premultiplied, tables);
+            } else {
+                blend_affine_samples(out + (i + j) * 4, c[0], c[1], c[2], c[3], weights_x[j], weights_y[j]);
+            }
+        }
+    }
+}
+
+/*
+ * Compact format affine sampler matching the nearest samplers
+ */
+static void affine_row_nearest_compact(uint8_t* out, const PNG_Image* image, Image_Rect source, int32_t u, int32_t v, int32_t du, int32_t dv, int count) {
+    affine_row_compact(out, image, source, u, v, du, dv, count, SCALE_NEAREST);
+}
+
+/*
+ * Compact format affine sampler matching the bilinear samplers
+ */
+static void affine_row_bilinear_compact(uint8_t* out, const PNG_Image* image, Image_Rect source, int32_t u, int32_t v, int32_t du, int32_t dv, int count) {
+    affine_row_compact(out, image, source, u, v, du, dv, count, SCALE_BILINEAR);
+}
+
+/*
+ * Compact format affine sampler matching affine_row_bilinear_linear
+ */
+static void affine_row_bilinear_linear_compact(uint8_t* out, const PNG_Image* image, Image_Rect source, int32_t u, int32_t v, int32_t du, int32_t dv, int count) {
+    affine_row_compact(out, image, source, u, v, du, dv, count, SCALE_BILINEAR_LINEAR);
+}
+
+/*
+ * Returns the row sampler of the given filter for sources in the given pixel format, used by the compositor to scale layers while it blends them
+ * RGBA sources are read in place, compact sources are gathered a chunk at a time by samplers of their own, with bit identical output
+ */
+Scale_Row_Function get_scale_row(Scale_Filter filter, Pixel_Format format) {
+    bool compact = format != PIXEL_FORMAT_RGBA;
+    switch (filter) {
+        case SCALE_BILINEAR: return compact ? scale_row_bilinear_compact : scale_row_bilinear;
+        case SCALE_BILINEAR_LINEAR: return compact ? scale_row_bilinear_linear_compact : scale_row_bilinear_linear;
+        case SCALE_NEAREST:
+        default: return compact ? scale_row_nearest_compact : scale_row_nearest;
+    }
+}
+
+/*
+ * Picks the fastest affine samplers the CPU supports, runs once per process
+ */
+static void select_affine_kernels() {
+    affine_kernels[SCALE_NEAREST] = affine_row_nearest_scalar;
+    affine_kernels[SCALE_BILINEAR] = affine_row_bilinear_scalar;
+    affine_kernels[SCALE_BILINEAR_LINEAR] = affine_row_bilinear_linear;
+#ifdef NAGATO_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        affine_kernels[SCALE_NEAREST] = affine_row_nearest_avx2;
+        affine_kernels[SCALE_BILINEAR] = affine_row_bilinear_avx2;
+    }
+#endif
+}
+
+/*
+ * Returns the affine row sampler of the given filter for sources in the given pixel format, used by the compositor to draw transformed layers
+ * Picks an AVX2 kernel which gathers 8 pixels at a time when the CPU supports it, all kernels give bit identical output.
+ * Compact sources are gathered a chunk at a time by samplers of their own, with output identical to their RGBA equivalent.
+ */
+Affine_Row_Function get_affine_row(Scale_Filter filter, Pixel_Format format) {
+    pthread_once(&affine_select_once, select_affine_kernels);
+    if (filter < 0 || filter >= SCALE_FILTER_COUNT) filter = SCALE_NEAREST;
+    if (format != PIXEL_FORMAT_RGBA) {
+        switch (filter) {
+            case SCALE_BILINEAR: return affine_row_bilinear_compact;
+            case SCALE_BILINEAR_LINEAR: return affine_row_bilinear_linear_compact;
+            default: return affine_row_nearest_compact;
+        }
+    }
+    return affine_kernels[filter];
+}
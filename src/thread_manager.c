@@ -8,6 +8,15 @@
 #include "uthash.h"
 #include "function_mapping.h"
 
+/*
+ * Worker tracing is compiled out unless NAGATO_THREAD_DEBUG is defined, it prints several lines per task
+ */
+#ifdef NAGATO_THREAD_DEBUG
+#define pool_log(...) printf(__VA_ARGS__)
+#else
+#define pool_log(...) ((void)0)
+#endif
+
 /*
  * Structure for holding UUIDs and condition variables in a hashmap
  */
@@ -57,7 +66,7 @@ int calc_core_count() {
     } else {
         max_sub_tasks = num_cores/4;
     }
-    printf("cpu cores available: %d\n", num_cores);
+    pool_log("cpu cores available: %d\n", num_cores);
     return num_cores;
 }
 
@@ -65,12 +74,12 @@ int calc_core_count() {
  * Find a condition variable by the uuid, and remove it from the hashmap after retreival
  */
 CondIDPair* find_cond_id_pair(TaskID task_id) {
-    printf("Worker thread %d: searching for condition/id pair\n", worker_thread_number);
+    pool_log("Worker thread %d: searching for condition/id pair\n", worker_thread_number);
     CondIDPair* pair = NULL;
     pthread_mutex_lock(&hashmap_mutex); // Lock the hashmap
     HASH_FIND_PTR(hashmap, task_id, pair); // Retrieve based on TaskID
     pthread_mutex_unlock(&hashmap_mutex);
-    printf("Worker thread %d: found condition/id pair\n", worker_thread_number);
+    pool_log("Worker thread %d: found condition/id pair\n", worker_thread_number);
     return pair; // NULL if not found
 }
 
@@ -111,36 +120,36 @@ void* worker_function(void *arg) {
     // For logging purposes, set up thread IDs
     worker_thread_number = atomic_fetch_add(&thread_counter, 1);
 
-    printf("Worker thread %d: started\n", worker_thread_number);
+    pool_log("Worker thread %d: started\n", worker_thread_number);
 
     while (!atomic_load(&shutdown_flag)) {
-        printf("Worker thread %d: dequeueing task\n", worker_thread_number);
+        pool_log("Worker thread %d: dequeueing task\n", worker_thread_number);
 
         // This function will sleep until something enters the queue
         queue_dequeue_with_id(&pool->task_queue, &task_function, &task_arg, &id); // Gets the task and the id
 
         //printf("Worker thread %d: received \"%s\"\n", worker_thread_number, get_function_name(task_function));
-        printf("Worker thread %d: received a task\n", worker_thread_number); //TODO: make the above work instead
+        pool_log("Worker thread %d: received a task\n", worker_thread_number); //TODO: make the above work instead
 
         task_function(task_arg); // Execute the task
 
-        printf("Worker thread %d: finished task\n", worker_thread_number);
+        pool_log("Worker thread %d: finished task\n", worker_thread_number);
 
         CondIDPair* pair = find_cond_id_pair(id);
         if(pair){
-            printf("Worker thread %d: processing pair\n", worker_thread_number);
+            pool_log("Worker thread %d: processing pair\n", worker_thread_number);
             pthread_mutex_lock(&pair->mutex);
             pthread_cond_signal(&pair->task_complete);
             pthread_mutex_unlock(&pair->mutex);
             remove_cond_id_pair(pair);
             remove_and_destroy_cond_id_pair(&pair);
-            printf("Worker thread %d: signaled task complete\n", worker_thread_number);
+            pool_log("Worker thread %d: signaled task complete\n", worker_thread_number);
         } else { // The pair is null so the wait thread should still see the task completed in this case
-            printf("Worker thread %d: failed to find uuid for finished task in hashmap\n", worker_thread_number);
+            pool_log("Worker thread %d: failed to find uuid for finished task in hashmap\n", worker_thread_number);
         }
     }
 
-    printf("Worker thread %d: closing\n", worker_thread_number);
+    pool_log("Worker thread %d: closing\n", worker_thread_number);
 
     return NULL;
 }
@@ -223,7 +232,6 @@ void add_id_cond_pair(TaskID id){
 TaskID* submit_task(PoolTask* task) {
     // Lazy initialization
     if(atomic_load(&init_flag)){
-        printf("here\n");
         pthread_mutex_lock(&init_mutex);
         if(!thread_pool){
             initialize_thread_pool();
@@ -237,6 +245,7 @@ TaskID* submit_task(PoolTask* task) {
     TaskID* id = malloc(sizeof(uuid_t));
     if(!id){
         perror("allocating id failed");
+        pthread_mutex_unlock(&thread_pool->lock);
         return NULL;
     }
     uuid_generate(*id); // uuid_t*
@@ -329,7 +338,7 @@ void wait_for_task_with_subtask_completion(TaskID id){
  * Flips the shutdown flag to true
  */
 void signal_shutdown(){
-    printf("Worker thread %d: signal shutdown of application\n", worker_thread_number);
+    pool_log("Worker thread %d: signal shutdown of application\n", worker_thread_number);
     atomic_store(&shutdown_flag, true);
 }
 
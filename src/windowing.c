@@ -23,7 +23,10 @@
 Display* d; // Connection to X Server, GUI thread exclusive resource
 Window w; // Window, GUI thread exclusive
 PNG_Image* image; // Image to display in the window
-PNG_Image* background_color; // Image representing a solid color
+Composite_Context* display_context; // Composites the image into the window's XImages, GUI thread exclusive
+
+// Color shown under the transparent parts of the image, as 0xRRGGBB
+#define WINDOW_MATTE 0xFFFFFFu
 
 // Window parameters
 // Should only be directly accessed in the GUI thread
@@ -101,41 +104,68 @@ void process_gui_tasks() {
 }
 
 /*
- * returns an XImage copy of the PNG_Image given as an argument
+ * Returns true if the XImage stores its pixels as blue, green, red and an unused byte, the layout the compositor can write directly
  */
-XImage* png_image_to_ximage(PNG_Image* p) {
-    // Check if the display (d) or PNG_Image (p) pointer is NULL, return NULL to indicate failure
-    if (!d || !p) return NULL;
-
-    // Get the color depth of the default screen of the display 'd'
-    int depth = DefaultDepth(d, 0);
-
-    // Allocate and initialize an XImage structure for the display 'd', using the default visual and the determined depth
-    // Assuming RGBA
-    XImage* image = XCreateImage(d, DefaultVisual(d, 0), depth, ZPixmap, 0, (char*)malloc(p->width * p->height * 4), p->width, p->height, 32, 0);
-
-    // If XCreateImage fails to create the image, return NULL
-    if (!image) return NULL;
+bool is_bgrx_layout(const XImage* ximage) {
+    return ximage->bits_per_pixel == 32 && ximage->byte_order == LSBFirst
+        && ximage->red_mask == 0xFF0000 && ximage->green_mask == 0xFF00 && ximage->blue_mask == 0xFF;
+}
 
+/*
+ * Copies an opaque PNG_Image into an XImage of the same size pixel by pixel, for displays whose layout is not BGRX
+ */
+void copy_png_image_to_ximage(XImage* ximage, const PNG_Image* p) {
     // Iterate over each pixel in the PNG_Image to copy its data to the XImage
     for (int y = 0; y < p->height; y++) {
         for (int x = 0; x < p->width; x++) {
             unsigned long pixel = 0; // Temporary storage for the pixel value
             int idx = (y * p->width + x) * 4; // Calculate the index in the PNG data array (4 bytes per pixel)
 
-            // Construct the pixel value for the XImage from the PNG data, assuming BGRX format for the display
+            // Construct the pixel value for the XImage from the PNG data, XPutPixel converts it to the image's layout
             pixel |= p->data[idx + 2]; // Blue
             pixel |= p->data[idx + 1] << 8; // Green
             pixel |= p->data[idx] << 16; // Red
 
             // The alpha component is not used in XImage.
             // Place the pixel value into the XImage at position (x, y)
-            XPutPixel(image, x, y, pixel);
+            XPutPixel(ximage, x, y, pixel);
         }
     }
+}
+
+/*
+ * Returns an XImage of the given image scaled to the given size with the given filter and flattened onto the window matte
+ * The compositor samples the image while it composites, so no scaled copy is made.
+ * On BGRX displays it writes the XImage pixels directly, matting and converting each tile while it is in cache,
+ * so the frame is never written out as RGBA. Other displays get an RGBA frame converted pixel by pixel.
+ */
+XImage* render_scaled_ximage(PNG_Image* p, int new_width, int new_height, Scale_Filter filter) {
+    // Check if the display (d) or PNG_Image (p) pointer is NULL, return NULL to indicate failure
+    if (!d || !p || new_width <= 0 || new_height <= 0) return NULL;
+
+    // Allocate and initialize an XImage structure for the display 'd', using the default visual and depth, and let it pick the row size
+    XImage* ximage = XCreateImage(d, DefaultVisual(d, 0), DefaultDepth(d, 0), ZPixmap, 0, NULL, new_width, new_height, 32, 0);
+    if (!ximage) return NULL;
+    ximage->data = malloc((size_t)ximage->bytes_per_line * new_height);
+    if (!ximage->data) {
+        XDestroyImage(ximage);
+        return NULL;
+    }
+
+    // Push the image scaled to the window, the first push is the topmost layer
+    context_push_image_scaled(display_context, p, 0, 0, new_width, new_height, filter);
+
+    if (is_bgrx_layout(ximage)) {
+        context_get_flattened_image_into_bgrx(display_context, (unsigned char*)ximage->data, new_width, new_height, ximage->bytes_per_line, WINDOW_MATTE);
+    } else {
+        // The matte becomes the background, then the opaque result is converted
+        context_push_fill_rect(display_context, (WINDOW_MATTE << 8) | 0xFF, 0, 0, new_width, new_height);
+        PNG_Image* matted = context_get_flattened_image(display_context);
+        if (matted) copy_png_image_to_ximage(ximage, matted);
+        png_destroy_image(&matted);
+    }
 
-    // Return the pointer to the newly created XImage
-    return image;
+    return ximage;
 }
 
 /*
@@ -423,19 +453,9 @@ void update_image(PNG_Image* new_image) {
 
                 png_destroy_image(&image); // Destroy the existing image
             }
-            if(background_color != NULL){
-                png_destroy_image(&background_color);
-            }
             // Assume RGBA with 8 bit channel
+            // Transparent parts are matted while the image is drawn, so it is kept as is
             image = dequeue ? new_image : png_copy_image(new_image); // Set the image to be equal to the new image
-
-            // White background color
-            background_color = png_create_image(image->width, image->height, 0xFFFFFF);
-
-            // Blend the background of the image to ensure that the image is opaque
-            PNG_Image* temp = blend_images(background_color, image, 0, 0);
-            png_destroy_image(&image);
-            image = temp;
             image_update_flag = true;
         }
     }
@@ -649,14 +669,9 @@ void start_window_loop() {
     Atom wmDelete = XInternAtom(d, "WM_DELETE_WINDOW", True);
     XSetWMProtocols(d, w, &wmDelete, 1);
 
-    // Load an image into the global variable 'image' from memory
+    // Load an image into the global variable 'image' from memory, it is matted onto white when drawn
     image = png_load_from_memory(resources_nagato_png, resources_nagato_png_len);
-    background_color = png_create_image(image->width, image->height, 0xFFFFFF);
-
-    // Blend the loaded image with a white background
-    PNG_Image* temp = blend_images(background_color, image, 0, 0);
-    png_destroy_image(&image);
-    image = temp;
+    display_context = composite_context_create();
 
     // Main event loop, continues until 'shutdown_flag' is set
     XEvent event;
@@ -716,24 +731,18 @@ void start_window_loop() {
                     new_width = (int)(height * img_aspect);
                 }
 
-                // Scale the image
+                // Scale the image, matte it and convert it to the display's layout
                 XImage* scaled_image = NULL;
                 bool set_default_scaling = false;
 
                 if(atomic_load(&use_nn)){
-                    PNG_Image* temp = nearest_neighbor_scale(image, new_width, new_height);
-                    scaled_image = png_image_to_ximage(temp);
-                    png_destroy_image(&temp);
+                    scaled_image = render_scaled_ximage(image, new_width, new_height, SCALE_NEAREST);
                 } else if(atomic_load(&use_bli)){
-                    PNG_Image* temp = bilinear_interpolation_scale(image, new_width, new_height);
-                    scaled_image = png_image_to_ximage(temp);
-                    png_destroy_image(&temp);
+                    scaled_image = render_scaled_ximage(image, new_width, new_height, SCALE_BILINEAR);
                 } else {
                     perror("No scaling method set");
                     set_default_scaling = true;
-                    PNG_Image* temp = bilinear_interpolation_scale(image, new_width, new_height);
-                    scaled_image = png_image_to_ximage(temp);
-                    png_destroy_image(&temp);
+                    scaled_image = render_scaled_ximage(image, new_width, new_height, SCALE_BILINEAR);
                 }
 
                 // This must be here or there will be a deadlock with aquiring the scaling lock
@@ -741,15 +750,18 @@ void start_window_loop() {
                     set_scaling_bli(); // Fallback to bilinear interpolation if no scaling method was set
                 }
 
-                // Calculate the position to center the image
-                int x_pos = (width - scaled_image->width) / 2;
-                int y_pos = (height - scaled_image->height) / 2;
+                // Nothing to draw into a window too small to hold the image, or if the XImage could not be made
+                if (scaled_image) {
+                    // Calculate the position to center the image
+                    int x_pos = (width - scaled_image->width) / 2;
+                    int y_pos = (height - scaled_image->height) / 2;
 
-                // Display the scaled image in the window
-                XPutImage(d, w, DefaultGC(d, 0), scaled_image, 0, 0, x_pos, y_pos, scaled_image->width, scaled_image->height);
+                    // Display the scaled image in the window
+                    XPutImage(d, w, DefaultGC(d, 0), scaled_image, 0, 0, x_pos, y_pos, scaled_image->width, scaled_image->height);
 
-                // Free resources associated with the scaled XImage
-                XDestroyImage(scaled_image);
+                    // Free resources associated with the scaled XImage
+                    XDestroyImage(scaled_image);
+                }
             }
             image_update_flag = false; // Flip flag back when done
         }
@@ -759,9 +771,7 @@ void start_window_loop() {
     if (image != NULL) {
         png_destroy_image(&image); // Free memory associated with the image
     }
-    if(background_color != NULL){
-        png_destroy_image(&background_color);
-    }
+    composite_context_destroy(&display_context);
 
     queue_destroy(&queue);
 
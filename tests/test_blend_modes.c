@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compositing.h"
+
+/*
+ * Prints a hash of the output of every row kernel, for every blend mode and alpha representation.
+ * make check builds this twice, once with the SIMD kernels and once with NAGATO_NO_SIMD, and compares the two outputs,
+ * so every SIMD kernel is checked against the scalar reference down to the last bit.
+ */
+
+#define MAX_COUNT 70 // Long enough to reach the tails after the widest vectors
+#define ROW_BYTES ((MAX_COUNT + 4) * 4)
+
+static uint32_t random_state = 12345;
+
+/*
+ * Small xorshift generator, so both builds see the same pixels whatever the C library
+ */
+static uint32_t next_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+/*
+ * Fills a row with random pixels, with alpha of 0 and 255 common since kernels take shortcuts for them
+ * Premultiplied rows never have a color above their alpha
+ */
+static void random_row(uint8_t* row, int count, bool premultiplied) {
+    for (int i = 0; i < count; i++) {
+        uint32_t r = next_random();
+        uint8_t alpha = (r & 3) == 0 ? 0 : (r & 3) == 1 ? 255 : (uint8_t)(r >> 8);
+        for (int c = 0; c < 3; c++) {
+            uint8_t color = (uint8_t)next_random();
+            row[i * 4 + c] = premultiplied ? (uint8_t)((color * alpha + 127) / 255) : color;
+        }
+        row[i * 4 + 3] = alpha;
+    }
+}
+
+/*
+ * FNV-1a over a block of bytes, continuing from the given hash
+ */
+static uint64_t hash_bytes(uint64_t hash, const uint8_t* bytes, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Runs a blend kernel over every row length and alignment, plain, modulated and masked
+ */
+static uint64_t hash_blend_kernel(Blend_Mode mode, bool src_premultiplied, bool dst_premultiplied) {
+    Blend_Row_Function blend_row = get_blend_row(mode, src_premultiplied, dst_premultiplied);
+    uint8_t src[ROW_BYTES], dst[ROW_BYTES], mask[MAX_COUNT + 4], factors[4];
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int count = 0; count <= MAX_COUNT; count++) {
+        for (int offset = 0; offset < 4; offset++) {
+            for (int variant = 0; variant < 3; variant++) {
+                random_row(src, MAX_COUNT + 4, src_premultiplied);
+                random_row(dst, MAX_COUNT + 4, dst_premultiplied);
+                for (int i = 0; i < MAX_COUNT + 4; i++) mask[i] = (uint8_t)next_random();
+                get_modulation_factors(factors, (uint8_t)next_random(), next_random() & 0xFFFFFF, src_premultiplied);
+
+                uint8_t* d = dst + offset * 4;
+                const uint8_t* s = src + offset * 4;
+                if (variant == 0) blend_row(d, s, count);
+                else if (variant == 1) blend_row_modulated(blend_row, d, s, count, factors);
+                else blend_row_masked(blend_row, d, s, mask + offset, count, factors, src_premultiplied);
+                hash = hash_bytes(hash, dst, sizeof(dst));
+            }
+        }
+    }
+    return hash;
+}
+
+/*
+ * Runs the kernels which are not blend modes: masking, filling and matting to BGRX
+ */
+static uint64_t hash_other_kernels(bool premultiplied) {
+    uint8_t src[ROW_BYTES], dst[ROW_BYTES], mask[MAX_COUNT + 4];
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int count = 0; count <= MAX_COUNT; count++) {
+        for (int offset = 0; offset < 4; offset++) {
+            random_row(src, MAX_COUNT + 4, premultiplied);
+            random_row(dst, MAX_COUNT + 4, premultiplied);
+            for (int i = 0; i < MAX_COUNT + 4; i++) mask[i] = (uint8_t)next_random();
+
+            mask_row(dst + offset * 4, src + offset * 4, mask + offset, count, premultiplied);
+            hash = hash_bytes(hash, dst, sizeof(dst));
+            fill_row(dst + offset * 4, src, count);
+            hash = hash_bytes(hash, dst, sizeof(dst));
+            matte_row_to_bgrx(dst + offset * 4, src + offset * 4, count, next_random() & 0xFFFFFF, premultiplied);
+            hash = hash_bytes(hash, dst, sizeof(dst));
+        }
+    }
+    return hash;
+}
+
+/*
+ * Composites a rotated layer with every filter, which runs the affine samplers of the scaling module
+ */
+static uint64_t hash_transformed_layers(bool premultiplied) {
+    png_set_premultiplied_loading(premultiplied);
+    PNG_Image* background = png_create_image(64, 48, 0x204060FF);
+    PNG_Image* image = png_create_image(37, 29, 0);
+    png_set_premultiplied_loading(false);
+    if (!background || !image) {
+        png_destroy_image(&background);
+        png_destroy_image(&image);
+        return 0;
+    }
+    random_row(image->data, image->width * image->height, premultiplied);
+    png_update_opaque_region(image);
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (int filter = 0; filter < SCALE_FILTER_COUNT; filter++) {
+        Layer_Transform transform = layer_transform_make(18.5, 14.5, 1.3, 0.8, 0.4 + filter, 31.25, 23.75);
+        push_image_transformed(image, 0, 0, &transform, (Scale_Filter)filter);
+        push_image_raw(background, 0, 0);
+        PNG_Image* flattened = get_flattened_image();
+        if (flattened) {
+            hash = hash_bytes(hash, flattened->data, (size_t)flattened->width * flattened->height * 4);
+            png_destroy_image(&flattened);
+        }
+    }
+
+    png_destroy_image(&background);
+    png_destroy_image(&image);
+    return hash;
+}
+
+int main() {
+    for (int mode = 0; mode < BLEND_MODE_COUNT; mode++) {
+        for (int representation = 0; representation < 4; representation++) {
+            bool src_premultiplied = representation & 1, dst_premultiplied = representation >> 1;
+            printf("blend mode %d src %s dst %s: %016llx\n", mode, src_premultiplied ? "premultiplied" : "straight",
+                   dst_premultiplied ? "premultiplied" : "straight", (unsigned long long)hash_blend_kernel(mode, src_premultiplied, dst_premultiplied));
+        }
+    }
+    for (int premultiplied = 0; premultiplied < 2; premultiplied++) {
+        printf("mask, fill and matte %s: %016llx\n", premultiplied ? "premultiplied" : "straight", (unsigned long long)hash_other_kernels(premultiplied));
+        printf("transformed layers %s: %016llx\n", premultiplied ? "premultiplied" : "straight", (unsigned long long)hash_transformed_layers(premultiplied));
+    }
+    return 0;
+}
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compositing.h"
+
+/*
+ * Behavior checks for the compositor, each returns true when it passes
+ * Run with make check, which exits with an error when any of them fails
+ */
+
+#define SCENE_LAYERS 5
+#define GROUP_CHILDREN 4
+
+// What a retained layer was last told, so a fresh scene can be built from the same state
+typedef struct Layer_State {
+    PNG_Image* image;
+    int x;
+    int y;
+    int z;
+    bool visible;
+} Layer_State;
+
+static uint32_t random_state = 2024;
+
+/*
+ * Small xorshift generator, so the checks see the same layers every run
+ */
+static uint32_t next_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+/*
+ * Creates an image of random straight alpha pixels
+ */
+static PNG_Image* random_image(int width, int height) {
+    PNG_Image* image = png_create_image(width, height, 0);
+    if (!image) return NULL;
+    for (int i = 0; i < width * height * 4; i++) image->data[i] = (uint8_t)next_random();
+    png_update_opaque_region(image);
+    return image;
+}
+
+/*
+ * Returns true if both images have the same size, representation and pixels
+ */
+static bool images_equal(const PNG_Image* a, const PNG_Image* b) {
+    if (!a || !b) return a == b;
+    return a->width == b->width && a->height == b->height && a->premultiplied == b->premultiplied
+        && memcmp(a->data, b->data, (size_t)a->width * a->height * 4) == 0;
+}
+
+/*
+ * Returns true if the flattened scene matches a scene built from scratch out of the same layer state, which redraws the whole canvas
+ * The layers are created in the same order, so layers with the same z tie the same way
+ */
+static bool scene_matches_full_redraw(const PNG_Image* flattened, const Layer_State* states, int count) {
+    Composite_Context* context = composite_context_create();
+    if (!context) return false;
+    Scene_Layer* layers[SCENE_LAYERS];
+    for (int i = 0; i < count; i++) {
+        layers[i] = context_layer_create(context, states[i].image, states[i].x, states[i].y, states[i].z);
+        layer_set_visible(layers[i], states[i].visible);
+    }
+    bool equal = images_equal(flattened, context_get_flattened_scene(context, NULL, NULL));
+    for (int i = 0; i < count; i++) layer_destroy(&layers[i]);
+    composite_context_destroy(&context);
+    return equal;
+}
+
+/*
+ * A premultiplied replace layer which covers a straight alpha background becomes the base of the composite,
+ * its pixels must still be converted to the straight alpha of the flattened image
+ */
+static bool check_replace_base_converts_representation() {
+    PNG_Image* background = png_create_image(8, 8, 0x00FF00FF);
+    png_set_premultiplied_loading(true);
+    PNG_Image* replace = png_create_image(8, 8, 0xFF000080);
+    png_set_premultiplied_loading(false);
+
+    Layer_Options options = LAYER_OPTIONS_DEFAULT;
+    options.blend_mode = BLEND_REPLACE;
+    push_image_with_options(replace, 0, 0, &options);
+    push_image_raw(background, 0, 0);
+    PNG_Image* flattened = get_flattened_image();
+
+    bool passed = flattened && !flattened->premultiplied;
+    for (int i = 0; passed && i < 8 * 8; i++) {
+        const uint8_t* pixel = flattened->data + i * 4;
+        passed = pixel[0] == 255 && pixel[1] == 0 && pixel[2] == 0 && pixel[3] == 128;
+    }
+
+    png_destroy_image(&flattened);
+    png_destroy_image(&background);
+    png_destroy_image(&replace);
+    return passed;
+}
+
+/*
+ * The background of a scene is drawn at the origin wherever it is placed, so moving an offset background,
+ * or another layer becoming the background, must redraw the canvas like a full redraw would
+ */
+static bool check_background_damage() {
+    Layer_State states[2] = {
+        {random_image(40, 30), 7, 5, 0, true},
+        {random_image(20, 20), 12, 9, 1, true},
+    };
+    Scene_Layer* layers[2];
+    for (int i = 0; i < 2; i++) layers[i] = layer_create(states[i].image, states[i].x, states[i].y, states[i].z);
+
+    bool passed = scene_matches_full_redraw(get_flattened_scene(NULL, NULL), states, 2);
+
+    // Moving the background changes nothing, it is still drawn at the origin
+    states[0].x = 3;
+    states[0].y = 11;
+    layer_move(layers[0], states[0].x, states[0].y);
+    passed = passed && scene_matches_full_redraw(get_flattened_scene(NULL, NULL), states, 2);
+
+    // Hiding the background makes the other layer the background, drawn at the origin
+    states[0].visible = false;
+    layer_set_visible(layers[0], false);
+    passed = passed && scene_matches_full_redraw(get_flattened_scene(NULL, NULL), states, 2);
+
+    // Showing it again, then moving it on top, makes it an ordinary layer drawn at its own position
+    states[0].visible = true;
+    layer_set_visible(layers[0], true);
+    passed = passed && scene_matches_full_redraw(get_flattened_scene(NULL, NULL), states, 2);
+    states[0].z = 2;
+    layer_set_z(layers[0], states[0].z);
+    passed = passed && scene_matches_full_redraw(get_flattened_scene(NULL, NULL), states, 2);
+
+    for (int i = 0; i < 2; i++) {
+        layer_destroy(&layers[i]);
+        png_destroy_image(&states[i].image);
+    }
+    return passed;
+}
+
+/*
+ * Random edits to a retained scene, where only the damage is recomposited, must give the same frames as a full redraw
+ */
+static bool check_scene_damage_matches_full_redraw() {
+    Layer_State states[SCENE_LAYERS];
+    Scene_Layer* layers[SCENE_LAYERS];
+    for (int i = 0; i < SCENE_LAYERS; i++) {
+        int width = i == 0 ? 120 : (int)(next_random() % 60) + 20;
+        int height = i == 0 ? 90 : (int)(next_random() % 60) + 20;
+        states[i] = (Layer_State){random_image(width, height), (int)(next_random() % 40), (int)(next_random() % 40), i, true};
+        layers[i] = layer_create(states[i].image, states[i].x, states[i].y, states[i].z);
+    }
+
+    bool passed = true;
+    for (int frame = 0; frame < 200 && passed; frame++) {
+        int k = next_random() % SCENE_LAYERS;
+        Layer_State* state = &states[k];
+        switch (next_random() % 4) {
+            case 0:
+                state->x = (int)(next_random() % 60) - 10;
+                state->y = (int)(next_random() % 60) - 10;
+                layer_move(layers[k], state->x, state->y);
+                break;
+            case 1:
+                state->z = next_random() % 8;
+                layer_set_z(layers[k], state->z);
+                break;
+            case 2:
+                state->visible = !state->visible;
+                layer_set_visible(layers[k], state->visible);
+                break;
+            default: // Changed in place, found through the new generation
+                state->image->data[next_random() % (state->image->width * state->image->height * 4)] ^= 0xFF;
+                png_update_opaque_region(state->image);
+                break;
+        }
+        passed = scene_matches_full_redraw(get_flattened_scene(NULL, NULL), states, SCENE_LAYERS);
+    }
+
+    for (int i = 0; i < SCENE_LAYERS; i++) {
+        layer_destroy(&layers[i]);
+        png_destroy_image(&states[i].image);
+    }
+    return passed;
+}
+
+/*
+ * Flattens a fresh scene of a background with a masked layer on top, which redraws the whole canvas
+ */
+static PNG_Image* flatten_masked_scene(const PNG_Image* background, const PNG_Image* image, const Layer_Options* options) {
+    Composite_Context* context = composite_context_create();
+    if (!context) return NULL;
+    Scene_Layer* base = context_layer_create(context, background, 0, 0, 0);
+    Scene_Layer* masked = context_layer_create(context, image, 10, 6, 1);
+    layer_set_options(masked, options);
+    const PNG_Image* flattened = context_get_flattened_scene(context, NULL, NULL);
+    PNG_Image* copy = flattened ? png_copy_image(flattened) : NULL;
+    layer_destroy(&masked);
+    layer_destroy(&base);
+    composite_context_destroy(&context);
+    return copy;
+}
+
+/*
+ * A mask changed in place gets a new generation, which must damage the retained layer it masks even though its options are unchanged
+ */
+static bool check_mask_change_damage() {
+    PNG_Image* background = random_image(60, 40);
+    PNG_Image* image = random_image(30, 20);
+    PNG_Image* mask = random_image(30, 20);
+    Layer_Options options = LAYER_OPTIONS_DEFAULT;
+    options.mask = mask;
+
+    Scene_Layer* base = layer_create(background, 0, 0, 0);
+    Scene_Layer* masked = layer_create(image, 10, 6, 1);
+    layer_set_options(masked, &options);
+    get_flattened_scene(NULL, NULL);
+
+    bool passed = true;
+    for (int change = 0; change < 20 && passed; change++) {
+        mask->data[next_random() % (mask->width * mask->height * 4)] ^= 0xFF;
+        png_mark_changed(mask);
+        PNG_Image* expected = flatten_masked_scene(background, image, &options);
+        passed = expected && images_equal(get_flattened_scene(NULL, NULL), expected);
+        png_destroy_image(&expected);
+    }
+
+    layer_destroy(&masked);
+    layer_destroy(&base);
+    png_destroy_image(&background);
+    png_destroy_image(&image);
+    png_destroy_image(&mask);
+    return passed;
+}
+
+/*
+ * Pushes a row of small layers over a background, skipping the layer at the given index when it is not below count
+ */
+static void push_layer_row(PNG_Image* const* images, int count, int skipped, const PNG_Image* background) {
+    for (int i = 0; i < count; i++) {
+        if (i != skipped) push_image_raw(images[i], 2 + i * 7, 4);
+    }
+    push_image_raw(background, 0, 0);
+}
+
+/*
+ * Layers are matched by identity between incremental flattens, so inserting or removing a layer in the middle of the stack
+ * must only damage where that layer is drawn, not every layer after it
+ */
+static bool check_inserted_layer_damage() {
+    enum { ROW_LAYERS = 24 };
+    PNG_Image* background = random_image(200, 16);
+    PNG_Image* images[ROW_LAYERS];
+    for (int i = 0; i < ROW_LAYERS; i++) images[i] = random_image(5, 5);
+
+    const Image_Rect* rects;
+    int count;
+    push_layer_row(images, ROW_LAYERS, ROW_LAYERS, background);
+    get_flattened_image_incremental(NULL, NULL);
+
+    // Remove the middle layer, then put it back
+    bool passed = true;
+    for (int skipped = ROW_LAYERS / 2; skipped <= ROW_LAYERS && passed; skipped += ROW_LAYERS / 2) {
+        push_layer_row(images, ROW_LAYERS, skipped, background);
+        const PNG_Image* incremental = get_flattened_image_incremental(&rects, &count);
+        passed = count == 1 && rects[0].x == 2 + ROW_LAYERS / 2 * 7 && rects[0].y == 4 && rects[0].width == 5 && rects[0].height == 5;
+
+        push_layer_row(images, ROW_LAYERS, skipped, background);
+        PNG_Image* expected = get_flattened_image();
+        passed = passed && images_equal(incremental, expected);
+        png_destroy_image(&expected);
+    }
+
+    for (int i = 0; i < ROW_LAYERS; i++) png_destroy_image(&images[i]);
+    png_destroy_image(&background);
+    return passed;
+}
+
+/*
+ * A group surface only refreshes its span index and opaque region where its children changed,
+ * the index must still match one built from scratch and the region must still be opaque
+ */
+static bool check_group_surface_metadata() {
+    PNG_Image* images[GROUP_CHILDREN];
+    Scene_Layer* children[GROUP_CHILDREN];
+    Layer_Group* group = layer_group_create(120, 90);
+    for (int i = 0; i < GROUP_CHILDREN; i++) {
+        images[i] = random_image(16 + i * 6, 12 + i * 4);
+        // Every other child is opaque, so the surface has an opaque region to keep up to date
+        if (i % 2) {
+            for (int p = 0; p < images[i]->width * images[i]->height; p++) images[i]->data[p * 4 + 3] = 255;
+            png_update_opaque_region(images[i]);
+        }
+        children[i] = layer_group_add_image(group, images[i], i * 17, i * 11, i);
+    }
+
+    bool passed = true;
+    for (int change = 0; change < 50 && passed; change++) {
+        layer_move(children[next_random() % GROUP_CHILDREN], next_random() % 110 - 10, next_random() % 80 - 10);
+        const PNG_Image* surface = layer_group_get_surface(group);
+        PNG_Image* rebuilt = png_copy_image(surface);
+        passed = surface->span_index && rebuilt && png_build_span_index(rebuilt);
+
+        const Image_Span_Index* index = passed ? surface->span_index : NULL;
+        passed = passed && !memcmp(index->row_starts, rebuilt->span_index->row_starts, sizeof(int) * (surface->height + 1))
+            && !memcmp(index->spans, rebuilt->span_index->spans, sizeof(Image_Span) * index->row_starts[surface->height]);
+
+        Image_Rect region = surface->opaque_region;
+        for (int y = region.y; y < region.y + region.height && passed; y++) {
+            for (int x = region.x; x < region.x + region.width && passed; x++) {
+                passed = surface->data[((size_t)y * surface->width + x) * 4 + 3] == 255;
+            }
+        }
+        png_destroy_image(&rebuilt);
+    }
+
+    layer_group_destroy(&group);
+    for (int i = 0; i < GROUP_CHILDREN; i++) png_destroy_image(&images[i]);
+    return passed;
+}
+
+int main() {
+    struct {
+        const char* name;
+        bool (*check)();
+    } checks[] = {
+        {"replace base converts representation", check_replace_base_converts_representation},
+        {"background damage", check_background_damage},
+        {"scene damage matches full redraw", check_scene_damage_matches_full_redraw},
+        {"mask change damage", check_mask_change_damage},
+        {"inserted layer damage", check_inserted_layer_damage},
+        {"group surface metadata", check_group_surface_metadata},
+    };
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        bool passed = checks[i].check();
+        printf("%s: %s\n", checks[i].name, passed ? "ok" : "FAILED");
+        if (!passed) failed++;
+    }
+    return failed ? 1 : 0;
+}